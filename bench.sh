@@ -0,0 +1,140 @@
+#!/usr/bin/env bash
+# Benchmark suite for ccsh
+#
+# Every result is printed as one JSON object per line on stdout, so runs can
+# be stored and compared between releases; progress goes to stderr.
+# Input data is generated deterministically under $BENCH_DIR and reused.
+#
+# Environment:
+#   BENCH_DIR      Data directory (default: /tmp/ccsh-bench)
+#   BENCH_GREP_MB  Size of the grep log in MB (default: 1024)
+#   BENCH_FILES    Files in the glob directory (default: 100000)
+#   BENCH_RUNS     Repetitions per measurement; the best run is kept (default: 3)
+
+set -e
+
+CCSH=${CCSH:-./ccsh}
+CCSH="$(cd "$(dirname "$CCSH")" && pwd)/$(basename "$CCSH")"
+BENCH_DIR=${BENCH_DIR:-/tmp/ccsh-bench}
+BENCH_GREP_MB=${BENCH_GREP_MB:-1024}
+BENCH_FILES=${BENCH_FILES:-100000}
+BENCH_RUNS=${BENCH_RUNS:-3}
+
+mkdir -p "$BENCH_DIR"
+
+# Wall clock in seconds with microsecond resolution
+now() {
+    if [ -n "$EPOCHREALTIME" ]; then
+        echo "$EPOCHREALTIME"
+    else
+        date +%s.%N
+    fi
+}
+
+# Best wall time in seconds of BENCH_RUNS runs of a command
+best_time() {
+    local best=""
+    for _ in $(seq "$BENCH_RUNS"); do
+        local start end
+        start=$(now)
+        "$@" > /dev/null
+        end=$(now)
+        best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+            'BEGIN { t = e - s; if (b == "" || t < b) b = t; printf "%.6f", b }')
+    done
+    echo "$best"
+}
+
+# Emit one result line: name, value, unit
+result() {
+    printf '{"bench":"%s","value":%s,"unit":"%s"}\n' "$1" "$2" "$3"
+    echo "  $1: $2 $3" >&2
+}
+
+# Run metadata, so results from different machines are not mixed up
+printf '{"bench":"meta","commit":"%s","os":"%s","arch":"%s","cpus":%s,"runs":%s}\n' \
+    "$(git rev-parse --short HEAD 2>/dev/null || echo unknown)" "$(uname -s)" "$(uname -m)" \
+    "$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)" "$BENCH_RUNS"
+
+echo "Benchmarking ccsh..." >&2
+
+# Cold startup: a whole process that runs nothing
+STARTS=200
+t=$(best_time bash -c "for i in \$(seq $STARTS); do $CCSH -c ''; done")
+result startup_ms "$(awk -v t="$t" -v n="$STARTS" 'BEGIN { printf "%.3f", t * 1000 / n }')" ms
+
+# Trivial external commands through script mode
+COMMANDS=2000
+script="$BENCH_DIR/true.ccsh"
+if [ ! -f "$script" ]; then
+    for i in $(seq $COMMANDS); do echo "/bin/true"; done > "$script"
+fi
+for engine in 1 0; do
+    name=$([ "$engine" = 1 ] && echo spawn || echo fork)
+    t=$(CCSH_SPAWN=$engine best_time "$CCSH" "$script")
+    result "commands_per_sec_$name" "$(awk -v t="$t" -v n="$COMMANDS" 'BEGIN { printf "%.1f", n / t }')" cmds/s
+done
+
+# Alias lookup: 1000 aliases, each line runs one through a no-op builtin
+ALIASES=1000
+LINES=100000
+script="$BENCH_DIR/alias.ccsh"
+if [ ! -f "$script" ]; then
+    {
+        for i in $(seq $ALIASES); do echo "alias a$i='set -o spawn'"; done
+        awk -v n=$LINES -v a=$ALIASES 'BEGIN { srand(42); for (i = 0; i < n; i++) print "a" int(rand() * a) + 1 }'
+    } > "$script"
+fi
+t=$(best_time "$CCSH" "$script")
+result alias_lines_per_sec "$(awk -v t="$t" -v n="$LINES" 'BEGIN { printf "%.1f", n / t }')" lines/s
+
+# Glob expansion over a large directory, timed by the shell's own trace
+dir="$BENCH_DIR/glob"
+if [ ! -f "$dir/.complete-$BENCH_FILES" ]; then
+    echo "  generating $BENCH_FILES files..." >&2
+    rm -rf "$dir"
+    mkdir -p "$dir"
+    (cd "$dir" && seq -f "f%06g.log" "$BENCH_FILES" | xargs touch && touch ".complete-$BENCH_FILES")
+fi
+trace="$BENCH_DIR/glob.trace"
+best_cold="" best_warm=""
+for _ in $(seq "$BENCH_RUNS"); do
+    rm -f "$trace"
+    (cd "$dir" && CCSH_TRACE="$trace" "$CCSH" -c 'true *7.log; true *7.log')
+    read -r cold warm <<< "$(awk '$3 == "glob" { sub("us", "", $2); printf "%s ", $2 }' "$trace")"
+    best_cold=$(awk -v t="$cold" -v b="$best_cold" 'BEGIN { print (b == "" || t < b) ? t : b }')
+    best_warm=$(awk -v t="$warm" -v b="$best_warm" 'BEGIN { print (b == "" || t < b) ? t : b }')
+done
+result glob_cold_ms "$(awk -v t="$best_cold" 'BEGIN { printf "%.3f", t / 1000 }')" ms
+result glob_cached_ms "$(awk -v t="$best_warm" 'BEGIN { printf "%.3f", t / 1000 }')" ms
+
+# Builtin grep throughput on a generated log
+log="$BENCH_DIR/grep-$BENCH_GREP_MB.log"
+if [ ! -f "$log" ]; then
+    echo "  generating ${BENCH_GREP_MB} MB log..." >&2
+    awk 'BEGIN {
+        srand(42)
+        split("INFO INFO INFO DEBUG WARN ERROR", level, " ")
+        split("GET POST PUT DELETE", method, " ")
+        for (i = 0; i < 1048576 / 64; i++)
+            printf "2024-01-%02d %s %s /api/v%d/item/%d %d %dms\n", int(rand() * 28) + 1,
+                level[int(rand() * 6) + 1], method[int(rand() * 4) + 1], int(rand() * 3) + 1,
+                int(rand() * 100000), 200 + int(rand() * 4) * 100, int(rand() * 1000)
+    }' > "$log.chunk"
+    : > "$log"
+    size=0
+    while [ "$size" -lt $((BENCH_GREP_MB * 1048576)) ]; do
+        cat "$log.chunk" "$log.chunk" "$log.chunk" "$log.chunk" >> "$log"
+        size=$(wc -c < "$log")
+    done
+    rm -f "$log.chunk"
+fi
+mb=$(awk -v b="$(wc -c < "$log")" 'BEGIN { printf "%.3f", b / 1048576 }')
+cat "$log" > /dev/null  # Warm the page cache so every variant reads from memory
+for variant in "plain:ERROR" "i:-i error" "v:-v INFO" "c:-c ERROR"; do
+    name=${variant%%:*}
+    t=$(best_time "$CCSH" -c "grep ${variant#*:} $log")
+    result "grep_${name}_mb_per_sec" "$(awk -v t="$t" -v m="$mb" 'BEGIN { printf "%.1f", m / t }')" MB/s
+done
+
+echo "Benchmark complete." >&2
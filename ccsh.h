@@ -0,0 +1,91 @@
+/*
+ * ccsh.h - Parsing core of ccsh as a library
+ *
+ * main.c built with -DCCSH_LIBRARY (make lib) leaves out main() and exposes
+ * the command-line front end: lexing, alias expansion, parsing into
+ * pipelines and glob expansion. Used by the parse microbenchmark and the
+ * fuzz target. Aliases and the directory listing cache are process-wide,
+ * exactly as in the shell.
+ */
+
+#ifndef CCSH_H
+#define CCSH_H
+
+/* Parser state, reused across lines; storage grows to the largest line seen */
+typedef struct CcshParser CcshParser;
+
+/**
+ * Create a parser
+ * @return New parser, or NULL on allocation failure
+ */
+CcshParser* ccsh_parser_new(void);
+
+/**
+ * Free a parser and everything it owns
+ * @param parser Parser (NULL is ignored)
+ */
+void ccsh_parser_free(CcshParser* parser);
+
+/**
+ * Lex, alias-expand and parse one command line
+ * Results stay valid until the next call on the same parser
+ * @param parser Parser
+ * @param line Command line
+ * @return 0 on success, -1 on a syntax error (reported on stderr)
+ */
+int ccsh_parse(CcshParser* parser, const char* line);
+
+/**
+ * Number of pipelines in the last parsed line
+ * @param parser Parser
+ * @return Pipeline count
+ */
+int ccsh_pipeline_count(const CcshParser* parser);
+
+/**
+ * Number of commands across every pipeline of the last parsed line
+ * @param parser Parser
+ * @return Stage count
+ */
+int ccsh_stage_count(const CcshParser* parser);
+
+/**
+ * Arguments of one command, before glob expansion
+ * @param parser Parser
+ * @param stage Index below ccsh_stage_count
+ * @return Null-terminated argument list
+ */
+char** ccsh_stage_argv(const CcshParser* parser, int stage);
+
+/**
+ * Substitute, glob- and brace-expand the arguments of one command
+ * $(...) runs its command, as the shell would
+ * @param parser Parser
+ * @param stage Index below ccsh_stage_count
+ * @return Null-terminated argument list, valid until the next expansion
+ *         on the same parser; NULL on allocation failure
+ */
+char** ccsh_expand_stage(CcshParser* parser, int stage);
+
+/**
+ * Define or replace an alias
+ * @param name Alias name
+ * @param value Replacement text
+ */
+void ccsh_alias_set(const char* name, const char* value);
+
+/**
+ * Remove an alias
+ * @param name Alias name
+ */
+void ccsh_alias_unset(const char* name);
+
+/**
+ * Match a file name against one pattern component (*, ? and [...])
+ * @param pattern Pattern without '/'
+ * @param name File name
+ * @return 1 on match, 0 otherwise
+ */
+int ccsh_glob_match(const char* pattern, const char* name);
+
+#endif /* CCSH_H */
@@ -0,0 +1,104 @@
+/*
+ * fuzz_parse.c - libFuzzer target for the ccsh parse path
+ *
+ * Each input is lexed, alias-expanded and parsed as one command line, and
+ * the part before the first NUL byte is also matched as a glob pattern
+ * against the part after it. Syntax errors are expected and go to stderr;
+ * run with -close_fd_mask=2 to silence them.
+ *
+ *   make fuzz && ./fuzz_parse -close_fd_mask=2 corpus/
+ *
+ * Built with -DFUZZ_STANDALONE instead of -fsanitize=fuzzer, the target
+ * gets a main() that replays the files named on the command line (or each
+ * line of stdin), for compilers without libFuzzer.
+ */
+
+#include <stdio.h>      /* Standalone driver input: fopen, fread, getline */
+#include <stdlib.h>     /* malloc, free */
+#include <string.h>     /* memcpy, memchr */
+#include <stdint.h>     /* uint8_t */
+#include "ccsh.h"       /* Parser under test */
+
+static CcshParser* parser = NULL;
+
+/**
+ * Run one input through the parser and the glob matcher
+ * @param data Input bytes
+ * @param size Number of bytes
+ * @return 0 (inputs are never rejected)
+ */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (!parser) {
+        /* Aliases that recurse, chain through a trailing blank and expand to operators */
+        ccsh_alias_set("ll", "ls -l");
+        ccsh_alias_set("ls", "ls --color");
+        ccsh_alias_set("sudo", "sudo ");
+        ccsh_alias_set("bg", "sleep 1 &");
+        ccsh_alias_set("p", "| cat ;");
+        parser = ccsh_parser_new();
+        if (!parser) return 0;
+    }
+
+    char* text = malloc(size + 1);
+    if (!text) return 0;
+    memcpy(text, data, size);
+    text[size] = '\0';
+
+    /* The parser sees the input up to its first NUL, as it would from a line */
+    if (ccsh_parse(parser, text) == 0) {
+        int stages = ccsh_stage_count(parser);
+        for (int s = 0; s < stages; s++) {
+            char** argv = ccsh_stage_argv(parser, s);
+            for (int i = 0; argv[i]; i++) (void)argv[i][0];
+        }
+    }
+
+    const char* nul = memchr(text, '\0', size);
+    if (nul && !memchr(text, '/', (size_t)(nul - text))) {
+        ccsh_glob_match(text, nul + 1);
+    }
+
+    free(text);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/**
+ * Replay inputs without libFuzzer
+ * @param argc Argument count
+ * @param argv Input files; each line of stdin is an input when none are given
+ * @return 0
+ */
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        char* line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &cap, stdin)) > 0) {
+            LLVMFuzzerTestOneInput((const uint8_t*)line, (size_t)len);
+        }
+        free(line);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE* file = fopen(argv[i], "rb");
+        if (!file) continue;
+        char* buf = NULL;
+        size_t len = 0, cap = 0;
+        size_t n;
+        char chunk[4096];
+        while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            if (len + n > cap) {
+                cap = (len + n) * 2;
+                buf = realloc(buf, cap);
+            }
+            memcpy(buf + len, chunk, n);
+            len += n;
+        }
+        fclose(file);
+        LLVMFuzzerTestOneInput((const uint8_t*)buf, len);
+        free(buf);
+    }
+    return 0;
+}
+#endif
@@ -3,26 +3,54 @@
  * A lightweight Unix-like shell implementation in C
  * 
  * Features:
- * - Interactive command prompt with history
+ * - Interactive command prompt with history, driven by a poll event loop
+ * - Non-interactive -c and script-file execution
  * - Built-in commands (cd, pwd, exit, jobs, fg, alias, unalias, help)
  * - I/O redirection (<, >, >>)
- * - Background job management
- * - Globbing support (*, ?)
+ * - Pipelines (|) with concurrent stages
+ * - Command lists (;, &&, ||) with exit status tracking
+ * - Job control (process group per job, Ctrl+Z, fg and bg)
+ * - Globbing support (*, ?, [...], **, {a,b}, ~)
  * - Alias system
+ * - Command hash table (remembered PATH lookups)
  * - Signal handling (Ctrl+C)
  * 
  */
 
+#define _GNU_SOURCE     /* Linux extensions: splice */
+
 #include <stdio.h>      /* Standard I/O operations: printf, fprintf, perror, fflush */
 #include <stdlib.h>     /* Memory management: malloc, free, exit, atoi */
 #include <string.h>     /* String operations: strcmp, strcpy, strncpy, strtok, strchr, strlen, strcspn */
 #include <unistd.h>     /* POSIX system calls: fork, execvp, chdir, getcwd, dup2, close */
 #include <sys/wait.h>   /* Process control: waitpid, WNOHANG, WIFEXITED */
 #include <fcntl.h>      /* File control: open, O_RDONLY, O_WRONLY, O_CREAT, O_APPEND, O_TRUNC */
-#include <glob.h>       /* Pathname pattern matching: glob, GLOB_TILDE, GLOB_APPEND */
-#include <signal.h>     /* Signal handling: signal, SIGINT, SIG_DFL */
+#include <dirent.h>     /* Directory reading for globbing: readdir, DT_DIR */
+#include <sys/syscall.h> /* Batched directory reads: SYS_getdents64 */
+#include <signal.h>     /* Signal handling: sigaction, SIGINT, SIGTSTP, SIG_DFL */
 #include <errno.h>      /* Error codes and error handling */
 #include <ctype.h>      /* Character classification: tolower */
+#include <limits.h>     /* System limits: PATH_MAX */
+#include <sys/stat.h>   /* File status: stat, S_ISDIR */
+#include <spawn.h>      /* Process spawning: posix_spawn, posix_spawn_file_actions_t */
+#include <sys/mman.h>   /* Memory mapping: mmap, munmap, madvise */
+#include <stdint.h>     /* Fixed-width integers: uint64_t */
+#include <stdarg.h>     /* Formatted builtin output: va_list */
+#include <pthread.h>    /* Threads for parallel grep: pthread_create, mutexes */
+#include <poll.h>       /* Waiting on child output pipes and the prompt's events: poll */
+#include <termios.h>    /* Terminal modes restored after foreground jobs: tcgetattr, tcsetattr */
+#include <sys/uio.h>    /* Gathered writes: writev */
+#include <sys/resource.h> /* Resource usage for time: wait4, getrusage */
+#include <sys/time.h>   /* timeradd, timersub */
+#include <time.h>       /* Monotonic clock: clock_gettime */
+#include "ccsh.h"       /* Library interface, built without main() under CCSH_LIBRARY */
+
+/* Vector instructions for the grep search engine */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>  /* SSE2/AVX2 intrinsics */
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    #include <arm_neon.h>   /* NEON intrinsics */
+#endif
 
 /* Readline library support - cross-platform detection */
 #if defined(__APPLE__) || defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
@@ -38,811 +66,7609 @@
 #endif
 
 /* Constants for shell limits */
-#define MAX_TOKENS 128    /* Maximum number of command arguments */
-#define MAX_JOBS 64       /* Maximum number of background jobs */
-#define MAX_ALIASES 64    /* Maximum number of aliases */
+#define CMD_HASH_SIZE 256 /* Number of buckets in the command hash table */
+#define MAX_STAGES 32     /* Maximum number of commands in a pipeline */
+#define OUTBUF_SIZE 65536 /* Size of the builtin output buffer */
+#define GREP_BUFFER_SIZE (128 * 1024)  /* Minimum size of each read() done by grep */
+#define DFA_MAX_STATES 4096  /* Cached regex DFA states before the cache is reset */
+#define RE_MAX_REPEAT 255    /* Largest bound accepted in {m,n} */
+#define GLOB_CACHE_SIZE 256       /* Buckets in the directory listing cache */
+#define GLOB_CACHE_MAX 4096       /* Cached directories before the cache is dropped */
+#define GLOB_MAX_BRACES 4096      /* Words one brace expression may produce */
+#define GLOB_DIRENT_BUFFER 65536  /* Bytes fetched per getdents64 call */
+#define GLOB_WALK_THREADS 8       /* Most threads listing a ** tree */
+#define HISTORY_COMPACT_MIN (64 * 1024)  /* History file size before stale lines are dropped */
+#define SIGINT_NOTICE "\nUse 'exit' to quit.\n"  /* Shown when Ctrl+C reaches the shell */
+#define BUILTIN_TABLE_SIZE 32     /* Slots in the builtin perfect hash (power of two) */
+#define BUILTIN_MAX_NAME 8        /* Longest builtin name */
+#define BUILTIN_HASH_WEIGHT 14u   /* First-character weight of builtin_slot (see builtin_table_check) */
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
 
 /* Job structure to track background processes */
 typedef struct {
-    pid_t pid;           /* Process ID of the background job */
-    char command[1024];  /* Command string for display */
+    int used;            /* Slot holds a job */
+    int next_free;       /* Next slot on the free list (-1 ends it) */
+    pid_t pid;           /* Process group of the job (the first process started) */
+    pid_t* pids;         /* Every process in the job's pipeline, 0 once reaped */
+    int pid_count;       /* Number of entries in pids */
+    int remaining;       /* Processes not yet reaped */
+    int status;          /* Exit status of the last process, once reaped */
+    int done;            /* Every process has exited; awaiting notification */
+    int stopped;         /* Stopped by a signal (Ctrl+Z, terminal input) */
+    int stop_reported;   /* The stop has been announced */
+    size_t command;      /* Job arena offset of the command string for display */
 } Job;
 
-/* Alias structure to store command aliases */
+/* Slot of the pid to job index */
+typedef struct {
+    pid_t pid;           /* Process ID (0 for an empty slot) */
+    int job;             /* ID of the job the process belongs to */
+} PidSlot;
+
+/* String arena: one growable block, strings addressed by offset */
+typedef struct {
+    char* data;          /* Packed NUL-terminated strings */
+    size_t len;          /* Bytes in use */
+    size_t cap;          /* Bytes allocated */
+    size_t dead;         /* Bytes of strings no longer referenced */
+} StringArena;
+
+/* Environment cache slot, pointing at a NAME=value string of environ */
+typedef struct {
+    const char* entry;   /* Environment string (NULL for an empty slot) */
+    size_t name_len;     /* Length of NAME */
+    unsigned int hash;   /* Hash of NAME */
+} EnvSlot;
+
+/* Alias hash table slot; strings live in the alias arena */
 typedef struct {
-    char name[64];       /* Alias name */
-    char value[1024];    /* Alias value/command */
+    int used;            /* Slot holds an alias */
+    unsigned int hash;   /* Hash of the name */
+    size_t name;         /* Arena offset of the alias name */
+    size_t value;        /* Arena offset of the alias value/command */
 } Alias;
 
+/* One command of a pipeline; arguments live in CommandList.args */
+typedef struct {
+    char** args;             /* Parsed arguments, null-terminated */
+    unsigned char* glob;     /* TOKF_GLOB and TOKF_EXPAND flags of each argument */
+    int first_arg;           /* Index of the first argument in CommandList.args */
+    int argc;                /* Number of arguments */
+    char* infile;            /* Input file for redirection (NULL if none) */
+    char* outfile;           /* Output file for redirection (NULL if none) */
+    int append;              /* 1 for append mode (>>), 0 for truncate (>) */
+} Stage;
+
+/* Token kinds produced by the lexer */
+enum {
+    TOK_WORD,     /* Word, possibly quoted */
+    TOK_LT,       /* < */
+    TOK_GT,       /* > */
+    TOK_APPEND,   /* >> */
+    TOK_AMP,      /* & */
+    TOK_PIPE,     /* | */
+    TOK_SEMI,     /* ; or newline */
+    TOK_AND,      /* && */
+    TOK_OR        /* || */
+};
+
+#define TOKF_QUOTED 1  /* Word contained quotes or escapes */
+#define TOKF_GLOB   2  /* Word contains unquoted *, ?, [ or {, or starts with ~ */
+#define TOKF_EXPAND 4  /* Word contains $ substitutions (CTL_EXPAND markers) */
+
+/* Substitution markers the lexer leaves in words: CTL_EXPAND, a kind
+   character, the variable name or raw command text, then CTL_END */
+#define CTL_EXPAND '\001'
+#define CTL_END    '\002'
+/* Precedes a quoted character that globbing and brace expansion must take
+   literally; kept only in words with TOKF_GLOB or TOKF_EXPAND */
+#define CTL_QUOTE  '\003'
+#define CTL_QUOTE_CHARS "*?[]{},~!^-"
+#define EXP_VAR    'v'   /* $NAME, ${NAME}, $? or $$ */
+#define EXP_CMD    'c'   /* $(command) */
+#define EXP_UNQUOTED 0x20  /* Set in the kind outside double quotes; clear inside: 'V', 'C' */
+
+/* One lexed token */
+typedef struct {
+    int kind;            /* TOK_* */
+    int flags;           /* TOKF_* (words only) */
+    size_t start;        /* Offset of the token in the command line (alias tokens
+                            inherit the span of the word they replaced) */
+    size_t len;          /* Length of the token in the command line */
+    size_t word;         /* Offset of the unquoted word in TokenList.words */
+} Token;
+
+/* Token stream for one command line; storage is reused across lines */
+typedef struct {
+    Token* tokens;       /* Tokens in source order */
+    int count;           /* Tokens in use */
+    int cap;             /* Tokens allocated */
+    char* words;         /* Unquoted, NUL-terminated words */
+    size_t words_len;    /* Bytes of words in use */
+    size_t words_cap;    /* Bytes of words allocated */
+    Token* scratch;      /* Staging area for alias splicing */
+    int scratch_cap;     /* Tokens allocated in scratch */
+} TokenList;
+
+/* One pipeline of a command list */
+typedef struct {
+    int first;           /* Index of the first stage in CommandList.stages */
+    int count;           /* Number of stages */
+    int background;      /* Run as a background job */
+    int connector;       /* TOK_SEMI, TOK_AND or TOK_OR joining it to the previous pipeline */
+    int timed;           /* Prefixed with the time keyword */
+    size_t text_start;   /* Source span of the pipeline, for job display */
+    size_t text_end;
+} Pipeline;
+
+/* Parsed command line: pipelines joined by ;, &, && and || */
+typedef struct {
+    Stage* stages;       /* Stages of every pipeline */
+    int stage_count;     /* Stages in use */
+    int stage_cap;       /* Stages allocated */
+    Pipeline* pipelines; /* Pipelines in source order */
+    int count;           /* Pipelines in use */
+    int cap;             /* Pipelines allocated */
+    char** args;         /* Null-terminated argument vectors of every stage, back to back */
+    unsigned char* arg_glob;  /* TOKF_GLOB and TOKF_EXPAND flags of each entry in args */
+    int arg_count;       /* Entries in use, terminators included */
+    int arg_cap;         /* Entries allocated */
+} CommandList;
+
+/* Cached listing of one directory */
+typedef struct DirListing {
+    char* path;              /* Directory as written in the pattern ("" for .) */
+    char* names;             /* Entry names, NUL-separated */
+    size_t names_len;        /* Bytes of names in use */
+    size_t* offsets;         /* Start of each name in names */
+    unsigned char* types;    /* d_type of each entry (DT_UNKNOWN if not reported) */
+    int count;               /* Number of entries */
+    struct timespec mtime;   /* Directory mtime when read */
+    struct timespec ctime;   /* Directory ctime when read */
+    int batch;               /* Expansion that last read or validated it */
+    int error;               /* Directory could not be read */
+    struct DirListing* next; /* Next listing in the hash bucket */
+} DirListing;
+
+/* Growable list of heap-allocated paths */
+typedef struct {
+    char** items;            /* Paths */
+    int count;               /* Paths in use */
+    int cap;                 /* Paths allocated */
+} GlobPaths;
+
+/* Candidates of the last tab completion, refined while the word grows */
+typedef struct {
+    GlobPaths matches;       /* Candidates as they replace the word, sorted */
+    char* text;              /* Word the candidates were filtered for */
+    size_t dir_len;          /* Length of the directory part of text */
+    int command;             /* Completed as a command name instead of a path */
+    int batch;               /* glob_batch the listings were valid for */
+    int next;                /* Next candidate handed to readline */
+} Completion;
+
+/* Shared state of a parallel ** directory walk */
+typedef struct {
+    GlobPaths queue;         /* Directories waiting to be listed */
+    int active;              /* Workers currently listing a directory */
+    pthread_mutex_t lock;    /* Protects queue and active */
+    pthread_cond_t cond;     /* Signalled when work arrives or the walk ends */
+} GlobWalk;
+
+/* Expanded argument vector: words and glob matches packed in one block */
+typedef struct {
+    char* data;              /* NUL-terminated arguments */
+    size_t len;              /* Bytes in use */
+    size_t cap;              /* Bytes allocated */
+    size_t* offsets;         /* Offset of each argument while the block may still move */
+    char** argv;             /* Null-terminated argument list, valid after expansion */
+    int count;               /* Arguments in use */
+    int argv_cap;            /* Entries allocated in offsets and argv */
+} ArgvArena;
+
+/* Everything needed to launch one command */
+typedef struct {
+    char** argv;           /* Null-terminated argument list */
+    const char* resolved;  /* Full path from the command hash (NULL to search PATH) */
+    const char* infile;    /* Input file for redirection (NULL if none) */
+    const char* outfile;   /* Output file for redirection (NULL if none) */
+    int append;            /* 1 for append mode (>>), 0 for truncate (>) */
+    int in_fd;             /* Pipe end to use as stdin (-1 if none) */
+    int out_fd;            /* Pipe end to use as stdout (-1 if none) */
+    pid_t pgid;            /* Process group to join (0 to lead a new one) */
+} LaunchSpec;
+
+/* Starting point of a pipeline measured with time */
+typedef struct {
+    uint64_t start;          /* Monotonic clock in nanoseconds */
+    struct rusage self;      /* Shell's own usage */
+} TimeSample;
+
+/* Descriptors a builtin reads from and writes to */
+typedef struct {
+    int in_fd;             /* Standard input */
+    int out_fd;            /* Standard output */
+    int err_fd;            /* Standard error */
+    struct OutBuf* out;    /* Buffered writer on out_fd, set by run_builtin unless
+                              the caller supplies one (command substitution) */
+} IoCtx;
+
+/* Builtin handler: argument count, null-terminated arguments, descriptors */
+typedef int (*BuiltinHandler)(int argc, char** argv, IoCtx* io);
+
+/* Builtin flags */
+#define BUILTIN_STATE 1    /* Changes shell state, so it must run in the shell itself */
+#define BUILTIN_SNAPSHOT 2 /* All its effects are captured by the rc snapshot */
+#define BUILTIN_CAPTURE 4  /* Writes only through io->out, so $(...) captures it in memory */
+#define BUILTIN_JOB 8      /* Waits on children of its own, so under job control it runs as a job */
+
+/* Entry of the builtin dispatch table */
+typedef struct {
+    const char* name;        /* Command name (NULL for an empty slot) */
+    BuiltinHandler handler;  /* Implementation */
+    int flags;               /* BUILTIN_* flags */
+} Builtin;
+
+/* Output buffer shared by builtins and used for captured output */
+typedef struct OutBuf {
+    int fd;                   /* Destination file descriptor (-1 to capture in memory) */
+    int tty;                  /* Destination is a terminal: flush at each newline */
+    size_t len;               /* Bytes currently buffered */
+    char* heap;               /* Captured output when fd is -1 */
+    size_t heap_len;          /* Bytes captured */
+    size_t heap_cap;          /* Allocated size of heap */
+    char data[OUTBUF_SIZE];   /* Pending output */
+} OutBuf;
+
+/* Reader handing out blocks of whole lines from any descriptor */
+typedef struct {
+    int fd;          /* Source file descriptor */
+    char* buf;       /* Growable read buffer (streams only) */
+    size_t cap;      /* Allocated size of buf */
+    size_t start;    /* Offset of the carried partial line */
+    size_t end;      /* Offset one past the last valid byte */
+    int eof;         /* Set once the input is exhausted */
+    char* map;       /* Memory mapping of a regular file (NULL if streaming) */
+    size_t map_len;  /* Length of map */
+    int streaming;   /* Set when reads may block (pipes, terminals) */
+} ChunkReader;
+
+/* One file of a parallel grep */
+typedef struct {
+    const char* filename;   /* File to search */
+    OutBuf* out;            /* Captured results until written */
+    int error;              /* Set if the file could not be opened */
+    long selected;          /* Lines selected in the file */
+    int done;               /* Set once the search has finished */
+} GrepTask;
+
+/* Fixed-string matcher prepared once per pattern */
+typedef struct Matcher {
+    const char* pattern;    /* Fixed string to search for */
+    size_t len;             /* Length of pattern */
+    int case_insensitive;   /* Compare with ASCII case folding */
+    unsigned char first_lo, first_up;  /* First pattern byte in both cases */
+    unsigned char last_lo, last_up;    /* Last pattern byte in both cases */
+    const char* (*find)(const struct Matcher*, const char*, size_t);  /* Search routine for this CPU */
+} Matcher;
+
+/* Aho-Corasick automaton for several fixed strings searched at once */
+typedef struct {
+    int* next;              /* node_count * 256 transitions (failure links resolved) */
+    unsigned char* terminal;/* Set if a pattern ends at the node or a suffix of it */
+    int node_count, cap;    /* Nodes used and allocated */
+    int case_insensitive;   /* Transitions ignore ASCII case */
+    int has_empty;          /* An empty pattern matches every line */
+} AhoCorasick;
+
+/* NFA state types for compiled regular expressions */
+enum { RE_STATE_SET, RE_STATE_SPLIT, RE_STATE_BOL, RE_STATE_EOL, RE_STATE_MATCH };
+
+/* One NFA state */
+typedef struct {
+    int type;               /* RE_STATE_* */
+    int out, out1;          /* Successor states (out1 only for splits) */
+    int set;                /* Byte set consumed by RE_STATE_SET */
+} RegexState;
+
+/* Extended regular expression compiled to an NFA (read-only once built) */
+typedef struct {
+    RegexState* states;     /* NFA states */
+    int state_count, state_cap;
+    unsigned char (*sets)[32];  /* 256-bit byte sets */
+    int set_count, set_cap;
+    int start;              /* Entry state */
+    int case_insensitive;   /* Sets were built with both cases */
+} RegexProgram;
+
+/* Lazily built DFA over a RegexProgram; states are created on first use */
+typedef struct {
+    const RegexProgram* prog;  /* Program being simulated */
+    int* trans;             /* DFA_MAX_STATES * 256 transitions (-1 = not built yet) */
+    int* set_offset;        /* Start of each state's NFA set in pool */
+    int* set_len;           /* Length of each state's NFA set */
+    unsigned char* accepting;  /* State contains the match state */
+    signed char* eol_accept;   /* State matches at end of line (-1 = unknown) */
+    int* pool;              /* Sorted NFA state lists of all DFA states */
+    int pool_len, pool_cap;
+    int* table;             /* Open-addressing index from NFA set to DFA state */
+    int table_size;
+    int state_count;        /* DFA states built */
+    int start;              /* State at the start of a line (-1 = not built) */
+    unsigned int generation;/* Bumped whenever the cache is reset */
+    unsigned int* marks;    /* Closure visit marks, one per NFA state */
+    unsigned int mark_gen;  /* Current mark value */
+    int* stack;             /* Closure work stack */
+    int* scratch;           /* Closure result */
+    int* seeds;             /* Closure input */
+} Dfa;
+
+/* Search engines available to grep */
+enum { SEARCH_FIXED, SEARCH_MULTI, SEARCH_REGEX };
+
+/* Pattern search engine selected from the grep options */
+typedef struct {
+    int kind;               /* SEARCH_* */
+    Matcher fixed;          /* Single fixed string */
+    AhoCorasick* multi;     /* Several fixed strings (-e ... -e ...) */
+    RegexProgram* prog;     /* Extended regex program (-E) */
+    Dfa* dfa;               /* DFA for prog (one per searching thread) */
+} Searcher;
+
+/* Options controlling a grep search */
+typedef struct {
+    Searcher searcher;      /* Prepared pattern(s) (carries -i) */
+    int show_line_numbers;  /* -n */
+    int invert_match;       /* -v */
+    int count_only;         /* -c */
+    int show_filename;      /* Prefix lines with the file name */
+    int in_fd;              /* Descriptor searched when no file is named */
+} GrepOptions;
+
+/* Work queue shared by parallel grep workers */
+typedef struct {
+    GrepTask* tasks;        /* One task per file, in argument order */
+    int count;              /* Number of tasks */
+    int next;               /* Next task to claim */
+    int written;            /* Tasks whose output has been written (ordered mode) */
+    int window;             /* How far workers may run ahead of the writer */
+    int unordered;          /* Write results in completion order */
+    struct OutBuf* out;     /* Destination of every file's results */
+    const GrepOptions* opts;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} GrepPool;
+
+/* One command run by the parallel builtin */
+typedef struct {
+    pid_t pid;           /* Child process (-1 if it could not be started) */
+    int out_fd;          /* Read end of the child's stdout pipe (-1 once closed) */
+    OutBuf* out;         /* Output held until it may be written (NULL if none) */
+    int status;          /* Exit status once done */
+    int done;            /* Child exited and its output is complete */
+} ParallelTask;
+
+/* Command hash entry caching the resolved location of a command */
+typedef struct CmdHashEntry {
+    char* name;                 /* Command name as typed */
+    char* path;                 /* Full path found in PATH */
+    unsigned int hits;          /* Number of times the entry was used */
+    struct CmdHashEntry* next;  /* Next entry in the same bucket */
+} CmdHashEntry;
+
 /* Global variables for job and alias management */
-Job jobs[MAX_JOBS];
-int job_count = 0;
+Job* jobs = NULL;        /* Job table, indexed by job ID */
+int job_capacity = 0;    /* Slots allocated */
+int job_count = 0;       /* Jobs currently tracked */
+int job_slots_used = 0;  /* Slots ever handed out; the rest are untouched */
+int job_free = -1;       /* Head of the free slot list */
+int job_current = -1;    /* Job fg and bg act on by default: the latest started or stopped */
+StringArena job_arena;   /* Storage for job command strings */
+int sigchld_pipe[2] = { -1, -1 };  /* Self-pipe written by the SIGCHLD handler */
+PidSlot* pid_index = NULL;  /* Open-addressing map from live pids to job IDs */
+size_t pid_index_cap = 0;   /* Slots in pid_index (power of two) */
+size_t pid_index_count = 0; /* Pids currently indexed */
 
-Alias aliases[MAX_ALIASES];
+Alias* aliases = NULL;       /* Open-addressing table, grown on demand */
+size_t alias_capacity = 0;   /* Number of slots (power of two) */
 int alias_count = 0;
+StringArena alias_arena;     /* Storage for alias names and values */
+
+/* Variable lookups for $NAME, rebuilt from environ after it changes */
+EnvSlot* env_cache = NULL;   /* Open-addressing table */
+size_t env_cache_cap = 0;    /* Number of slots (power of two) */
+int env_cache_valid = 0;     /* Cleared by every setenv and unsetenv */
+
+/* Global variables for the command hash table */
+CmdHashEntry* cmd_hash[CMD_HASH_SIZE];
+int cmd_hash_count = 0;
+char* cmd_hash_path = NULL;  /* PATH value the table was filled from */
+
+/* History state: entries are appended to the file as they are entered */
+char* history_path = NULL;   /* $HISTFILE or ~/.ccsh_history */
+int history_fd = -1;         /* Append-only descriptor, opened on first entry */
+int history_size = 1000;     /* $HISTSIZE: entries kept in memory */
+char* history_last = NULL;   /* Most recent entry, for consecutive dedup */
+
+/* Instrumentation: the CCSH_TRACE log and the usage of children reaped for time */
+OutBuf* trace_out = NULL;    /* Buffered trace log (NULL when tracing is off) */
+uint64_t trace_epoch = 0;    /* Clock at startup; trace lines are relative to it */
+struct rusage child_usage;   /* Usage summed over children reaped since time_begin */
+
+/* While ~/.ccshrc runs: 1 as long as its effects fit in a snapshot, -1 otherwise */
+int rc_cacheable = -1;
+
+/* Directory listings read for globbing */
+DirListing* dir_cache[GLOB_CACHE_SIZE];
+int dir_cache_count = 0;
+int glob_batch = 0;  /* Incremented for every expansion */
+pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Expanded arguments of the command being launched, reused across commands */
+ArgvArena shell_argv;
+
+/* Output buffer of the running builtin, rebound to its descriptor on every run */
+OutBuf builtin_out;
+
+/* Shell options toggled with set -o / set +o */
+int opt_spawn = 1;  /* Launch simple commands with posix_spawn instead of fork */
+int opt_globcache = 0;  /* Keep directory listings across command lines */
+
+typedef struct {
+    const char* name;  /* Option name used with set -o */
+    int* value;        /* Pointer to the option flag */
+} ShellOption;
+
+ShellOption shell_options[] = {
+    { "spawn", &opt_spawn },
+    { "globcache", &opt_globcache },
+    { NULL, NULL }
+};
+
+/* Exit status of the last foreground pipeline */
+int last_status = 0;
+int exit_requested = 0;  /* Set by the exit builtin */
+
+/* Job control state, enabled only for interactive shells owning the terminal */
+int interactive = 0;  /* Reading commands from a terminal; job notifications are printed */
+int job_control = 0;
+pid_t shell_pgid = 0;
+
+struct termios shell_tmodes;  /* Terminal modes of the shell, restored after each foreground job */
+
+/* Signal state: handlers only record signals; the main loop acts on them */
+int signal_pipe[2] = { -1, -1 };  /* Self-pipe waking the prompt loop */
+volatile sig_atomic_t sigint_pending = 0;  /* Ctrl+C reached the shell itself */
+
+extern char** environ;
+
+/* Working directory cache, refreshed by cd instead of calling getcwd per prompt */
+char shell_cwd[PATH_MAX];         /* Current directory ("" if unknown) */
+int shell_cwd_valid = 0;          /* Set once shell_cwd and the prompt are computed */
+char prompt_cache[PATH_MAX + 16]; /* Prompt with the home directory shortened to ~ */
 
 /* Function declarations */
-void generate_prompt(char* prompt, size_t prompt_size);
+const char* generate_prompt();
+const Builtin* find_builtin(const char* name);
+int run_builtin(const Builtin* builtin, char** argv, IoCtx* io);
+void set_cloexec(int fd);
+int decode_status(int status);
+void outbuf_write(OutBuf* out, const char* data, size_t len);
+void outbuf_flush(OutBuf* out);
+void outbuf_init(OutBuf* out, int fd);
+void outbuf_printf(OutBuf* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void outbuf_puts(OutBuf* out, const char* s);
+size_t arena_add(StringArena* arena, const char* s);
+void arena_release(StringArena* arena, size_t offset);
+void job_index(int id);
+int is_builtin(const char* name);
+void outbuf_init_capture(OutBuf* out);
+void outbuf_append(OutBuf* out, const OutBuf* captured);
+void outbuf_release(OutBuf* out);
+int expand_word(const char* word, int split, GlobPaths* fields, int* glob);
+int expand_alias(TokenList* list);
+int parse_list(const TokenList* list, CommandList* cmds);
+void command_list_init(CommandList* cmds);
+void command_list_free(CommandList* cmds);
+int run_line(TokenList* tokens, CommandList* cmds, const char* line);
+void trace_forked();
+void trace_flush();
+
+/**
+ * Forward a signal to the prompt loop through the self-pipe
+ * @param sig Signal number, sent as the byte written
+ */
+void signal_forward_handler(int sig) {
+    int saved_errno = errno;
+    char byte = (char)sig;
+    if (write(signal_pipe[1], &byte, 1) == -1) {
+        /* Pipe full: the loop is already due to wake up */
+    }
+    errno = saved_errno;
+}
 
-/* Signal handler for Ctrl+C (SIGINT) */
+/**
+ * Signal handler for Ctrl+C (SIGINT): only sets a flag and wakes the loop
+ * Installed without SA_RESTART, so a builtin blocked in a system call sees
+ * EINTR and can stop; the prompt loop discards the line being edited
+ * @param sig Signal number
+ */
 void sigint_handler(int sig) {
-    (void)sig;  /* Suppress unused parameter warning */
-    char prompt[1024];
-    generate_prompt(prompt, sizeof(prompt));
-    printf("\nUse 'exit' to quit.\n%s", prompt);
-    fflush(stdout);  /* Ensure prompt is displayed immediately */
+    sigint_pending = 1;
+    if (signal_pipe[1] != -1) signal_forward_handler(sig);
 }
 
 /* Job management functions */
 
 /**
- * Add a new background job to the job list
- * @param pid Process ID of the job
- * @param cmd Command string for display
+ * SIGCHLD handler: only records that children changed state
+ * The actual reaping happens in check_background_jobs
+ * @param sig Signal number (unused)
  */
-void add_job(pid_t pid, const char* cmd) {
-    if (job_count < MAX_JOBS) {
-        jobs[job_count].pid = pid;
-        strncpy(jobs[job_count].command, cmd, sizeof(jobs[job_count].command) - 1);
-        jobs[job_count].command[sizeof(jobs[job_count].command) - 1] = '\0';
-        job_count++;
+void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    char byte = 0;
+    if (write(sigchld_pipe[1], &byte, 1) == -1) {
+        /* Pipe full: a wakeup is already pending */
     }
+    errno = saved_errno;
 }
 
 /**
- * Check for completed background jobs and remove them from the list
- * Uses waitpid with WNOHANG to check without blocking
+ * Set up the SIGCHLD self-pipe the first time a background job starts
+ * Shells that never background anything skip this entirely
  */
-void check_background_jobs() {
-    for (int i = 0; i < job_count; i++) {
-        int status;
-        pid_t result = waitpid(jobs[i].pid, &status, WNOHANG);
-        if (result > 0) {
-            printf("[done] %s\n", jobs[i].command);
-            /* Remove completed job by shifting remaining jobs */
-            for (int j = i; j < job_count - 1; j++) {
-                jobs[j] = jobs[j + 1];
-            }
-            job_count--;
-            i--;  /* Recheck current index since jobs shifted */
-        }
+void jobs_init() {
+    if (sigchld_pipe[0] != -1) return;
+    if (pipe(sigchld_pipe) == -1) return;
+    for (int i = 0; i < 2; i++) {
+        set_cloexec(sigchld_pipe[i]);
+        fcntl(sigchld_pipe[i], F_SETFL, fcntl(sigchld_pipe[i], F_GETFL) | O_NONBLOCK);
     }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;  /* Stops and continues are reported too */
+    sigaction(SIGCHLD, &sa, NULL);
 }
 
 /**
- * Display all current background jobs
+ * Home slot of a pid in the pid index
+ * @param pid Process ID
+ * @return Slot index
  */
-void list_jobs() {
-    if (job_count == 0) {
-        printf("No background jobs.\n");
-        return;
-    }
-    for (int i = 0; i < job_count; i++) {
-        printf("[%d] %d %s\n", i, jobs[i].pid, jobs[i].command);
+static size_t pid_index_home(pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & (pid_index_cap - 1);
+}
+
+/**
+ * Look up the job a process belongs to
+ * @param pid Process ID
+ * @return Job ID, or -1 if the pid is not tracked
+ */
+int pid_index_find(pid_t pid) {
+    if (pid_index_count == 0) return -1;
+    for (size_t i = pid_index_home(pid); pid_index[i].pid != 0; i = (i + 1) & (pid_index_cap - 1)) {
+        if (pid_index[i].pid == pid) return pid_index[i].job;
     }
+    return -1;
 }
 
-/* Alias management functions */
+/**
+ * Map a pid to its job, growing the index to stay at most half full
+ * @param pid Process ID
+ * @param job Job ID
+ */
+void pid_index_insert(pid_t pid, int job) {
+    if ((pid_index_count + 1) * 2 > pid_index_cap) {
+        PidSlot* old = pid_index;
+        size_t old_cap = pid_index_cap;
+        size_t cap = old_cap ? old_cap * 2 : 64;
+        PidSlot* grown = calloc(cap, sizeof(PidSlot));
+        if (!grown) return;
+        pid_index = grown;
+        pid_index_cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].pid == 0) continue;
+            size_t slot = pid_index_home(old[i].pid);
+            while (pid_index[slot].pid != 0) slot = (slot + 1) & (cap - 1);
+            pid_index[slot] = old[i];
+        }
+        free(old);
+    }
+    size_t slot = pid_index_home(pid);
+    while (pid_index[slot].pid != 0 && pid_index[slot].pid != pid) {
+        slot = (slot + 1) & (pid_index_cap - 1);
+    }
+    if (pid_index[slot].pid == 0) pid_index_count++;
+    pid_index[slot].pid = pid;
+    pid_index[slot].job = job;
+}
 
 /**
- * Add or update an alias
- * @param name Alias name
- * @param value Alias value/command
+ * Drop a pid from the index
+ * Later entries of the probe run are shifted back so lookups stay correct
+ * @param pid Process ID
  */
-void add_alias(const char* name, const char* value) {
-    /* Check if alias already exists and update it */
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            strncpy(aliases[i].value, value, sizeof(aliases[i].value) - 1);
-            aliases[i].value[sizeof(aliases[i].value) - 1] = '\0';
-            return;
+void pid_index_remove(pid_t pid) {
+    if (pid_index_count == 0) return;
+    size_t mask = pid_index_cap - 1;
+    size_t hole = pid_index_home(pid);
+    while (pid_index[hole].pid != pid) {
+        if (pid_index[hole].pid == 0) return;
+        hole = (hole + 1) & mask;
+    }
+    pid_index_count--;
+
+    for (size_t i = (hole + 1) & mask; pid_index[i].pid != 0; i = (i + 1) & mask) {
+        size_t home = pid_index_home(pid_index[i].pid);
+        /* Move the entry if the hole lies between its home and its slot */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            pid_index[hole] = pid_index[i];
+            hole = i;
         }
     }
-    /* Add new alias if space available */
-    if (alias_count < MAX_ALIASES) {
-        strncpy(aliases[alias_count].name, name, sizeof(aliases[alias_count].name) - 1);
-        aliases[alias_count].name[sizeof(aliases[alias_count].name) - 1] = '\0';
-        strncpy(aliases[alias_count].value, value, sizeof(aliases[alias_count].value) - 1);
-        aliases[alias_count].value[sizeof(aliases[alias_count].value) - 1] = '\0';
-        alias_count++;
-    } else {
-        fprintf(stderr, "Alias limit reached.\n");
+    pid_index[hole].pid = 0;
+}
+
+/**
+ * Remove a job's unreaped processes from the pid index
+ * @param job Job
+ */
+void job_unindex(Job* job) {
+    for (int k = 0; k < job->pid_count; k++) {
+        if (job->pids[k] > 0) pid_index_remove(job->pids[k]);
     }
 }
 
 /**
- * Remove an alias by name
- * @param name Name of alias to remove
+ * Add a new background job to the job list
+ * Slots come from a free list, so a job keeps its ID until it is gone;
+ * the table grows without limit
+ * @param pids Process IDs of the job's pipeline stages (0 for ones already gone)
+ * @param count Number of processes
+ * @param pgid Process group of the job
+ * @param cmd Command string for display
+ * @return Job ID, or -1 if out of memory
  */
-void remove_alias(const char* name) {
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            /* Shift remaining aliases to fill the gap */
-            for (int j = i; j < alias_count - 1; j++) {
-                aliases[j] = aliases[j + 1];
+int add_job(const pid_t* pids, int count, pid_t pgid, const char* cmd) {
+    int id = job_free;
+    if (id != -1) {
+        job_free = jobs[id].next_free;
+    } else {
+        if (job_slots_used == job_capacity) {
+            int cap = job_capacity ? job_capacity * 2 : 16;
+            Job* grown = realloc(jobs, cap * sizeof(Job));
+            if (!grown) {
+                fprintf(stderr, "ccsh: cannot track job: out of memory\n");
+                return -1;
             }
-            alias_count--;
-            return;
+            jobs = grown;
+            job_capacity = cap;
         }
+        id = job_slots_used++;
     }
-    fprintf(stderr, "Alias not found: %s\n", name);
+
+    Job* job = &jobs[id];
+    job->used = 1;
+    job->pid = pgid;
+    job->pids = malloc(count * sizeof(pid_t));
+    memcpy(job->pids, pids, count * sizeof(pid_t));
+    job->pid_count = count;
+    job->status = 0;
+    job->stopped = 0;
+    job->stop_reported = 0;
+    job->command = arena_add(&job_arena, cmd);
+    job_index(id);
+    job_count++;
+    job_current = id;
+    return id;
 }
 
 /**
- * Get the value of an alias by name
- * @param name Name of alias to look up
- * @return Pointer to alias value or NULL if not found
+ * Index a job's live processes and count them
+ * Used when a job is created and when fg hands a stopped job back
+ * @param id Job ID
  */
-const char* get_alias_value(const char* name) {
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            return aliases[i].value;
+void job_index(int id) {
+    Job* job = &jobs[id];
+    job->remaining = 0;
+    for (int i = 0; i < job->pid_count; i++) {
+        if (job->pids[i] > 0) {
+            job->remaining++;
+            pid_index_insert(job->pids[i], id);
         }
     }
-    return NULL;
+    job->done = job->remaining == 0;
 }
 
-/* Command parsing and execution functions */
-
 /**
- * Parse command line into arguments and handle I/O redirection
- * @param input Raw command string
- * @param args Array to store parsed arguments
- * @param background Set to 1 if job should run in background
- * @param infile Input file for redirection (NULL if none)
- * @param outfile Output file for redirection (NULL if none)
- * @param append Set to 1 for append mode (>>), 0 for truncate (>)
- */
-void parse_command(char* input, char** args, int* background, char** infile, char** outfile, int* append) {
-    int i = 0;
-    *background = 0;
-    *infile = NULL;
-    *outfile = NULL;
-    *append = 0;
-
-    char* token = strtok(input, " ");
-    while (token != NULL) {
-        if (strcmp(token, "<") == 0) {
-            /* Input redirection */
-            token = strtok(NULL, " ");
-            *infile = token;
-        } else if (strcmp(token, ">") == 0) {
-            /* Output redirection (truncate) */
-            token = strtok(NULL, " ");
-            *outfile = token;
-            *append = 0;
-        } else if (strcmp(token, ">>") == 0) {
-            /* Output redirection (append) */
-            token = strtok(NULL, " ");
-            *outfile = token;
-            *append = 1;
-        } else if (strcmp(token, "&") == 0) {
-            /* Background execution */
-            *background = 1;
-        } else {
-            /* Regular argument */
-            args[i++] = token;
-        }
-        token = strtok(NULL, " ");
+ * Send a signal to every process of a job
+ * @param job Job
+ * @param sig Signal number
+ */
+void job_signal(const Job* job, int sig) {
+    if (job_control && kill(-job->pid, sig) == 0) return;
+    for (int i = 0; i < job->pid_count; i++) {
+        if (job->pids[i] > 0) kill(job->pids[i], sig);
     }
-    args[i] = NULL;  /* Null-terminate argument list */
 }
 
 /**
- * Expand glob patterns (*, ?) in command arguments
- * @param args Original arguments array
- * @param expanded_args Array to store expanded arguments
- * @param expanded_count Number of expanded arguments
- */
-void expand_globs(char** args, char** expanded_args, int* expanded_count) {
-    *expanded_count = 0;
-    glob_t results;
-    results.gl_offs = 0;
-    results.gl_pathc = 0;
-    results.gl_pathv = NULL;
-
-    for (int i = 0; args[i] != NULL; i++) {
-        int flags = GLOB_TILDE;  /* Expand ~ to home directory */
-        if (strchr(args[i], '*') || strchr(args[i], '?')) {
-            /* Pattern contains glob characters */
-            if (*expanded_count > 0) flags |= GLOB_APPEND;
-            if (glob(args[i], flags, NULL, &results) != 0) {
-                /* Glob failed, use original argument */
-                expanded_args[(*expanded_count)++] = args[i];
-            } else {
-                /* Add all matched files */
-                for (size_t j = 0; j < results.gl_pathc; j++) {
-                    expanded_args[(*expanded_count)++] = results.gl_pathv[j];
-                }
-            }
-        } else {
-            /* No glob characters, use as-is */
-            expanded_args[(*expanded_count)++] = args[i];
-        }
+ * Get the command string of a job
+ * @param job Job
+ * @return Command string (valid until a job is next added or removed)
+ */
+const char* job_command(const Job* job) {
+    return job_arena.data + job->command;
+}
+
+/**
+ * Drop the space of finished jobs' commands from the job arena
+ * Free once the table is empty; otherwise live commands are copied into a
+ * fresh arena when most of the old one is dead
+ */
+void job_arena_compact(void) {
+    if (job_count == 0) {
+        job_arena.len = 0;
+        job_arena.dead = 0;
+        return;
     }
-    expanded_args[*expanded_count] = NULL;
-    
-    /* Free the glob structure */
-    if (results.gl_pathv != NULL) {
-        globfree(&results);
+    if (job_arena.dead <= 4096 || job_arena.dead * 2 <= job_arena.len) return;
+
+    StringArena old = job_arena;
+    memset(&job_arena, 0, sizeof(job_arena));
+    for (int id = 0; id < job_slots_used; id++) {
+        if (jobs[id].used) jobs[id].command = arena_add(&job_arena, old.data + jobs[id].command);
     }
+    free(old.data);
 }
 
 /**
- * Expand aliases in command line
- * @param line Original command line
- * @param out Buffer for expanded command line
- * @param out_size Size of output buffer
+ * Remove a job and return its slot to the free list
+ * @param id Job ID
  */
-void expand_alias(char* line, char* out, size_t out_size) {
-    /* Create a copy of the line to avoid modifying the original */
-    char line_copy[2048];
-    strncpy(line_copy, line, sizeof(line_copy) - 1);
-    line_copy[sizeof(line_copy) - 1] = '\0';
-    
-    char* token = strtok(line_copy, " ");
-    if (!token) {
-        *out = '\0';
+void remove_job(int id) {
+    job_unindex(&jobs[id]);
+    free(jobs[id].pids);
+    arena_release(&job_arena, jobs[id].command);
+    jobs[id].used = 0;
+    jobs[id].pids = NULL;
+    jobs[id].next_free = job_free;
+    job_free = id;
+    job_count--;
+    if (job_current == id) job_current = -1;
+    job_arena_compact();
+}
+
+/**
+ * Find a tracked job by ID
+ * @param id Job ID
+ * @return Job, or NULL if there is no such job
+ */
+Job* find_job(int id) {
+    if (id < 0 || id >= job_slots_used || !jobs[id].used) return NULL;
+    return &jobs[id];
+}
+
+/**
+ * Record a state change of one child in the job it belongs to
+ * @param pid Process that exited, stopped or continued
+ * @param status Status from waitpid
+ */
+void job_process_changed(pid_t pid, int status) {
+    int id = pid_index_find(pid);
+    if (id < 0) return;
+
+    Job* job = &jobs[id];
+    if (WIFSTOPPED(status)) {
+        if (!job->stopped) job_current = id;
+        job->stopped = 1;
+        return;
+    }
+    if (WIFCONTINUED(status)) {
+        job->stopped = 0;
+        job->stop_reported = 0;
+        return;
+    }
+    pid_index_remove(pid);
+    for (int k = 0; k < job->pid_count; k++) {
+        if (job->pids[k] != pid) continue;
+        job->pids[k] = 0;
+        if (k == job->pid_count - 1) job->status = decode_status(status);
+        if (--job->remaining == 0) job->done = 1;
         return;
     }
+}
+
+/**
+ * Block until another child exits or stops and record it in its job
+ * @return 0 if a child changed state, -1 if there are no children left or
+ *         Ctrl+C interrupted the wait
+ */
+int job_reap_one() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WUNTRACED)) == -1 && errno == EINTR) {
+        if (sigint_pending) return -1;
+    }
+    if (pid <= 0) return -1;
+    job_process_changed(pid, status);
+    return 0;
+}
+
+/**
+ * Reap every child that has exited since the last call
+ * Cheap when nothing happened: the self-pipe is empty and no waitpid is made
+ */
+void reap_children() {
+    if (sigchld_pipe[0] == -1) return;
+
+    char buf[64];
+    int signalled = 0;
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) signalled = 1;
+    if (!signalled) return;
+
+    /* One drain loop for all jobs instead of a waitpid per job */
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        job_process_changed(pid, status);
+    }
+}
 
-    const char* alias_val = get_alias_value(token);
-    if (alias_val) {
-        /* Replace first token with alias value */
-        snprintf(out, out_size, "%s", alias_val);
-        char* rest = strtok(NULL, "");
-        if (rest) {
-            /* Append remaining arguments */
-            strncat(out, " ", out_size - strlen(out) - 1);
-            strncat(out, rest, out_size - strlen(out) - 1);
+/**
+ * Reap finished children and report completed and newly stopped jobs
+ * Called before each prompt; notifications are printed only when interactive
+ */
+void check_background_jobs() {
+    reap_children();
+    for (int id = 0; id < job_slots_used && job_count > 0; id++) {
+        if (!jobs[id].used) continue;
+        if (jobs[id].done) {
+            if (interactive) printf("[%d] Done %s\n", id, job_command(&jobs[id]));
+            remove_job(id);
+        } else if (jobs[id].stopped && !jobs[id].stop_reported) {
+            if (interactive) printf("[%d] Stopped %s\n", id, job_command(&jobs[id]));
+            jobs[id].stop_reported = 1;
         }
-    } else {
-        /* No alias found, copy original line */
-        strncpy(out, line, out_size - 1);
-        out[out_size - 1] = '\0';
     }
 }
 
 /**
- * Simple pattern matching function for grep
- * @param text Text to search in
- * @param pattern Pattern to search for
- * @param case_insensitive Whether to ignore case
- * @return 1 if pattern matches, 0 otherwise
+ * Check whether check_background_jobs has anything to announce
+ * @return 1 if a job finished or stopped since the last notice
  */
-int simple_match(const char* text, const char* pattern, int case_insensitive) {
-    if (!text || !pattern) return 0;
-    
-    char* text_copy = strdup(text);
-    char* pattern_copy = strdup(pattern);
-    
-    if (case_insensitive) {
-        /* Convert to lowercase for case-insensitive matching */
-        for (int i = 0; text_copy[i]; i++) {
-            text_copy[i] = tolower(text_copy[i]);
+int jobs_have_notice() {
+    for (int id = 0; id < job_slots_used; id++) {
+        if (jobs[id].used && (jobs[id].done || (jobs[id].stopped && !jobs[id].stop_reported))) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Display all current background jobs
+ * Jobs that finished since the last prompt are shown once as Done
+ * @param out Output buffer
+ */
+void list_jobs(OutBuf* out) {
+    reap_children();
+    if (job_count == 0) {
+        outbuf_puts(out, "No background jobs.\n");
+        return;
+    }
+    for (int id = 0; id < job_slots_used; id++) {
+        if (!jobs[id].used) continue;
+        const char* state = jobs[id].done ? "Done" : jobs[id].stopped ? "Stopped" : "Running";
+        outbuf_printf(out, "[%d] %d %s %s\n", id, jobs[id].pid, state, job_command(&jobs[id]));
+        if (jobs[id].stopped) jobs[id].stop_reported = 1;
+        if (jobs[id].done) remove_job(id);
+    }
+}
+
+/**
+ * Resolve a wait operand: %N names job N, a bare number is a process ID
+ * @param arg Operand
+ * @return Job ID, or -1 if it names no tracked job
+ */
+int wait_operand_job(const char* arg) {
+    char* end;
+    int is_job = arg[0] == '%';
+    long value = strtol(arg + is_job, &end, 10);
+    if (end == arg + is_job || *end != '\0' || value < 0) return -1;
+    if (is_job) return find_job((int)value) ? (int)value : -1;
+    return pid_index_find((pid_t)value);
+}
+
+/**
+ * Built-in wait command implementation
+ * wait           - wait for every background job, status 0
+ * wait ID...     - wait for the given jobs (%N) or processes, status of the last
+ * wait -n [ID...] - wait for whichever job finishes first, status of that job
+ * Waited jobs are removed without a Done notification; stopped jobs are
+ * not waited for, and Ctrl+C ends the wait
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return Exit status as described above, 127 for unknown operands,
+ *         130 if interrupted
+ */
+int builtin_wait(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    (void)io;
+    reap_children();
+    int any = args[1] && strcmp(args[1], "-n") == 0;
+    char** operands = args + 1 + any;
+
+    if (any) {
+        /* Check the candidates, then block for one more child, until one is done */
+        for (;;) {
+            int candidates = 0;
+            for (int id = 0; id < job_slots_used; id++) {
+                if (!jobs[id].used || (jobs[id].stopped && !jobs[id].done)) continue;
+                if (operands[0]) {
+                    int listed = 0;
+                    for (int i = 0; operands[i] && !listed; i++) {
+                        listed = wait_operand_job(operands[i]) == id;
+                    }
+                    if (!listed) continue;
+                }
+                candidates++;
+                if (jobs[id].done) {
+                    int status = jobs[id].status;
+                    remove_job(id);
+                    return status;
+                }
+            }
+            if (candidates == 0 || job_reap_one() != 0) return sigint_pending ? 128 + SIGINT : 127;
         }
-        for (int i = 0; pattern_copy[i]; i++) {
-            pattern_copy[i] = tolower(pattern_copy[i]);
+    }
+
+    if (!operands[0]) {
+        for (int id = 0; id < job_slots_used; id++) {
+            if (!jobs[id].used) continue;
+            while (!jobs[id].done && !jobs[id].stopped && job_reap_one() == 0) {
+                /* Other jobs finishing meanwhile are recorded too */
+            }
+            if (sigint_pending) return 128 + SIGINT;
+            if (jobs[id].done) remove_job(id);
         }
+        return 0;
     }
-    
-    int result = strstr(text_copy, pattern_copy) != NULL;
-    
-    free(text_copy);
-    free(pattern_copy);
-    return result;
+
+    int status = 0;
+    for (int i = 0; operands[i]; i++) {
+        int id = wait_operand_job(operands[i]);
+        if (id < 0) {
+            fprintf(stderr, "ccsh: wait: %s: no such job\n", operands[i]);
+            status = 127;
+            continue;
+        }
+        while (!jobs[id].done && !jobs[id].stopped && job_reap_one() == 0) {
+            /* Keep reaping until this job's processes are all gone */
+        }
+        if (sigint_pending) return 128 + SIGINT;
+        if (!jobs[id].done) {
+            status = 128 + SIGTSTP;
+            continue;
+        }
+        status = jobs[id].status;
+        remove_job(id);
+    }
+    return status;
 }
 
+/* String arena functions */
+
 /**
- * Built-in grep command implementation
- * @param args Command arguments
- * @return 0 on success, 1 on error
+ * Hash a string with the FNV-1a algorithm
+ * @param s String to hash
+ * @return 32-bit hash value
  */
-int builtin_grep(char** args) {
-    if (!args[1]) {
-        fprintf(stderr, "Usage: grep [options] pattern [file...]\n");
-        fprintf(stderr, "Options:\n");
-        fprintf(stderr, "  -i    Ignore case\n");
-        fprintf(stderr, "  -n    Show line numbers\n");
-        fprintf(stderr, "  -v    Invert match (show non-matching lines)\n");
-        fprintf(stderr, "  -c    Count matching lines only\n");
-        return 1;
+unsigned int hash_string(const char* s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
     }
-    
-    int case_insensitive = 0;
-    int show_line_numbers = 0;
-    int invert_match = 0;
-    int count_only = 0;
-    char* pattern = NULL;
-    int file_count = 0;
-    char** files = NULL;
-    
-    /* Parse options and arguments */
+    return h;
+}
+
+/**
+ * Copy a string into an arena
+ * Strings are addressed by offset so the block can grow with realloc
+ * @param arena String arena
+ * @param s String to copy
+ * @return Offset of the copy
+ */
+size_t arena_add(StringArena* arena, const char* s) {
+    size_t len = strlen(s) + 1;
+    if (arena->len + len > arena->cap) {
+        size_t cap = arena->cap ? arena->cap * 2 : 1024;
+        while (cap < arena->len + len) cap *= 2;
+        arena->data = realloc(arena->data, cap);
+        arena->cap = cap;
+    }
+    memcpy(arena->data + arena->len, s, len);
+    arena->len += len;
+    return arena->len - len;
+}
+
+/**
+ * Record that a string in an arena is no longer referenced
+ * @param arena String arena
+ * @param offset Offset of the dead string
+ */
+void arena_release(StringArena* arena, size_t offset) {
+    arena->dead += strlen(arena->data + offset) + 1;
+}
+
+/* Alias management functions */
+
+/**
+ * Find the slot holding an alias, or the empty slot where it would go
+ * @param name Alias name
+ * @param hash Hash of name
+ * @return Slot index
+ */
+size_t alias_slot(const char* name, unsigned int hash) {
+    size_t mask = alias_capacity - 1;
+    size_t i = hash & mask;
+    while (aliases[i].used) {
+        if (aliases[i].hash == hash && strcmp(alias_arena.data + aliases[i].name, name) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * Rebuild the alias table with a new capacity, compacting the arena
+ * @param capacity New number of slots (power of two)
+ */
+void alias_rehash(size_t capacity) {
+    Alias* old = aliases;
+    size_t old_capacity = alias_capacity;
+    StringArena old_arena = alias_arena;
+
+    aliases = calloc(capacity, sizeof(Alias));
+    alias_capacity = capacity;
+    memset(&alias_arena, 0, sizeof(alias_arena));
+
+    /* Copy live strings only, dropping space left by updates and removals */
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i].used) continue;
+        size_t slot = alias_slot(old_arena.data + old[i].name, old[i].hash);
+        aliases[slot].used = 1;
+        aliases[slot].hash = old[i].hash;
+        aliases[slot].name = arena_add(&alias_arena, old_arena.data + old[i].name);
+        aliases[slot].value = arena_add(&alias_arena, old_arena.data + old[i].value);
+    }
+    free(old);
+    free(old_arena.data);
+}
+
+/**
+ * Add or update an alias
+ * @param name Alias name
+ * @param value Alias value/command
+ */
+void add_alias(const char* name, const char* value) {
+    /* Keep the load factor at or below 1/2 */
+    if ((size_t)(alias_count + 1) * 2 > alias_capacity) {
+        alias_rehash(alias_capacity ? alias_capacity * 2 : 64);
+    }
+
+    unsigned int hash = hash_string(name);
+    size_t slot = alias_slot(name, hash);
+    if (aliases[slot].used) {
+        /* Existing alias: replace its value */
+        arena_release(&alias_arena, aliases[slot].value);
+        aliases[slot].value = arena_add(&alias_arena, value);
+    } else {
+        aliases[slot].used = 1;
+        aliases[slot].hash = hash;
+        aliases[slot].name = arena_add(&alias_arena, name);
+        aliases[slot].value = arena_add(&alias_arena, value);
+        alias_count++;
+    }
+
+    /* Compact once most of the arena is dead */
+    if (alias_arena.dead > 4096 && alias_arena.dead * 2 > alias_arena.len) {
+        alias_rehash(alias_capacity);
+    }
+}
+
+/**
+ * Remove an alias by name
+ * Uses backward-shift deletion so lookups never need tombstones
+ * @param name Name of alias to remove
+ */
+void remove_alias(const char* name) {
+    if (alias_count == 0 || !aliases[alias_slot(name, hash_string(name))].used) {
+        fprintf(stderr, "Alias not found: %s\n", name);
+        return;
+    }
+
+    size_t mask = alias_capacity - 1;
+    size_t hole = alias_slot(name, hash_string(name));
+    arena_release(&alias_arena, aliases[hole].name);
+    arena_release(&alias_arena, aliases[hole].value);
+    aliases[hole].used = 0;
+    alias_count--;
+
+    /* Pull later entries of the probe run back over the hole */
+    for (size_t i = (hole + 1) & mask; aliases[i].used; i = (i + 1) & mask) {
+        size_t home = aliases[i].hash & mask;
+        int movable = (hole <= i) ? (home <= hole || home > i) : (home <= hole && home > i);
+        if (movable) {
+            aliases[hole] = aliases[i];
+            aliases[i].used = 0;
+            hole = i;
+        }
+    }
+}
+
+/**
+ * Get the value of an alias by name
+ * @param name Name of alias to look up
+ * @return Pointer to alias value (valid until the table is next modified)
+ *         or NULL if not found
+ */
+const char* get_alias_value(const char* name) {
+    if (alias_count == 0) return NULL;
+    size_t slot = alias_slot(name, hash_string(name));
+    return aliases[slot].used ? alias_arena.data + aliases[slot].value : NULL;
+}
+
+/**
+ * Compare two alias slots by name for sorted listing
+ */
+static int alias_compare(const void* a, const void* b) {
+    const Alias* x = *(const Alias* const*)a;
+    const Alias* y = *(const Alias* const*)b;
+    return strcmp(alias_arena.data + x->name, alias_arena.data + y->name);
+}
+
+/**
+ * Print every alias, sorted by name
+ * @param out Output buffer
+ */
+void list_aliases(OutBuf* out) {
+    if (alias_count == 0) return;
+    const Alias** sorted = malloc(alias_count * sizeof(Alias*));
+    int n = 0;
+    for (size_t i = 0; i < alias_capacity; i++) {
+        if (aliases[i].used) sorted[n++] = &aliases[i];
+    }
+    qsort(sorted, n, sizeof(Alias*), alias_compare);
+    for (int i = 0; i < n; i++) {
+        outbuf_printf(out, "alias %s='%s'\n", alias_arena.data + sorted[i]->name, alias_arena.data + sorted[i]->value);
+    }
+    free(sorted);
+}
+
+/* Command hash functions */
+
+/**
+ * Remove every entry from the command hash table
+ */
+void cmd_hash_clear() {
+    for (int i = 0; i < CMD_HASH_SIZE; i++) {
+        CmdHashEntry* entry = cmd_hash[i];
+        while (entry) {
+            CmdHashEntry* next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        cmd_hash[i] = NULL;
+    }
+    cmd_hash_count = 0;
+}
+
+/**
+ * Drop the table if PATH has changed since it was last filled
+ * Cached locations are only valid for the PATH they were found with
+ */
+void cmd_hash_check_path() {
+    const char* path = getenv("PATH");
+    if (!path) path = "";
+    if (cmd_hash_path && strcmp(cmd_hash_path, path) == 0) return;
+
+    cmd_hash_clear();
+    free(cmd_hash_path);
+    cmd_hash_path = strdup(path);
+}
+
+/**
+ * Find a command's entry in the hash table
+ * @param name Command name
+ * @return Entry or NULL if the command is not hashed
+ */
+CmdHashEntry* cmd_hash_find(const char* name) {
+    CmdHashEntry* entry = cmd_hash[hash_string(name) % CMD_HASH_SIZE];
+    while (entry) {
+        if (strcmp(entry->name, name) == 0) return entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+/**
+ * Add or replace a command location in the hash table
+ * @param name Command name
+ * @param path Full path to the executable
+ * @return The stored entry
+ */
+CmdHashEntry* cmd_hash_insert(const char* name, const char* path) {
+    CmdHashEntry* entry = cmd_hash_find(name);
+    if (entry) {
+        free(entry->path);
+        entry->path = strdup(path);
+        entry->hits = 0;
+        return entry;
+    }
+
+    unsigned int bucket = hash_string(name) % CMD_HASH_SIZE;
+    entry = malloc(sizeof(CmdHashEntry));
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    entry->hits = 0;
+    entry->next = cmd_hash[bucket];
+    cmd_hash[bucket] = entry;
+    cmd_hash_count++;
+    return entry;
+}
+
+/**
+ * Search PATH for an executable without copying or tokenizing PATH
+ * @param name Command name (must not contain '/')
+ * @param out Buffer for the full path
+ * @param out_size Size of output buffer
+ * @return 0 if found, -1 otherwise
+ */
+int search_path(const char* name, char* out, size_t out_size) {
+    const char* dir = cmd_hash_path;
+    while (dir) {
+        const char* end = strchr(dir, ':');
+        size_t len = end ? (size_t)(end - dir) : strlen(dir);
+
+        /* An empty PATH element means the current directory */
+        if (len == 0) {
+            snprintf(out, out_size, "./%s", name);
+        } else {
+            snprintf(out, out_size, "%.*s/%s", (int)len, dir, name);
+        }
+
+        struct stat st;
+        if (access(out, X_OK) == 0 && stat(out, &st) == 0 && !S_ISDIR(st.st_mode)) {
+            return 0;
+        }
+        dir = end ? end + 1 : NULL;
+    }
+    return -1;
+}
+
+/**
+ * Resolve a command to its full path, filling the hash table on first use
+ * @param name Command name
+ * @return Cached full path, or NULL if not found or name contains '/'
+ */
+const char* hash_lookup_command(const char* name) {
+    if (!name || !*name || strchr(name, '/')) return NULL;
+
+    cmd_hash_check_path();
+
+    CmdHashEntry* entry = cmd_hash_find(name);
+    if (!entry) {
+        char full_path[PATH_MAX];
+        if (search_path(name, full_path, sizeof(full_path)) != 0) return NULL;
+        entry = cmd_hash_insert(name, full_path);
+    }
+    entry->hits++;
+    return entry->path;
+}
+
+/**
+ * Built-in hash command implementation
+ * hash          - list hashed commands with hit counts
+ * hash -r       - forget all remembered locations
+ * hash -p path name - remember path as the location of name
+ * hash name...  - look up and remember each name
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0 on success, 1 on error
+ */
+int builtin_hash(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    cmd_hash_check_path();
+
+    if (!args[1]) {
+        if (cmd_hash_count == 0) {
+            outbuf_puts(io->out, "hash: hash table empty\n");
+            return 0;
+        }
+        outbuf_puts(io->out, "hits\tcommand\n");
+        for (int i = 0; i < CMD_HASH_SIZE; i++) {
+            for (CmdHashEntry* entry = cmd_hash[i]; entry; entry = entry->next) {
+                outbuf_printf(io->out, "%4u\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0) {
+        cmd_hash_clear();
+        return 0;
+    }
+
+    if (strcmp(args[1], "-p") == 0) {
+        if (!args[2] || !args[3]) {
+            fprintf(stderr, "Usage: hash -p path name\n");
+            return 1;
+        }
+        cmd_hash_insert(args[3], args[2]);
+        return 0;
+    }
+
+    int status = 0;
     for (int i = 1; args[i] != NULL; i++) {
-        if (args[i][0] == '-' && args[i][1] != '\0') {
-            /* Option */
-            for (int j = 1; args[i][j] != '\0'; j++) {
-                switch (args[i][j]) {
-                    case 'i':
-                        case_insensitive = 1;
-                        break;
-                    case 'n':
-                        show_line_numbers = 1;
-                        break;
-                    case 'v':
-                        invert_match = 1;
-                        break;
-                    case 'c':
-                        count_only = 1;
-                        break;
-                    default:
-                        fprintf(stderr, "grep: invalid option -- '%c'\n", args[i][j]);
-                        return 1;
+        if (strchr(args[i], '/')) continue;
+        /* Re-resolve so a stale entry can be refreshed on request */
+        char full_path[PATH_MAX];
+        if (search_path(args[i], full_path, sizeof(full_path)) == 0) {
+            cmd_hash_insert(args[i], full_path);
+        } else {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* Tokenizer functions */
+
+/**
+ * Initialize an empty token list
+ * @param list Token list
+ */
+void token_list_init(TokenList* list) {
+    memset(list, 0, sizeof(*list));
+}
+
+/**
+ * Release the storage owned by a token list
+ * @param list Token list
+ */
+void token_list_free(TokenList* list) {
+    free(list->tokens);
+    free(list->scratch);
+    free(list->words);
+    token_list_init(list);
+}
+
+/**
+ * Unquoted text of a word token
+ * @param list Token list
+ * @param index Token index
+ * @return NUL-terminated word inside the list's word buffer
+ */
+char* token_word(const TokenList* list, int index) {
+    return list->words + list->tokens[index].word;
+}
+
+/**
+ * Make room for one more token
+ * @param list Token list
+ * @return 0 on success, -1 if out of memory
+ */
+static int token_reserve(TokenList* list) {
+    if (list->count < list->cap) return 0;
+    int cap = list->cap ? list->cap * 2 : 64;
+    Token* tokens = realloc(list->tokens, cap * sizeof(Token));
+    if (!tokens) return -1;
+    list->tokens = tokens;
+    list->cap = cap;
+    return 0;
+}
+
+/**
+ * Source text of an operator token, for error messages
+ * @param kind Token kind
+ * @return Operator spelling
+ */
+const char* token_text(int kind) {
+    switch (kind) {
+        case TOK_LT: return "<";
+        case TOK_GT: return ">";
+        case TOK_APPEND: return ">>";
+        case TOK_AMP: return "&";
+        case TOK_PIPE: return "|";
+        case TOK_SEMI: return ";";
+        case TOK_AND: return "&&";
+        case TOK_OR: return "||";
+        default: return "word";
+    }
+}
+
+/**
+ * Lex a $ substitution into a word
+ * Leaves CTL_EXPAND, the kind, the name or raw command text and CTL_END;
+ * a $ that starts no substitution is copied as a literal
+ * @param p Source text at the $
+ * @param out Write position in the word buffer (advanced)
+ * @param quoted 1 inside double quotes
+ * @param flags Token flags (TOKF_EXPAND is set)
+ * @return Source position after the substitution, or NULL on syntax error
+ */
+static const char* lex_dollar(const char* p, char** out, int quoted, int* flags) {
+    const char* name = p + 1;
+    const char* end;
+    char kind = EXP_VAR;
+    if (*name == '(') {
+        /* Find the matching parenthesis, skipping quoted text */
+        int depth = 1;
+        for (end = name + 1; *end; end++) {
+            if (*end == '\\' && end[1]) {
+                end++;
+            } else if (*end == '\'') {
+                const char* close = strchr(end + 1, '\'');
+                if (!close) break;
+                end = close;
+            } else if (*end == '"') {
+                for (end++; *end && *end != '"'; end++) {
+                    if (*end == '\\' && end[1]) end++;
+                }
+                if (!*end) break;
+            } else if (*end == '(') {
+                depth++;
+            } else if (*end == ')' && --depth == 0) {
+                break;
+            }
+        }
+        if (*end != ')') {
+            fprintf(stderr, "ccsh: syntax error: unterminated $(\n");
+            return NULL;
+        }
+        kind = EXP_CMD;
+        name++;
+    } else if (*name == '{') {
+        name++;
+        for (end = name; isalnum((unsigned char)*end) || *end == '_'; end++) {
+            /* Variable name */
+        }
+        if (*end != '}' || end == name) {
+            fprintf(stderr, "ccsh: syntax error: bad substitution\n");
+            return NULL;
+        }
+    } else if (*name == '?' || *name == '$') {
+        end = name + 1;
+    } else if (isalpha((unsigned char)*name) || *name == '_') {
+        for (end = name; isalnum((unsigned char)*end) || *end == '_'; end++) {
+            /* Variable name */
+        }
+    } else {
+        *(*out)++ = '$';
+        return p + 1;
+    }
+
+    *(*out)++ = CTL_EXPAND;
+    *(*out)++ = quoted ? (char)(kind & ~EXP_UNQUOTED) : kind;
+    memcpy(*out, name, (size_t)(end - name));
+    *out += end - name;
+    *(*out)++ = CTL_END;
+    *flags |= TOKF_EXPAND;
+    return (*end == ')' || *end == '}') && name != p + 1 ? end + 1 : end;
+}
+
+/**
+ * Copy a quoted character into a word, marking it if globbing would treat
+ * it as an operator
+ * @param out Write position in the word buffer (advanced)
+ * @param c Character
+ */
+static void lex_quoted(char** out, char c) {
+    if (strchr(CTL_QUOTE_CHARS, c)) *(*out)++ = CTL_QUOTE;
+    *(*out)++ = c;
+}
+
+/**
+ * Remove CTL_QUOTE markers from a word in place
+ * @param s Word
+ * @return Length of the result
+ */
+static size_t ctl_unquote(char* s) {
+    char* out = strchr(s, CTL_QUOTE);
+    if (!out) return strlen(s);
+    for (const char* p = out; *p; p++) {
+        if (*p == CTL_QUOTE && p[1]) p++;
+        *out++ = *p;
+    }
+    *out = '\0';
+    return (size_t)(out - s);
+}
+
+/**
+ * Lex text and append its tokens to a list
+ * Words are unquoted into the list's word buffer as they are scanned; quotes,
+ * backslash escapes and operators are handled in the same single pass
+ * @param list Token list (tokens and words are appended)
+ * @param text Source text
+ * @return 0 on success, -1 on syntax error or allocation failure
+ */
+int tokenize_append(TokenList* list, const char* text) {
+    /* No source byte yields more than two word bytes: a quoted glob character
+       gains a CTL_QUOTE and $X becomes four marker bytes, so twice the text
+       plus terminators covers every word */
+    size_t text_len = strlen(text);
+    size_t need = list->words_len + 2 * text_len + 2;
+    if (need > list->words_cap) {
+        char* words = realloc(list->words, need);
+        if (!words) return -1;
+        list->words = words;
+        list->words_cap = need;
+    }
+
+    const char* p = text;
+    while (*p) {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        if (*p == '#') {
+            /* Comment runs to the end of the line */
+            while (*p && *p != '\n') p++;
+            continue;
+        }
+        if (token_reserve(list) != 0) return -1;
+        Token* tok = &list->tokens[list->count];
+        tok->start = p - text;
+        tok->word = 0;
+        tok->flags = 0;
+
+        /* Operators */
+        if (*p == '\n' || *p == ';') {
+            tok->kind = TOK_SEMI;
+            p++;
+        } else if (*p == '|') {
+            tok->kind = p[1] == '|' ? TOK_OR : TOK_PIPE;
+            p += p[1] == '|' ? 2 : 1;
+        } else if (*p == '&') {
+            tok->kind = p[1] == '&' ? TOK_AND : TOK_AMP;
+            p += p[1] == '&' ? 2 : 1;
+        } else if (*p == '<') {
+            tok->kind = TOK_LT;
+            p++;
+        } else if (*p == '>') {
+            tok->kind = p[1] == '>' ? TOK_APPEND : TOK_GT;
+            p += p[1] == '>' ? 2 : 1;
+        } else {
+            /* Word: copy characters with quoting removed */
+            char* out = list->words + list->words_len;
+            tok->kind = TOK_WORD;
+            tok->word = list->words_len;
+            while (*p && !strchr(" \t\n;|&<>", *p)) {
+                if (*p == '\'') {
+                    /* Single quotes: everything literal up to the closing quote */
+                    tok->flags |= TOKF_QUOTED;
+                    const char* close = strchr(p + 1, '\'');
+                    if (!close) {
+                        fprintf(stderr, "ccsh: syntax error: unterminated quote\n");
+                        return -1;
+                    }
+                    for (p++; p < close; p++) lex_quoted(&out, *p);
+                    p = close + 1;
+                } else if (*p == '"') {
+                    /* Double quotes: backslash only escapes " \ $ ` and newline */
+                    tok->flags |= TOKF_QUOTED;
+                    p++;
+                    while (*p && *p != '"') {
+                        if (*p == '$') {
+                            p = lex_dollar(p, &out, 1, &tok->flags);
+                            if (!p) return -1;
+                            continue;
+                        }
+                        if (*p == '\\' && p[1] && strchr("\"\\$`\n", p[1])) p++;
+                        lex_quoted(&out, *p++);
+                    }
+                    if (!*p) {
+                        fprintf(stderr, "ccsh: syntax error: unterminated quote\n");
+                        return -1;
+                    }
+                    p++;
+                } else if (*p == '\\') {
+                    /* Backslash takes the next character literally */
+                    tok->flags |= TOKF_QUOTED;
+                    p++;
+                    if (*p) lex_quoted(&out, *p++);
+                } else if (*p == '$') {
+                    p = lex_dollar(p, &out, 0, &tok->flags);
+                    if (!p) return -1;
+                } else {
+                    if (*p == '*' || *p == '?' || *p == '[' || *p == '{') tok->flags |= TOKF_GLOB;
+                    if (*p == '~' && out == list->words + tok->word) tok->flags |= TOKF_GLOB;
+                    *out++ = *p++;
                 }
             }
+            *out = '\0';
+            if (!(tok->flags & (TOKF_GLOB | TOKF_EXPAND)) && (tok->flags & TOKF_QUOTED)) {
+                /* Nothing will glob this word, so its quoting needs no record */
+                out = list->words + tok->word + ctl_unquote(list->words + tok->word);
+            }
+            list->words_len = out + 1 - list->words;
+        }
+        tok->len = (p - text) - tok->start;
+        list->count++;
+    }
+    return 0;
+}
+
+/**
+ * Lex a command line into a fresh token list
+ * The list's storage is reused, so steady-state lexing does not allocate
+ * @param list Token list (cleared first)
+ * @param line Command line
+ * @return 0 on success, -1 on syntax error
+ */
+int tokenize(TokenList* list, const char* line) {
+    list->count = 0;
+    list->words_len = 0;
+    return tokenize_append(list, line);
+}
+
+/* Glob expansion functions */
+
+/**
+ * Hash of a directory path for the listing cache
+ * @param path Directory path
+ * @return Bucket index
+ */
+static unsigned int dir_cache_bucket(const char* path) {
+    return hash_string(path) % GLOB_CACHE_SIZE;
+}
+
+/**
+ * Release the entries of one listing
+ * @param listing Directory listing
+ */
+static void dir_listing_clear(DirListing* listing) {
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->types);
+    listing->names = NULL;
+    listing->offsets = NULL;
+    listing->types = NULL;
+    listing->names_len = 0;
+    listing->count = 0;
+}
+
+/**
+ * Add one entry to a listing being read
+ * @param listing Directory listing
+ * @param name Entry name
+ * @param type d_type of the entry
+ * @param names_cap Allocated size of listing->names
+ * @param entries_cap Allocated entries of offsets and types
+ */
+static void dir_listing_add(DirListing* listing, const char* name, unsigned char type,
+                            size_t* names_cap, int* entries_cap) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) return;
+    size_t len = strlen(name) + 1;
+    size_t used = listing->names_len;
+    if (used + len > *names_cap) {
+        *names_cap = (*names_cap ? *names_cap * 2 : 4096) + len;
+        listing->names = realloc(listing->names, *names_cap);
+    }
+    if (listing->count == *entries_cap) {
+        *entries_cap = *entries_cap ? *entries_cap * 2 : 64;
+        listing->offsets = realloc(listing->offsets, *entries_cap * sizeof(size_t));
+        listing->types = realloc(listing->types, *entries_cap);
+    }
+    memcpy(listing->names + used, name, len);
+    listing->names_len += len;
+    listing->offsets[listing->count] = used;
+    listing->types[listing->count] = type;
+    listing->count++;
+}
+
+/**
+ * Read a whole directory into a listing
+ * On Linux, getdents64 fetches entries in large batches straight from the
+ * kernel; elsewhere readdir is used
+ * @param listing Listing to fill (path must be set)
+ */
+static void dir_listing_read(DirListing* listing) {
+    size_t names_cap = 0;
+    int entries_cap = 0;
+    dir_listing_clear(listing);
+    listing->error = 0;
+
+    const char* path = listing->path[0] ? listing->path : ".";
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1) close(fd);
+        listing->error = 1;
+        return;
+    }
+    listing->mtime = st.st_mtim;
+    listing->ctime = st.st_ctim;
+
+#if defined(__linux__) && defined(SYS_getdents64)
+    char* buf = malloc(GLOB_DIRENT_BUFFER);
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, GLOB_DIRENT_BUFFER);
+        if (n <= 0) break;
+        for (long pos = 0; pos < n; ) {
+            /* struct linux_dirent64: ino, off, reclen, type, name */
+            unsigned short reclen;
+            memcpy(&reclen, buf + pos + 16, sizeof(reclen));
+            unsigned char type = (unsigned char)buf[pos + 18];
+            dir_listing_add(listing, buf + pos + 19, type, &names_cap, &entries_cap);
+            pos += reclen;
+        }
+    }
+    free(buf);
+    close(fd);
+#else
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        listing->error = 1;
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+#ifdef DT_UNKNOWN
+        dir_listing_add(listing, entry->d_name, entry->d_type, &names_cap, &entries_cap);
+#else
+        dir_listing_add(listing, entry->d_name, 0, &names_cap, &entries_cap);
+#endif
+    }
+    closedir(dir);
+#endif
+}
+
+/**
+ * Drop every cached directory listing
+ */
+void dir_cache_clear() {
+    for (int i = 0; i < GLOB_CACHE_SIZE; i++) {
+        DirListing* listing = dir_cache[i];
+        while (listing) {
+            DirListing* next = listing->next;
+            dir_listing_clear(listing);
+            free(listing->path);
+            free(listing);
+            listing = next;
+        }
+        dir_cache[i] = NULL;
+    }
+    dir_cache_count = 0;
+}
+
+/**
+ * Get the listing of a directory, reading it at most once per expansion
+ * A listing from an earlier expansion is reused while the directory's
+ * mtime and ctime are unchanged. Safe to call from several threads for
+ * different directories.
+ * @param path Directory path ("" for the current directory)
+ * @return Listing (check its error flag)
+ */
+DirListing* dir_cache_get(const char* path) {
+    unsigned int bucket = dir_cache_bucket(path);
+    pthread_mutex_lock(&dir_cache_lock);
+    DirListing* listing = dir_cache[bucket];
+    while (listing && strcmp(listing->path, path) != 0) listing = listing->next;
+    pthread_mutex_unlock(&dir_cache_lock);
+
+    if (listing) {
+        if (listing->batch == glob_batch) return listing;
+        struct stat st;
+        const char* dir = path[0] ? path : ".";
+        if (!listing->error && stat(dir, &st) == 0 &&
+            st.st_mtim.tv_sec == listing->mtime.tv_sec && st.st_mtim.tv_nsec == listing->mtime.tv_nsec &&
+            st.st_ctim.tv_sec == listing->ctime.tv_sec && st.st_ctim.tv_nsec == listing->ctime.tv_nsec) {
+            listing->batch = glob_batch;
+            return listing;
+        }
+        dir_listing_read(listing);
+        listing->batch = glob_batch;
+        return listing;
+    }
+
+    listing = calloc(1, sizeof(DirListing));
+    listing->path = strdup(path);
+    dir_listing_read(listing);
+    listing->batch = glob_batch;
+
+    pthread_mutex_lock(&dir_cache_lock);
+    listing->next = dir_cache[bucket];
+    dir_cache[bucket] = listing;
+    dir_cache_count++;
+    pthread_mutex_unlock(&dir_cache_lock);
+    return listing;
+}
+
+/**
+ * Append a string to a path list, taking ownership of it
+ * @param list Path list
+ * @param path Heap-allocated string
+ */
+static void glob_paths_push(GlobPaths* list, char* path) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(char*));
+    }
+    list->items[list->count++] = path;
+}
+
+/**
+ * Free a path list and its strings
+ * @param list Path list
+ */
+static void glob_paths_free(GlobPaths* list) {
+    for (int i = 0; i < list->count; i++) free(list->items[i]);
+    free(list->items);
+    list->items = NULL;
+    list->count = list->cap = 0;
+}
+
+/**
+ * Join a directory prefix and an entry name
+ * @param base Prefix ("" for the current directory, "/" for the root)
+ * @param name Entry name
+ * @return Heap-allocated path
+ */
+static char* glob_join(const char* base, const char* name) {
+    size_t base_len = strlen(base);
+    size_t name_len = strlen(name);
+    int slash = base_len > 0 && base[base_len - 1] != '/';
+    char* path = malloc(base_len + slash + name_len + 1);
+    memcpy(path, base, base_len);
+    if (slash) path[base_len] = '/';
+    memcpy(path + base_len + slash, name, name_len + 1);
+    return path;
+}
+
+/**
+ * Check whether a word contains glob metacharacters
+ * @param s Word
+ * @return 1 if it contains an unquoted *, ? or [
+ */
+static int glob_has_meta(const char* s) {
+    for (; *s; s++) {
+        if (*s == CTL_QUOTE && s[1]) s++;
+        else if (*s == '*' || *s == '?' || *s == '[') return 1;
+    }
+    return 0;
+}
+
+/**
+ * Read one pattern character, taking a CTL_QUOTE-marked one literally
+ * @param p Pattern position
+ * @param c Set to the character
+ * @return Position after it
+ */
+static const char* glob_char(const char* p, unsigned char* c) {
+    if (*p == CTL_QUOTE && p[1]) p++;
+    *c = (unsigned char)*p;
+    return p + 1;
+}
+
+/**
+ * Match one character against a bracket expression
+ * @param p Pattern positioned at '['
+ * @param c Character to test
+ * @param matched Set to 1 if c is in the set
+ * @return Pattern position after the closing ']', or NULL if unterminated
+ */
+static const char* glob_bracket(const char* p, unsigned char c, int* matched) {
+    const char* q = p + 1;
+    int negate = *q == '!' || *q == '^';
+    if (negate) q++;
+    *matched = 0;
+    int first = 1;
+    while (*q && (first || *q != ']')) {
+        unsigned char lo, hi;
+        q = glob_char(q, &lo);
+        hi = lo;
+        if (q[0] == '-' && q[1] && q[1] != ']') q = glob_char(q + 1, &hi);
+        if (c >= lo && c <= hi) *matched = 1;
+        first = 0;
+    }
+    if (*q != ']') return NULL;
+    if (negate) *matched = !*matched;
+    return q + 1;
+}
+
+/**
+ * Match a file name against one pattern component
+ * Supports *, ? and [...]; a leading '.' must be matched explicitly and
+ * characters marked with CTL_QUOTE match only themselves
+ * @param p Pattern component
+ * @param s File name
+ * @return 1 on match, 0 otherwise
+ */
+int glob_match(const char* p, const char* s) {
+    if (*s == '.' && *p != '.') return 0;
+
+    const char* star_p = NULL;
+    const char* star_s = NULL;
+    while (*s) {
+        if (*p == '*') {
+            /* Remember the star and first try matching nothing */
+            while (*p == '*') p++;
+            star_p = p;
+            star_s = s;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[') {
+            int matched;
+            const char* end = glob_bracket(p, (unsigned char)*s, &matched);
+            if (end) {
+                if (matched) {
+                    p = end;
+                    s++;
+                    continue;
+                }
+                goto backtrack;
+            }
+            /* Unterminated bracket: a literal '[' */
+        }
+        unsigned char c;
+        const char* after = glob_char(p, &c);
+        if (c == (unsigned char)*s) {
+            p = after;
+            s++;
+            continue;
+        }
+    backtrack:
+        if (!star_p) return 0;
+        p = star_p;
+        s = ++star_s;
+    }
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+/**
+ * Check whether a listing entry is a directory, following symlinks
+ * @param listing Listing holding the entry
+ * @param index Entry index
+ * @param follow Set to 1 to treat symlinks to directories as directories
+ * @return 1 if the entry is a directory
+ */
+static int glob_entry_is_dir(const DirListing* listing, int index, int follow) {
+    unsigned char type = listing->types[index];
+#ifdef DT_DIR
+    if (type == DT_DIR) return 1;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) return 0;
+#endif
+    char* path = glob_join(listing->path, listing->names + listing->offsets[index]);
+    struct stat st;
+    int is_dir = (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+    free(path);
+    return is_dir;
+}
+
+/**
+ * Worker for the parallel ** prefetch: read queued directories and queue
+ * their subdirectories until the whole tree is listed
+ * @param arg GlobWalk shared by all workers
+ * @return NULL
+ */
+static void* glob_walk_worker(void* arg) {
+    GlobWalk* walk = arg;
+    for (;;) {
+        pthread_mutex_lock(&walk->lock);
+        while (walk->queue.count == 0 && walk->active > 0) pthread_cond_wait(&walk->cond, &walk->lock);
+        if (walk->queue.count == 0) {
+            pthread_cond_broadcast(&walk->cond);
+            pthread_mutex_unlock(&walk->lock);
+            return NULL;
+        }
+        char* path = walk->queue.items[--walk->queue.count];
+        walk->active++;
+        pthread_mutex_unlock(&walk->lock);
+
+        /* Listing happens outside the lock; this is where the I/O goes */
+        DirListing* listing = dir_cache_get(path);
+        for (int i = 0; !listing->error && i < listing->count; i++) {
+            const char* name = listing->names + listing->offsets[i];
+            if (name[0] == '.' || !glob_entry_is_dir(listing, i, 0)) continue;
+            char* child = glob_join(path, name);
+            pthread_mutex_lock(&walk->lock);
+            glob_paths_push(&walk->queue, child);
+            pthread_cond_signal(&walk->cond);
+            pthread_mutex_unlock(&walk->lock);
+        }
+        free(path);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->active--;
+        if (walk->active == 0 && walk->queue.count == 0) pthread_cond_broadcast(&walk->cond);
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+/**
+ * List a whole directory tree into the cache using several threads
+ * Hidden directories and symlinks are not descended into
+ * @param base Root of the tree ("" for the current directory)
+ */
+static void glob_prefetch_tree(const char* base) {
+    GlobWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    glob_paths_push(&walk.queue, strdup(base));
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > GLOB_WALK_THREADS ? GLOB_WALK_THREADS : (cpus > 0 ? (int)cpus : 1);
+    pthread_t workers[GLOB_WALK_THREADS];
+    int started = 0;
+    for (int i = 0; threads > 1 && i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, glob_walk_worker, &walk) == 0) started++;
+    }
+    if (started == 0) glob_walk_worker(&walk);  /* Single CPU: walk on this thread */
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    free(walk.queue.items);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.cond);
+}
+
+/**
+ * Collect everything below a directory from the (prefetched) cache
+ * @param base Directory ("" for the current directory)
+ * @param out Receives the paths
+ * @param files Set to 1 to include files as well as directories
+ */
+static void glob_collect_tree(const char* base, GlobPaths* out, int files) {
+    DirListing* listing = dir_cache_get(base);
+    for (int i = 0; !listing->error && i < listing->count; i++) {
+        const char* name = listing->names + listing->offsets[i];
+        if (name[0] == '.') continue;
+        int is_dir = glob_entry_is_dir(listing, i, 0);
+        if (!is_dir && !files) continue;
+        char* path = glob_join(base, name);
+        glob_paths_push(out, path);
+        if (is_dir) glob_collect_tree(path, out, files);
+    }
+}
+
+/**
+ * qsort comparator ordering paths bytewise
+ * @param a Pointer to the first path
+ * @param b Pointer to the second path
+ * @return strcmp result
+ */
+static int glob_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Expand one brace-free pattern against the file system
+ * Each directory involved is listed through the cache, so patterns on
+ * the same command line share one read per directory
+ * @param pattern Pattern (may contain *, ?, [...] and ** components)
+ * @param out Receives the matching paths, sorted
+ */
+static void glob_walk(const char* pattern, GlobPaths* out) {
+    GlobPaths current = { NULL, 0, 0 };
+    glob_paths_push(&current, strdup(pattern[0] == '/' ? "/" : ""));
+    size_t pattern_len = strlen(pattern);
+    int trailing_slash = pattern_len > 0 && pattern[pattern_len - 1] == '/';
+
+    const char* p = pattern;
+    while (*p == '/') p++;
+    while (*p && current.count > 0) {
+        const char* slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        const char* rest = slash ? slash + strspn(slash, "/") : p + len;
+        int last = *rest == '\0';
+        int dirs_only = !last || trailing_slash;
+        char* component = malloc(len + 1);
+        memcpy(component, p, len);
+        component[len] = '\0';
+        int literal = !glob_has_meta(component);
+        if (literal) ctl_unquote(component);
+
+        GlobPaths next = { NULL, 0, 0 };
+        for (int b = 0; b < current.count; b++) {
+            const char* base = current.items[b];
+            if (literal) {
+                /* Literal component: only the final one needs to exist */
+                char* path = glob_join(base, component);
+                struct stat st;
+                if (!last || (lstat(path, &st) == 0 && (!dirs_only || S_ISDIR(st.st_mode)))) {
+                    glob_paths_push(&next, path);
+                } else {
+                    free(path);
+                }
+            } else if (strcmp(component, "**") == 0) {
+                /* Any depth of directories, listed in parallel up front */
+                glob_prefetch_tree(base);
+                if (!last) glob_paths_push(&next, strdup(base));
+                glob_collect_tree(base, &next, last && !dirs_only);
+            } else {
+                DirListing* listing = dir_cache_get(base);
+                for (int i = 0; !listing->error && i < listing->count; i++) {
+                    const char* name = listing->names + listing->offsets[i];
+                    if (!glob_match(component, name)) continue;
+                    if (dirs_only && !glob_entry_is_dir(listing, i, 1)) continue;
+                    glob_paths_push(&next, glob_join(base, name));
+                }
+            }
+        }
+        free(component);
+        glob_paths_free(&current);
+        current = next;
+        p = rest;
+    }
+
+    qsort(current.items, current.count, sizeof(char*), glob_compare);
+    for (int i = 0; i < current.count; i++) {
+        char* path = current.items[i];
+        if (trailing_slash) {
+            char* with_slash = glob_join(path, "");
+            free(path);
+            path = with_slash;
+        }
+        glob_paths_push(out, path);
+    }
+    free(current.items);
+}
+
+/**
+ * Expand {a,b,c} and {1..5} brace expressions
+ * Alternatives are produced in order; nested braces are expanded too, and
+ * braces and commas marked with CTL_QUOTE are literal
+ * @param word Word to expand
+ * @param out Receives the expanded words
+ */
+static void brace_expand(const char* word, GlobPaths* out) {
+    /* Find the first brace pair with a top-level comma or a range */
+    for (const char* open = word; *open; open++) {
+        if (*open == CTL_QUOTE && open[1]) {
+            open++;
+            continue;
+        }
+        if (*open != '{') continue;
+        int depth = 0;
+        const char* close = NULL;
+        const char* commas[GLOB_MAX_BRACES];
+        int comma_count = 0;
+        for (const char* q = open + 1; *q; q++) {
+            if (*q == CTL_QUOTE && q[1]) q++;
+            else if (*q == '{') depth++;
+            else if (*q == '}' && depth-- == 0) {
+                close = q;
+                break;
+            } else if (*q == ',' && depth == 0 && comma_count < GLOB_MAX_BRACES) {
+                commas[comma_count++] = q;
+            }
+        }
+        if (!close) break;
+
+        size_t prefix_len = (size_t)(open - word);
+        const char* suffix = close + 1;
+        char* alt_word;
+        if (comma_count > 0) {
+            const char* start = open + 1;
+            for (int i = 0; i <= comma_count; i++) {
+                const char* end = i < comma_count ? commas[i] : close;
+                size_t alt_len = (size_t)(end - start);
+                alt_word = malloc(prefix_len + alt_len + strlen(suffix) + 1);
+                memcpy(alt_word, word, prefix_len);
+                memcpy(alt_word + prefix_len, start, alt_len);
+                strcpy(alt_word + prefix_len + alt_len, suffix);
+                brace_expand(alt_word, out);
+                free(alt_word);
+                start = end + 1;
+            }
+            return;
+        }
+
+        /* {first..last}: numbers or single letters */
+        long first, last;
+        char* dots;
+        first = strtol(open + 1, &dots, 10);
+        int numeric = dots != open + 1 && strncmp(dots, "..", 2) == 0;
+        if (numeric) {
+            char* end;
+            last = strtol(dots + 2, &end, 10);
+            numeric = end != dots + 2 && end == close;
+        } else if (close - open == 5 && open[2] == '.' && open[3] == '.' &&
+                   isalpha((unsigned char)open[1]) && isalpha((unsigned char)open[4])) {
+            first = open[1];
+            last = open[4];
+        } else {
+            continue;  /* Not an expression: look for a later one */
+        }
+        long step = first <= last ? 1 : -1;
+        if (labs(last - first) >= GLOB_MAX_BRACES) break;
+        for (long v = first; ; v += step) {
+            char item[32];
+            if (numeric) snprintf(item, sizeof(item), "%ld", v);
+            else snprintf(item, sizeof(item), "%c", (char)v);
+            alt_word = malloc(prefix_len + strlen(item) + strlen(suffix) + 1);
+            memcpy(alt_word, word, prefix_len);
+            strcpy(alt_word + prefix_len, item);
+            strcat(alt_word + prefix_len, suffix);
+            brace_expand(alt_word, out);
+            free(alt_word);
+            if (v == last) break;
+        }
+        return;
+    }
+    glob_paths_push(out, strdup(word));
+}
+
+/**
+ * Start a new expansion: listings read from now on are fresh for this
+ * command, and without the globcache option nothing survives a new line
+ * @param new_line Set to 1 at the start of a command line
+ */
+void glob_begin(int new_line) {
+    if (new_line && !opt_globcache) {
+        if (dir_cache_count > 0) dir_cache_clear();
+    } else if (dir_cache_count > GLOB_CACHE_MAX) {
+        dir_cache_clear();
+    }
+    glob_batch++;
+}
+
+/**
+ * Double the argument capacity of an argv arena
+ * @param arena Argument storage
+ * @return 0 on success, -1 on allocation failure
+ */
+static int argv_arena_grow(ArgvArena* arena) {
+    int cap = arena->argv_cap ? arena->argv_cap * 2 : 64;
+    size_t* offsets = realloc(arena->offsets, cap * sizeof(size_t));
+    if (!offsets) return -1;
+    arena->offsets = offsets;
+    char** argv = realloc(arena->argv, cap * sizeof(char*));
+    if (!argv) return -1;
+    arena->argv = argv;
+    arena->argv_cap = cap;
+    return 0;
+}
+
+/**
+ * Append an argument to an argv arena
+ * @param arena Argument storage
+ * @param s Argument to copy
+ * @return 0 on success, -1 on allocation failure
+ */
+static int argv_arena_push(ArgvArena* arena, const char* s) {
+    size_t len = strlen(s) + 1;
+    if (arena->len + len > arena->cap) {
+        size_t cap = arena->cap ? arena->cap * 2 : 4096;
+        while (cap < arena->len + len) cap *= 2;
+        char* grown = realloc(arena->data, cap);
+        if (!grown) return -1;
+        arena->data = grown;
+        arena->cap = cap;
+    }
+    if (arena->count + 1 >= arena->argv_cap && argv_arena_grow(arena) != 0) return -1;
+    memcpy(arena->data + arena->len, s, len);
+    arena->offsets[arena->count++] = arena->len;
+    arena->len += len;
+    return 0;
+}
+
+/**
+ * Release the storage of an argv arena
+ * @param arena Argument storage
+ */
+void argv_arena_free(ArgvArena* arena) {
+    free(arena->data);
+    free(arena->offsets);
+    free(arena->argv);
+    memset(arena, 0, sizeof(*arena));
+}
+
+/**
+ * Check an expanded argument list against the kernel's exec limit
+ * Counts the strings and pointers of both argv and the environment, as
+ * execve does, so E2BIG is caught before anything is forked
+ * @param arena Expanded arguments
+ * @return 1 if exec would fail with E2BIG, 0 otherwise
+ */
+int argv_arena_too_big(const ArgvArena* arena) {
+    long limit = sysconf(_SC_ARG_MAX);
+    if (limit <= 0) return 0;
+    size_t bytes = arena->len + (size_t)(arena->count + 1) * sizeof(char*);
+    for (char** env = environ; *env && bytes <= (size_t)limit; env++) {
+        bytes += strlen(*env) + 1 + sizeof(char*);
+    }
+    return bytes > (size_t)limit;
+}
+
+/**
+ * Brace-, tilde- and glob-expand one word onto an argv arena
+ * @param arg Word
+ * @param arena Argument storage
+ * @return 0 on success, -1 on allocation failure
+ */
+static int expand_glob_word(const char* arg, ArgvArena* arena) {
+    int status = 0;
+    GlobPaths words = { NULL, 0, 0 };
+    brace_expand(arg, &words);
+    for (int w = 0; w < words.count && status == 0; w++) {
+        /* Expand ~ to home directory */
+        const char* word = words.items[w];
+        char* tilde = NULL;
+        const char* home = getenv("HOME");
+        if (word[0] == '~' && (word[1] == '\0' || word[1] == '/') && home) {
+            tilde = glob_join(home, word[1] ? word + 2 : "");
+            if (!word[1]) tilde[strlen(home)] = '\0';
+            word = tilde;
+        }
+
+        GlobPaths matches = { NULL, 0, 0 };
+        if (glob_has_meta(word)) glob_walk(word, &matches);
+        if (matches.count == 0) {
+            char* literal = strdup(word);
+            ctl_unquote(literal);
+            glob_paths_push(&matches, literal);
+        }
+        for (int m = 0; m < matches.count && status == 0; m++) {
+            status = argv_arena_push(arena, matches.items[m]);
+        }
+        glob_paths_free(&matches);
+        free(tilde);
+    }
+    glob_paths_free(&words);
+    return status;
+}
+
+/**
+ * Expand substitutions, glob patterns (*, ?, [...], **) and braces in
+ * command arguments
+ * Patterns that match nothing are kept as written. The arena is reset first
+ * and its storage reused, so the previous expansion's argv becomes invalid.
+ * @param args Original arguments array
+ * @param globbable Per-argument TOKF_GLOB and TOKF_EXPAND flags from the
+ *                  lexer (NULL checks every argument for * and ?)
+ * @param arena Receives the expanded arguments in arena->argv
+ * @return 0 on success, -1 on allocation failure
+ */
+int expand_globs(char** args, const unsigned char* globbable, ArgvArena* arena) {
+    int status = 0;
+    arena->len = 0;
+    arena->count = 0;
+    if (arena->argv_cap == 0 && argv_arena_grow(arena) != 0) return -1;
+    glob_begin(0);
+
+    for (int i = 0; args[i] != NULL && status == 0; i++) {
+        int flags = globbable ? globbable[i] : (strchr(args[i], '*') || strchr(args[i], '?')) ? TOKF_GLOB : 0;
+        if (flags & TOKF_EXPAND) {
+            /* Substitute first; each resulting field is then globbed like a word */
+            GlobPaths fields = { NULL, 0, 0 };
+            int glob = (flags & TOKF_GLOB) != 0;
+            status = expand_word(args[i], 1, &fields, &glob);
+            for (int f = 0; f < fields.count && status == 0; f++) {
+                if (!glob) ctl_unquote(fields.items[f]);
+                status = glob ? expand_glob_word(fields.items[f], arena)
+                              : argv_arena_push(arena, fields.items[f]);
+            }
+            glob_paths_free(&fields);
+        } else if (flags & TOKF_GLOB) {
+            status = expand_glob_word(args[i], arena);
+        } else {
+            /* No glob characters, use as-is */
+            status = argv_arena_push(arena, args[i]);
+        }
+    }
+
+    if (status != 0) {
+        if (!sigint_pending) fprintf(stderr, "ccsh: out of memory expanding arguments\n");
+        arena->count = 0;
+    }
+
+    /* The block may have moved while growing; point into it only now */
+    for (int i = 0; i < arena->count; i++) arena->argv[i] = arena->data + arena->offsets[i];
+    arena->argv[arena->count] = NULL;
+    return status;
+}
+
+/* Parameter and command substitution functions */
+
+/**
+ * Hash a variable name with the FNV-1a algorithm
+ * @param name Name (not NUL-terminated)
+ * @param len Length of name
+ * @return 32-bit hash value
+ */
+static unsigned int env_hash(const char* name, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Rebuild the environment cache from environ
+ * The table is sized for a load factor of at most one half; the first
+ * definition of a name wins, as with getenv
+ */
+static void env_cache_build() {
+    size_t count = 0;
+    for (char** env = environ; *env; env++) count++;
+    size_t cap = 64;
+    while (cap < count * 2) cap *= 2;
+    if (cap != env_cache_cap) {
+        free(env_cache);
+        env_cache = malloc(cap * sizeof(EnvSlot));
+        env_cache_cap = env_cache ? cap : 0;
+        if (!env_cache) return;
+    }
+    memset(env_cache, 0, env_cache_cap * sizeof(EnvSlot));
+
+    for (char** env = environ; *env; env++) {
+        const char* eq = strchr(*env, '=');
+        if (!eq) continue;
+        size_t len = (size_t)(eq - *env);
+        unsigned int hash = env_hash(*env, len);
+        size_t slot = hash & (env_cache_cap - 1);
+        while (env_cache[slot].entry && (env_cache[slot].hash != hash || env_cache[slot].name_len != len ||
+                                         memcmp(env_cache[slot].entry, *env, len) != 0)) {
+            slot = (slot + 1) & (env_cache_cap - 1);
+        }
+        if (env_cache[slot].entry) continue;
+        env_cache[slot].entry = *env;
+        env_cache[slot].name_len = len;
+        env_cache[slot].hash = hash;
+    }
+    env_cache_valid = 1;
+}
+
+/**
+ * Look up an environment variable through the cache
+ * @param name Variable name (not NUL-terminated)
+ * @param len Length of name
+ * @return Value, or NULL if the variable is not set
+ */
+const char* env_lookup(const char* name, size_t len) {
+    if (!env_cache_valid) env_cache_build();
+    if (!env_cache_valid) return NULL;
+    unsigned int hash = env_hash(name, len);
+    for (size_t slot = hash & (env_cache_cap - 1); env_cache[slot].entry;
+         slot = (slot + 1) & (env_cache_cap - 1)) {
+        const EnvSlot* entry = &env_cache[slot];
+        if (entry->hash == hash && entry->name_len == len && memcmp(entry->entry, name, len) == 0) {
+            return entry->entry + len + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Set an environment variable, invalidating the lookup cache
+ * @param name Variable name
+ * @param value New value, or NULL to unset the variable
+ */
+void env_set(const char* name, const char* value) {
+    if (value) setenv(name, value, 1);
+    else unsetenv(name);
+    env_cache_valid = 0;
+}
+
+/**
+ * Run the command of $(...) as a builtin of this shell, capturing in memory
+ * Only a single builtin marked BUILTIN_CAPTURE qualifies, with no
+ * redirections, and state builtins only when they just report state
+ * @param text Command text
+ * @param out Capture buffer receiving the output
+ * @return 1 if the command was handled here (or had a syntax error), 0 if
+ *         it needs a subshell
+ */
+static int command_subst_builtin(const char* text, OutBuf* out) {
+    TokenList tokens;
+    CommandList cmds;
+    token_list_init(&tokens);
+    command_list_init(&cmds);
+
+    int handled = 0;
+    if (tokenize(&tokens, text) != 0 || expand_alias(&tokens) != 0 || parse_list(&tokens, &cmds) != 0) {
+        last_status = 2;
+        handled = 1;
+    } else if (cmds.count == 1 && cmds.pipelines[0].count == 1 && !cmds.pipelines[0].background &&
+               !cmds.pipelines[0].timed) {
+        Stage* stage = &cmds.stages[cmds.pipelines[0].first];
+        const Builtin* builtin = stage->argc > 0 ? find_builtin(stage->args[0]) : NULL;
+        if (builtin && (builtin->flags & BUILTIN_CAPTURE) && !stage->infile && !stage->outfile &&
+            (!(builtin->flags & BUILTIN_STATE) || stage->argc == 1)) {
+            ArgvArena argv = { 0 };
+            IoCtx io = { STDIN_FILENO, -1, STDERR_FILENO, out };
+            last_status = expand_globs(stage->args, stage->glob, &argv) == 0
+                              ? run_builtin(builtin, argv.argv, &io) : 1;
+            argv_arena_free(&argv);
+            handled = 1;
+        }
+    }
+
+    command_list_free(&cmds);
+    token_list_free(&tokens);
+    return handled;
+}
+
+/**
+ * Run the command of $(...) and collect its standard output
+ * Capturable builtins run in the shell; anything else runs in a forked
+ * subshell whose output is read from a pipe. Sets last_status.
+ * @param text Command text
+ * @return Heap-allocated capture buffer (see outbuf_release)
+ */
+OutBuf* command_subst(const char* text) {
+    OutBuf* out = malloc(sizeof(OutBuf));
+    if (!out) return NULL;
+    outbuf_init_capture(out);
+    if (command_subst_builtin(text, out)) return out;
+
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        last_status = 1;
+        return out;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Subshell: a non-interactive shell running the text with stdout on the pipe */
+        trace_forked();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGWINCH, SIG_DFL);
+        interactive = 0;
+        job_control = 0;
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+
+        TokenList tokens;
+        CommandList cmds;
+        token_list_init(&tokens);
+        command_list_init(&cmds);
+        run_line(&tokens, &cmds, text);
+        fflush(stdout);
+        trace_flush();
+        _exit(last_status);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        last_status = 1;
+        return out;
+    }
+
+    /* Read straight into the buffer, moving full blocks to its heap part */
+    for (;;) {
+        ssize_t n = read(fds[0], out->data + out->len, sizeof(out->data) - out->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->len += (size_t)n;
+        if (out->len == sizeof(out->data)) outbuf_flush(out);
+    }
+    close(fds[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            status = 0;
+            break;
+        }
+    }
+    last_status = decode_status(status);
+    return out;
+}
+
+/**
+ * Append bytes to a growable string
+ * @param buf String (reallocated as needed)
+ * @param len Bytes in use
+ * @param cap Bytes allocated
+ * @param data Bytes to append
+ * @param n Number of bytes
+ * @return 0 on success, -1 on allocation failure
+ */
+static int field_append(char** buf, size_t* len, size_t* cap, const char* data, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t grown = *cap ? *cap * 2 : 64;
+        while (grown < *len + n + 1) grown *= 2;
+        char* p = realloc(*buf, grown);
+        if (!p) return -1;
+        *buf = p;
+        *cap = grown;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+/**
+ * Substitute the $ markers of a word and split it into fields
+ * Results of unquoted substitutions are split on blanks and newlines and
+ * an empty one adds no field; quoted results stay inside their field.
+ * Trailing newlines of command output are dropped.
+ * @param word Word with CTL_EXPAND markers from the lexer
+ * @param split 0 to treat every result as quoted (assignments, redirections)
+ * @param fields Receives the heap-allocated fields
+ * @param glob Set to 1 if an unquoted result brought glob characters
+ * @return 0 on success, -1 on allocation failure or Ctrl+C
+ */
+int expand_word(const char* word, int split, GlobPaths* fields, int* glob) {
+    char* buf = NULL;
+    size_t len = 0, cap = 0;
+    int started = 0;  /* The current field has content, if only an empty quoted result */
+    int status = field_append(&buf, &len, &cap, "", 0);
+
+    const char* p = word;
+    while (*p && status == 0) {
+        if (*p != CTL_EXPAND) {
+            const char* next = strchr(p, CTL_EXPAND);
+            if (!next) next = p + strlen(p);
+            status = field_append(&buf, &len, &cap, p, (size_t)(next - p));
+            started = 1;
+            p = next;
+            continue;
+        }
+
+        /* CTL_EXPAND kind name-or-text CTL_END */
+        char kind = p[1];
+        const char* name = p + 2;
+        const char* end = strchr(name, CTL_END);
+        size_t name_len = (size_t)(end - name);
+        p = end + 1;
+
+        const char* value = NULL;
+        size_t value_len = 0;
+        char number[24];
+        OutBuf* captured = NULL;
+        if ((kind | EXP_UNQUOTED) == EXP_CMD) {
+            char* text = strndup(name, name_len);
+            captured = text ? command_subst(text) : NULL;
+            free(text);
+            if (sigint_pending) status = -1;  /* Ctrl+C abandons the command */
+            if (captured) {
+                outbuf_flush(captured);
+                value = captured->heap ? captured->heap : "";
+                value_len = captured->heap_len;
+                while (value_len > 0 && value[value_len - 1] == '\n') value_len--;
+            }
+        } else if (name_len == 1 && (*name == '?' || *name == '$')) {
+            snprintf(number, sizeof(number), "%d", *name == '?' ? last_status : (int)getpid());
+            value = number;
+        } else {
+            value = env_lookup(name, name_len);
+        }
+        if (!value) value = "";
+        else if (!captured) value_len = strlen(value);
+
+        if (!split || !(kind & EXP_UNQUOTED)) {
+            /* Quoted: the result joins the current field verbatim, and is
+               marked so that globbing the field leaves it alone */
+            const char mark = CTL_QUOTE;
+            size_t run = 0;
+            for (size_t i = 0; split && i < value_len && status == 0; i++) {
+                if (!value[i] || !strchr(CTL_QUOTE_CHARS, value[i])) continue;
+                status = field_append(&buf, &len, &cap, value + run, i - run);
+                if (status == 0) status = field_append(&buf, &len, &cap, &mark, 1);
+                run = i;
+            }
+            if (status == 0) status = field_append(&buf, &len, &cap, value + run, value_len - run);
+            started = 1;
+        } else {
+            for (size_t i = 0; i < value_len && status == 0; ) {
+                if (value[i] == ' ' || value[i] == '\t' || value[i] == '\n') {
+                    if (started) {
+                        glob_paths_push(fields, buf);
+                        buf = NULL;
+                        len = cap = 0;
+                        status = field_append(&buf, &len, &cap, "", 0);
+                        started = 0;
+                    }
+                    i++;
+                    continue;
+                }
+                size_t run = i;
+                while (run < value_len && value[run] != ' ' && value[run] != '\t' && value[run] != '\n') run++;
+                if (memchr(value + i, '*', run - i) || memchr(value + i, '?', run - i) ||
+                    memchr(value + i, '[', run - i)) {
+                    *glob = 1;
+                }
+                status = field_append(&buf, &len, &cap, value + i, run - i);
+                started = 1;
+                i = run;
+            }
+        }
+        outbuf_release(captured);
+    }
+
+    if (status == 0 && started) glob_paths_push(fields, buf);
+    else free(buf);
+    return status;
+}
+
+/**
+ * Check whether a word is a NAME=value assignment
+ * @param word Word as parsed
+ * @return 1 if it starts with a valid name followed by =
+ */
+int is_assignment(const char* word) {
+    if (!isalpha((unsigned char)*word) && *word != '_') return 0;
+    while (isalnum((unsigned char)*word) || *word == '_') word++;
+    return *word == '=';
+}
+
+/**
+ * Run a command made only of NAME=value words: set environment variables
+ * Values are substituted without field splitting or globbing
+ * @param args Assignment words
+ * @param flags TOKF_* flags of each word
+ * @return 0 on success, 1 on allocation failure
+ */
+int run_assignments(char** args, const unsigned char* flags) {
+    for (int i = 0; args[i]; i++) {
+        ctl_unquote(args[i]);  /* Values are never globbed */
+        char* eq = strchr(args[i], '=');
+        char* name = strndup(args[i], (size_t)(eq - args[i]));
+        if (!name) return 1;
+        GlobPaths fields = { NULL, 0, 0 };
+        int glob = 0;
+        const char* value = eq + 1;
+        if ((flags[i] & TOKF_EXPAND) && expand_word(value, 0, &fields, &glob) != 0) {
+            free(name);
+            return 1;
+        }
+        if (flags[i] & TOKF_EXPAND) value = fields.count ? fields.items[0] : "";
+        env_set(name, value);
+        /* The prompt abbreviates the home directory and shows PWD */
+        if (strcmp(name, "HOME") == 0 || strcmp(name, "PWD") == 0) shell_cwd_valid = 0;
+        glob_paths_free(&fields);
+        free(name);
+    }
+    return 0;
+}
+
+/**
+ * Expand the substitutions of a redirection target, which must stay one word
+ * @param target Target as parsed (NULL if none); replaced by the expansion
+ * @param storage Receives the heap-allocated expansion, freed by the caller
+ * @return 0 on success, -1 if the target is not exactly one word (reported)
+ */
+int expand_target(char** target, char** storage) {
+    *storage = NULL;
+    if (!*target || !strchr(*target, CTL_EXPAND)) return 0;
+    GlobPaths fields = { NULL, 0, 0 };
+    int glob = 0;
+    int status = expand_word(*target, 0, &fields, &glob);
+    if (status == 0 && fields.count != 1) {
+        fprintf(stderr, "ccsh: ambiguous redirect\n");
+        status = -1;
+    }
+    if (status == 0) {
+        *storage = fields.items[0];
+        *target = *storage;
+        fields.count = 0;
+    }
+    glob_paths_free(&fields);
+    return status;
+}
+
+/* Command parsing and execution functions */
+
+/**
+ * Append one argument to the command list's shared argument vector
+ * @param cmds Command list
+ * @param arg Argument, or NULL to terminate a stage
+ * @param glob TOKF_GLOB and TOKF_EXPAND flags of the argument
+ * @return 0 on success, -1 on allocation failure
+ */
+static int command_list_push_arg(CommandList* cmds, char* arg, int glob) {
+    if (cmds->arg_count == cmds->arg_cap) {
+        int cap = cmds->arg_cap ? cmds->arg_cap * 2 : 64;
+        char** args = realloc(cmds->args, cap * sizeof(char*));
+        if (!args) return -1;
+        cmds->args = args;
+        unsigned char* flags = realloc(cmds->arg_glob, cap);
+        if (!flags) return -1;
+        cmds->arg_glob = flags;
+        cmds->arg_cap = cap;
+    }
+    cmds->args[cmds->arg_count] = arg;
+    cmds->arg_glob[cmds->arg_count++] = glob;
+    return 0;
+}
+
+/**
+ * Parse one command from the token stream, handling I/O redirection
+ * Stops at the first operator that is not a redirection. Arguments are
+ * appended to cmds->args; stage->args is pointed at them by parse_list once
+ * the vector has stopped growing.
+ * @param list Token list
+ * @param pos Index of the first token; advanced past the command
+ * @param cmds Command list owning the argument vector
+ * @param stage Stage receiving arguments and redirections
+ * @return 0 on success, -1 on syntax error
+ */
+int parse_command(const TokenList* list, int* pos, CommandList* cmds, Stage* stage) {
+    stage->first_arg = cmds->arg_count;
+    stage->argc = 0;
+    stage->args = NULL;
+    stage->glob = NULL;
+    stage->infile = NULL;
+    stage->outfile = NULL;
+    stage->append = 0;
+
+    while (*pos < list->count) {
+        const Token* tok = &list->tokens[*pos];
+        if (tok->kind != TOK_WORD && tok->kind != TOK_LT && tok->kind != TOK_GT &&
+            tok->kind != TOK_APPEND) break;
+        (*pos)++;
+
+        if (tok->kind == TOK_LT || tok->kind == TOK_GT || tok->kind == TOK_APPEND) {
+            /* Redirection takes the following word as its target */
+            if (*pos >= list->count || list->tokens[*pos].kind != TOK_WORD) {
+                fprintf(stderr, "ccsh: syntax error near unexpected token `%s'\n",
+                        *pos < list->count ? token_text(list->tokens[*pos].kind) : "newline");
+                return -1;
+            }
+            char* target = token_word(list, (*pos)++);
+            ctl_unquote(target);  /* Targets are never globbed */
+            if (tok->kind == TOK_LT) {
+                stage->infile = target;
+            } else {
+                stage->outfile = target;
+                stage->append = tok->kind == TOK_APPEND;
+            }
+        } else {
+            /* Regular argument */
+            if (command_list_push_arg(cmds, token_word(list, *pos - 1), tok->flags & (TOKF_GLOB | TOKF_EXPAND)) != 0) {
+                fprintf(stderr, "ccsh: out of memory\n");
+                return -1;
+            }
+            stage->argc++;
+        }
+    }
+    return command_list_push_arg(cmds, NULL, 0);  /* Null-terminate argument list */
+}
+
+/**
+ * Expand aliases in the token stream
+ * The first word of every command is replaced by the tokens of its alias value,
+ * recursively unless the alias refers to itself; a value ending in a blank
+ * makes the following word eligible too. Quoted words and words with $
+ * substitutions are never expanded.
+ * @param list Token list, edited in place
+ * @return 0 on success, -1 on syntax error in an alias value
+ */
+int expand_alias(TokenList* list) {
+    size_t active[16];  /* Word offsets of aliases expanded at the current position */
+    int active_count = 0;
+    int expansions = 0;
+    int command_start = 1;
+
+    for (int i = 0; i < list->count; ) {
+        Token tok = list->tokens[i];
+        if (tok.kind != TOK_WORD) {
+            command_start = tok.kind == TOK_PIPE || tok.kind == TOK_SEMI || tok.kind == TOK_AMP ||
+                            tok.kind == TOK_AND || tok.kind == TOK_OR;
+            active_count = 0;
+            i++;
+            continue;
+        }
+
+        const char* value = NULL;
+        if (command_start && !(tok.flags & (TOKF_QUOTED | TOKF_EXPAND)) && expansions < 64) {
+            value = get_alias_value(token_word(list, i));
+            for (int j = 0; value && j < active_count; j++) {
+                if (strcmp(list->words + active[j], token_word(list, i)) == 0) value = NULL;
+            }
+        }
+        if (!value || active_count == (int)(sizeof(active) / sizeof(active[0]))) {
+            /* The time prefix leaves the next word in command position */
+            command_start = command_start && !(tok.flags & (TOKF_QUOTED | TOKF_EXPAND)) &&
+                            strcmp(token_word(list, i), "time") == 0;
+            active_count = 0;
+            i++;
+            continue;
+        }
+
+        /* Lex the value onto the end of the list, then rotate it into place */
+        int old_count = list->count;
+        if (tokenize_append(list, value) != 0) return -1;
+        int added = list->count - old_count;
+        for (int j = old_count; j < list->count; j++) {
+            list->tokens[j].start = tok.start;
+            list->tokens[j].len = tok.len;
+        }
+        if (added > list->scratch_cap) {
+            Token* scratch = realloc(list->scratch, added * sizeof(Token));
+            if (!scratch) return -1;
+            list->scratch = scratch;
+            list->scratch_cap = added;
+        }
+        memcpy(list->scratch, list->tokens + old_count, added * sizeof(Token));
+        memmove(list->tokens + i + added, list->tokens + i + 1,
+                (old_count - i - 1) * sizeof(Token));
+        memcpy(list->tokens + i, list->scratch, added * sizeof(Token));
+        list->count = old_count - 1 + added;
+        expansions++;
+
+        /* Word offsets survive the word buffer growing */
+        active[active_count++] = tok.word;
+        size_t value_len = strlen(value);
+        if (added == 0 || (value_len && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))) {
+            /* Trailing blank: the word after the value is also checked */
+            i += added;
+            command_start = 1;
+            active_count = 0;
+        }
+    }
+    return 0;
+}
+
+/* Timing and trace functions */
+
+/**
+ * Monotonic clock reading
+ * @return Nanoseconds since an arbitrary fixed point
+ */
+uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Open the trace log named by $CCSH_TRACE, if any
+ * Lines are appended through an OutBuf and written when it fills, before
+ * each prompt and at exit
+ */
+void trace_init() {
+    const char* file = getenv("CCSH_TRACE");
+    if (!file || !*file) return;
+    int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "ccsh: CCSH_TRACE: %s: %s\n", file, strerror(errno));
+        return;
+    }
+    trace_out = malloc(sizeof(OutBuf));
+    outbuf_init(trace_out, fd);
+    trace_epoch = clock_ns();
+}
+
+/**
+ * Start timing a traced phase
+ * @return Start time, or 0 when tracing is off (no clock read)
+ */
+uint64_t trace_start() {
+    return trace_out ? clock_ns() : 0;
+}
+
+/**
+ * Log one phase: time since startup, duration, phase name and detail
+ * @param start Value returned by trace_start
+ * @param phase Phase name (lex, alias, parse, glob, spawn, fork, exec, wait, builtin)
+ * @param detail What the phase worked on (first line only)
+ * @param number Extra number shown after the detail (pid, count), or -1
+ */
+void trace_event(uint64_t start, const char* phase, const char* detail, long number) {
+    if (!trace_out) return;
+    uint64_t now = clock_ns();
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%llu.%06llu %lluus %s %.*s",
+                       (unsigned long long)((now - trace_epoch) / 1000000000ull),
+                       (unsigned long long)((now - trace_epoch) / 1000 % 1000000),
+                       (unsigned long long)((now - start) / 1000), phase,
+                       (int)strcspn(detail, "\n"), detail);
+    if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+    if (number >= 0) len += snprintf(line + len, sizeof(line) - len, " %ld", number);
+    if (len >= (int)sizeof(line) - 1) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    outbuf_write(trace_out, line, (size_t)len);
+}
+
+/**
+ * Write buffered trace lines to the log
+ */
+void trace_flush() {
+    if (trace_out) outbuf_flush(trace_out);
+}
+
+/**
+ * Drop trace lines a forked child inherited from the parent's buffer
+ * The parent still writes them, so the child must not write them twice
+ */
+void trace_forked() {
+    if (trace_out) trace_out->len = 0;
+}
+
+/**
+ * Add a reaped child's resource usage to the time accumulator
+ * @param usage Usage returned by wait4
+ */
+void child_usage_add(const struct rusage* usage) {
+    timeradd(&child_usage.ru_utime, &usage->ru_utime, &child_usage.ru_utime);
+    timeradd(&child_usage.ru_stime, &usage->ru_stime, &child_usage.ru_stime);
+    if (usage->ru_maxrss > child_usage.ru_maxrss) child_usage.ru_maxrss = usage->ru_maxrss;
+    child_usage.ru_nvcsw += usage->ru_nvcsw;
+    child_usage.ru_nivcsw += usage->ru_nivcsw;
+}
+
+/**
+ * Start measuring a pipeline prefixed with time
+ * @param sample Receives the starting clock and the shell's own usage
+ */
+void time_begin(TimeSample* sample) {
+    memset(&child_usage, 0, sizeof(child_usage));
+    getrusage(RUSAGE_SELF, &sample->self);
+    sample->start = clock_ns();
+}
+
+/**
+ * Print one time line in bash's 0m0.000s format
+ * @param label Line label
+ * @param usec Duration in microseconds
+ */
+static void time_print(const char* label, uint64_t usec) {
+    fprintf(stderr, "%s\t%llum%llu.%03llus\n", label, (unsigned long long)(usec / 60000000ull),
+            (unsigned long long)(usec / 1000000ull % 60), (unsigned long long)(usec / 1000 % 1000));
+}
+
+/**
+ * Report wall, user and sys time, peak RSS and context switches on stderr
+ * User and sys time cover the children reaped with wait4 plus the shell's own
+ * work, so builtins and shell overhead are included
+ * @param sample Values recorded by time_begin
+ */
+void time_report(const TimeSample* sample) {
+    uint64_t wall = (clock_ns() - sample->start) / 1000;
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    struct timeval user, sys;
+    timersub(&self.ru_utime, &sample->self.ru_utime, &user);
+    timersub(&self.ru_stime, &sample->self.ru_stime, &sys);
+    timeradd(&user, &child_usage.ru_utime, &user);
+    timeradd(&sys, &child_usage.ru_stime, &sys);
+
+    /* Peak RSS of the largest child, or of the shell if no child ran */
+    long maxrss = child_usage.ru_maxrss ? child_usage.ru_maxrss : self.ru_maxrss;
+#ifdef __APPLE__
+    maxrss /= 1024;  /* Reported in bytes rather than kilobytes */
+#endif
+
+    time_print("real", wall);
+    time_print("user", (uint64_t)user.tv_sec * 1000000ull + (uint64_t)user.tv_usec);
+    time_print("sys", (uint64_t)sys.tv_sec * 1000000ull + (uint64_t)sys.tv_usec);
+    fprintf(stderr, "maxrss\t%ldk\n", maxrss);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n",
+            child_usage.ru_nvcsw + (self.ru_nvcsw - sample->self.ru_nvcsw),
+            child_usage.ru_nivcsw + (self.ru_nivcsw - sample->self.ru_nivcsw));
+}
+
+/* Process launch functions */
+
+/**
+ * Mark a descriptor close-on-exec so spawned commands never inherit it
+ * @param fd File descriptor
+ */
+void set_cloexec(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags != -1) fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+/**
+ * Launch a command with fork()
+ * General path: arbitrary child-side setup can happen between fork and exec,
+ * which is also how builtins run as pipeline stages
+ * @param spec Command, redirections, pipe ends and process group
+ * @param builtin Set to 1 to run a builtin in the child instead of exec
+ * @param pipe_fds Every open pipe descriptor of the pipeline (closed in the child)
+ * @param pipe_fd_count Number of entries in pipe_fds
+ * @return Child PID or -1 on failure
+ */
+pid_t fork_command(const LaunchSpec* spec, int builtin, const int* pipe_fds, int pipe_fd_count) {
+    uint64_t start = trace_start();
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Child process */
+        trace_forked();
+        signal(SIGINT, SIG_DFL);  /* Reset signal handlers for child */
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGWINCH, SIG_DFL);
+        if (job_control) setpgid(0, spec->pgid);
+
+        /* Connect pipeline ends, then drop every other pipe descriptor */
+        if (spec->in_fd != -1) dup2(spec->in_fd, STDIN_FILENO);
+        if (spec->out_fd != -1) dup2(spec->out_fd, STDOUT_FILENO);
+        for (int i = 0; i < pipe_fd_count; i++) {
+            if (pipe_fds[i] > STDERR_FILENO) close(pipe_fds[i]);
+        }
+        
+        /* Handle input redirection */
+        if (spec->infile) {
+            int fd = open(spec->infile, O_RDONLY);
+            if (fd == -1) { 
+                perror("input"); 
+                exit(1); 
+            }
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+        
+        /* Handle output redirection */
+        if (spec->outfile) {
+            int flags = O_WRONLY | O_CREAT;
+            if (spec->append) flags |= O_APPEND;
+            else flags |= O_TRUNC;
+            
+            int fd = open(spec->outfile, flags, 0644);
+            if (fd == -1) { 
+                perror("output"); 
+                exit(1); 
+            }
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+
+        if (builtin) {
+            IoCtx io = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, NULL };
+            int status = run_builtin(find_builtin(spec->argv[0]), spec->argv, &io);
+            fflush(stdout);
+            trace_flush();
+            _exit(status);
+        }
+
+        /* The log is opened O_APPEND, so this line lands whole beside the parent's */
+        trace_event(start, "exec", spec->argv[0], (long)getpid());
+        trace_flush();
+        
+        /* Execute command, skipping the PATH search when it is hashed */
+        if (spec->resolved) execv(spec->resolved, spec->argv);
+        if (execvp(spec->argv[0], spec->argv) == -1) {
+            perror("execvp");
+            exit(1);
+        }
+    } else if (pid > 0) {
+        /* Set the group from the parent too so it exists before we hand off the terminal */
+        if (job_control) setpgid(pid, spec->pgid ? spec->pgid : pid);
+        trace_event(start, "fork", spec->argv[0], (long)pid);
+    } else {
+        /* Fork failed */
+        perror("fork");
+    }
+    return pid;
+}
+
+/**
+ * Launch an external command with posix_spawn
+ * Fast path: no page-table copy, redirections expressed as file actions.
+ * Pipe descriptors are close-on-exec, so only the dup2'd ends survive.
+ * @param spec Command, redirections, pipe ends and process group
+ * @return Child PID or -1 on failure
+ */
+pid_t spawn_command(const LaunchSpec* spec) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    pid_t pid;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+    posix_spawn_file_actions_init(&actions);
+    if (spec->in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, spec->in_fd, STDIN_FILENO);
+    }
+    if (spec->out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, spec->out_fd, STDOUT_FILENO);
+    }
+    if (spec->infile) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, spec->infile, O_RDONLY, 0);
+    }
+    if (spec->outfile) {
+        int oflags = O_WRONLY | O_CREAT | (spec->append ? O_APPEND : O_TRUNC);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, spec->outfile, oflags, 0644);
+    }
+
+    /* Give the child default signal dispositions and an empty mask */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTSTP);
+    sigaddset(&signals, SIGTTIN);
+    sigaddset(&signals, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    if (job_control) {
+        posix_spawnattr_setpgroup(&attr, spec->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    /* posix_spawn returns once the child has exec'd, so this phase covers both */
+    uint64_t start = trace_start();
+    int err;
+    if (spec->resolved) {
+        err = posix_spawn(&pid, spec->resolved, &actions, &attr, spec->argv, environ);
+    } else {
+        err = posix_spawnp(&pid, spec->argv[0], &actions, &attr, spec->argv, environ);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+        fprintf(stderr, "ccsh: %s: %s\n", spec->argv[0], strerror(err));
+        return -1;
+    }
+    trace_event(start, "spawn", spec->argv[0], (long)pid);
+    return pid;
+}
+
+/**
+ * Launch an external command using the engine selected by 'set -o spawn'
+ * @param spec Command, redirections, pipe ends and process group
+ * @param pipe_fds Every open pipe descriptor of the pipeline
+ * @param pipe_fd_count Number of entries in pipe_fds
+ * @return Child PID or -1 on failure
+ */
+pid_t launch_command(const LaunchSpec* spec, const int* pipe_fds, int pipe_fd_count) {
+    if (opt_spawn) {
+        return spawn_command(spec);
+    }
+    return fork_command(spec, 0, pipe_fds, pipe_fd_count);
+}
+
+/**
+ * Convert a waitpid status into a shell exit status
+ * @param status Status from waitpid
+ * @return Exit code, or 128 + signal number if the process was killed
+ */
+int decode_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+/**
+ * Wait for every process of a foreground job, or until it is stopped
+ * Hands the terminal to the job's process group while it runs and takes it
+ * back, with the shell's terminal modes, afterwards
+ * @param pids Process IDs to wait for (0 entries are skipped; reaped ones
+ *             are set to 0)
+ * @param count Number of entries in pids
+ * @param pgid Process group of the job (0 if none)
+ * @param stopped Set to 1 if the job was stopped (Ctrl+Z) instead of exiting
+ * @return Exit status of the last process, or 128 + the stop signal
+ */
+int wait_for_pids(pid_t* pids, int count, pid_t pgid, int* stopped) {
+    int result = (count > 0 && pids[count - 1] > 0) ? 0 : 127;
+    *stopped = 0;
+
+    if (job_control && pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+        /* Resume anything that stopped on terminal input before the handoff */
+        kill(-pgid, SIGCONT);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (pids[i] <= 0) continue;
+        uint64_t start = trace_start();
+        int status = 0;
+        struct rusage usage;
+        pid_t reaped;
+        while ((reaped = wait4(pids[i], &status, WUNTRACED, &usage)) == -1) {
+            if (errno != EINTR) break;
+        }
+        trace_event(start, "wait", "pid", (long)pids[i]);
+        if (reaped > 0 && WIFSTOPPED(status)) {
+            /* The terminal stopped the whole group; the caller keeps it as a job */
+            *stopped = 1;
+            result = 128 + WSTOPSIG(status);
+            break;
+        }
+        if (reaped > 0) child_usage_add(&usage);
+        if (i == count - 1) result = decode_status(status);
+        pids[i] = 0;
+    }
+
+    if (job_control && pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    return result;
+}
+
+/* Shell option functions */
+
+/**
+ * Built-in set command implementation
+ * set -o         - list options and their state
+ * set -o name    - enable an option
+ * set +o name    - disable an option
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0 on success, 1 on error
+ */
+int builtin_set(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    if (!args[1] || (strcmp(args[1], "-o") == 0 && !args[2])) {
+        for (int i = 0; shell_options[i].name; i++) {
+            outbuf_printf(io->out, "%-12s %s\n", shell_options[i].name, *shell_options[i].value ? "on" : "off");
+        }
+        return 0;
+    }
+
+    int enable;
+    if (strcmp(args[1], "-o") == 0) enable = 1;
+    else if (strcmp(args[1], "+o") == 0) enable = 0;
+    else {
+        fprintf(stderr, "Usage: set [-o|+o] [option]\n");
+        return 1;
+    }
+
+    if (!args[2]) {
+        fprintf(stderr, "Usage: set [-o|+o] [option]\n");
+        return 1;
+    }
+
+    for (int i = 0; shell_options[i].name; i++) {
+        if (strcmp(shell_options[i].name, args[2]) == 0) {
+            *shell_options[i].value = enable;
+            return 0;
+        }
+    }
+    fprintf(stderr, "set: %s: invalid option name\n", args[2]);
+    return 1;
+}
+
+/* Pattern matching functions */
+
+/* ASCII case-folding table, built on first use */
+static unsigned char fold_table[256];
+static int fold_table_ready = 0;
+
+/**
+ * Build the ASCII case-folding table used for -i comparisons
+ */
+void init_fold_table() {
+    if (fold_table_ready) return;
+    for (int c = 0; c < 256; c++) {
+        fold_table[c] = (unsigned char)tolower(c);
+    }
+    fold_table_ready = 1;
+}
+
+/**
+ * Check a candidate position against the whole pattern
+ * @param m Prepared matcher
+ * @param text Candidate start (at least m->len bytes available)
+ * @return 1 if the pattern matches at text, 0 otherwise
+ */
+static inline int matcher_verify(const Matcher* m, const char* text) {
+    if (!m->case_insensitive) {
+        return memcmp(text, m->pattern, m->len) == 0;
+    }
+    const unsigned char* t = (const unsigned char*)text;
+    const unsigned char* p = (const unsigned char*)m->pattern;
+    for (size_t i = 0; i < m->len; i++) {
+        if (fold_table[t[i]] != fold_table[p[i]]) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Scalar search used for short inputs, vector tails and unsupported CPUs
+ * @param m Prepared matcher
+ * @param text Text to search
+ * @param len Length of text
+ * @return Pointer to the first match or NULL
+ */
+static const char* matcher_find_scalar(const Matcher* m, const char* text, size_t len) {
+    if (len < m->len) return NULL;
+    const char* last = text + (len - m->len);
+
+    if (!m->case_insensitive) {
+        /* memchr is already vectorized by libc for the first byte */
+        const char* p = text;
+        while (p <= last && (p = memchr(p, m->first_lo, (size_t)(last - p) + 1)) != NULL) {
+            if ((unsigned char)p[m->len - 1] == m->last_lo && matcher_verify(m, p)) return p;
+            p++;
+        }
+        return NULL;
+    }
+
+    for (const char* p = text; p <= last; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c == m->first_lo || c == m->first_up) && matcher_verify(m, p)) return p;
+    }
+    return NULL;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/**
+ * SSE2 search: filter 16 candidate positions at once on first and last byte
+ */
+__attribute__((target("sse2")))
+static const char* matcher_find_sse2(const Matcher* m, const char* text, size_t len) {
+    if (len < m->len + 16) return matcher_find_scalar(m, text, len);
+    size_t last = len - m->len;
+    const __m128i first_lo = _mm_set1_epi8((char)m->first_lo);
+    const __m128i first_up = _mm_set1_epi8((char)m->first_up);
+    const __m128i last_lo = _mm_set1_epi8((char)m->last_lo);
+    const __m128i last_up = _mm_set1_epi8((char)m->last_up);
+    size_t i = 0;
+
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(text + i + m->len - 1));
+        __m128i ma = _mm_or_si128(_mm_cmpeq_epi8(a, first_lo), _mm_cmpeq_epi8(a, first_up));
+        __m128i mb = _mm_or_si128(_mm_cmpeq_epi8(b, last_lo), _mm_cmpeq_epi8(b, last_up));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(ma, mb));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (matcher_verify(m, text + i + bit)) return text + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    const char* rest = matcher_find_scalar(m, text + i, len - i);
+    return rest;
+}
+
+/**
+ * AVX2 search: same filter as SSE2 over 32 candidate positions
+ */
+__attribute__((target("avx2")))
+static const char* matcher_find_avx2(const Matcher* m, const char* text, size_t len) {
+    if (len < m->len + 32) return matcher_find_sse2(m, text, len);
+    size_t last = len - m->len;
+    const __m256i first_lo = _mm256_set1_epi8((char)m->first_lo);
+    const __m256i first_up = _mm256_set1_epi8((char)m->first_up);
+    const __m256i last_lo = _mm256_set1_epi8((char)m->last_lo);
+    const __m256i last_up = _mm256_set1_epi8((char)m->last_up);
+    size_t i = 0;
+
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(text + i + m->len - 1));
+        __m256i ma = _mm256_or_si256(_mm256_cmpeq_epi8(a, first_lo), _mm256_cmpeq_epi8(a, first_up));
+        __m256i mb = _mm256_or_si256(_mm256_cmpeq_epi8(b, last_lo), _mm256_cmpeq_epi8(b, last_up));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(ma, mb));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (matcher_verify(m, text + i + bit)) return text + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return matcher_find_sse2(m, text + i, len - i);
+}
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+/**
+ * NEON search: filter 16 candidate positions at once on first and last byte
+ */
+static const char* matcher_find_neon(const Matcher* m, const char* text, size_t len) {
+    if (len < m->len + 16) return matcher_find_scalar(m, text, len);
+    size_t last = len - m->len;
+    const uint8x16_t first_lo = vdupq_n_u8(m->first_lo);
+    const uint8x16_t first_up = vdupq_n_u8(m->first_up);
+    const uint8x16_t last_lo = vdupq_n_u8(m->last_lo);
+    const uint8x16_t last_up = vdupq_n_u8(m->last_up);
+    size_t i = 0;
+
+    for (; i + 16 <= last + 1; i += 16) {
+        uint8x16_t a = vld1q_u8((const uint8_t*)(text + i));
+        uint8x16_t b = vld1q_u8((const uint8_t*)(text + i + m->len - 1));
+        uint8x16_t ma = vorrq_u8(vceqq_u8(a, first_lo), vceqq_u8(a, first_up));
+        uint8x16_t mb = vorrq_u8(vceqq_u8(b, last_lo), vceqq_u8(b, last_up));
+        /* Narrow to 4 bits per lane to get a scalar candidate mask */
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(ma, mb)), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask) >> 2;
+            if (matcher_verify(m, text + i + bit)) return text + i + bit;
+            mask &= ~(0xFULL << (bit * 4));
+        }
+    }
+    return matcher_find_scalar(m, text + i, len - i);
+}
+#endif
+
+/**
+ * Prepare a pattern once for repeated searching
+ * Precomputes first/last bytes (both cases for -i) and picks the widest
+ * vector search the CPU supports
+ * @param m Matcher to initialize
+ * @param pattern Fixed string to search for (must outlive the matcher)
+ * @param case_insensitive Whether to ignore ASCII case
+ */
+void matcher_init(Matcher* m, const char* pattern, int case_insensitive) {
+    init_fold_table();
+    m->pattern = pattern;
+    m->len = strlen(pattern);
+    m->case_insensitive = case_insensitive;
+
+    unsigned char first = m->len ? (unsigned char)pattern[0] : 0;
+    unsigned char last = m->len ? (unsigned char)pattern[m->len - 1] : 0;
+    m->first_lo = m->first_up = first;
+    m->last_lo = m->last_up = last;
+    if (case_insensitive) {
+        m->first_lo = (unsigned char)tolower(first);
+        m->first_up = (unsigned char)toupper(first);
+        m->last_lo = (unsigned char)tolower(last);
+        m->last_up = (unsigned char)toupper(last);
+    }
+
+    m->find = matcher_find_scalar;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) m->find = matcher_find_avx2;
+    else if (__builtin_cpu_supports("sse2")) m->find = matcher_find_sse2;
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    m->find = matcher_find_neon;
+#endif
+}
+
+/**
+ * Find the first occurrence of the pattern in a block of text
+ * @param m Prepared matcher
+ * @param text Text to search (need not be NUL-terminated)
+ * @param len Length of text
+ * @return Pointer to the first match or NULL
+ */
+const char* matcher_find(const Matcher* m, const char* text, size_t len) {
+    if (m->len == 0) return text;
+    return m->find(m, text, len);
+}
+
+/**
+ * Simple pattern matching function for grep
+ * @param text Text to search in
+ * @param pattern Pattern to search for
+ * @param case_insensitive Whether to ignore case
+ * @return 1 if pattern matches, 0 otherwise
+ */
+int simple_match(const char* text, const char* pattern, int case_insensitive) {
+    if (!text || !pattern) return 0;
+    
+    Matcher m;
+    matcher_init(&m, pattern, case_insensitive);
+    return matcher_find(&m, text, strlen(text)) != NULL;
+}
+
+/* Multi-pattern (Aho-Corasick) functions */
+
+/**
+ * Build an Aho-Corasick automaton over several fixed strings
+ * Failure links are folded into a full 256-way transition table, so the
+ * scan is one table lookup per input byte for any number of patterns
+ * @param patterns Strings to search for
+ * @param count Number of patterns
+ * @param case_insensitive Whether to ignore ASCII case
+ * @return Automaton (free with ac_free)
+ */
+AhoCorasick* ac_build(const char** patterns, int count, int case_insensitive) {
+    init_fold_table();
+    AhoCorasick* ac = calloc(1, sizeof(AhoCorasick));
+    ac->case_insensitive = case_insensitive;
+    ac->cap = 64;
+    ac->next = malloc((size_t)ac->cap * 256 * sizeof(int));
+    ac->terminal = calloc((size_t)ac->cap, 1);
+    memset(ac->next, -1, 256 * sizeof(int));
+    ac->node_count = 1;
+
+    /* Insert every pattern into the trie */
+    for (int i = 0; i < count; i++) {
+        const unsigned char* p = (const unsigned char*)patterns[i];
+        if (!*p) ac->has_empty = 1;
+        int node = 0;
+        for (; *p; p++) {
+            int c = case_insensitive ? fold_table[*p] : *p;
+            if (ac->next[node * 256 + c] == -1) {
+                if (ac->node_count == ac->cap) {
+                    ac->cap *= 2;
+                    ac->next = realloc(ac->next, (size_t)ac->cap * 256 * sizeof(int));
+                    ac->terminal = realloc(ac->terminal, (size_t)ac->cap);
+                    memset(ac->terminal + ac->node_count, 0, (size_t)(ac->cap - ac->node_count));
+                }
+                memset(ac->next + ac->node_count * 256, -1, 256 * sizeof(int));
+                ac->next[node * 256 + c] = ac->node_count++;
+            }
+            node = ac->next[node * 256 + c];
+        }
+        ac->terminal[node] = 1;
+    }
+
+    /* Breadth-first pass: resolve failure links into direct transitions */
+    int* fail = calloc((size_t)ac->node_count, sizeof(int));
+    int* queue = malloc((size_t)ac->node_count * sizeof(int));
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        int child = ac->next[c];
+        if (child == -1) {
+            ac->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int node = queue[head++];
+        ac->terminal[node] |= ac->terminal[fail[node]];
+        for (int c = 0; c < 256; c++) {
+            int child = ac->next[node * 256 + c];
+            int via_fail = ac->next[fail[node] * 256 + c];
+            if (child == -1) {
+                ac->next[node * 256 + c] = via_fail;
+            } else {
+                fail[child] = via_fail;
+                queue[tail++] = child;
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+
+    /* Under -i, upper-case bytes follow the same edges as lower-case ones */
+    if (case_insensitive) {
+        for (int node = 0; node < ac->node_count; node++) {
+            for (int c = 0; c < 256; c++) {
+                ac->next[node * 256 + c] = ac->next[node * 256 + fold_table[c]];
+            }
+        }
+    }
+    return ac;
+}
+
+/**
+ * Find the first byte at which any pattern ends
+ * @param ac Automaton
+ * @param text Text to search (starting at a line boundary)
+ * @param len Length of text
+ * @return Pointer inside the first matching line, or NULL
+ */
+const char* ac_find(const AhoCorasick* ac, const char* text, size_t len) {
+    if (ac->has_empty) return len > 0 ? text : NULL;
+    const unsigned char* p = (const unsigned char*)text;
+    const unsigned char* end = p + len;
+    const int* next = ac->next;
+    int state = 0;
+    for (; p < end; p++) {
+        state = next[state * 256 + *p];
+        if (ac->terminal[state]) return (const char*)p;
+    }
+    return NULL;
+}
+
+/**
+ * Free an Aho-Corasick automaton
+ * @param ac Automaton
+ */
+void ac_free(AhoCorasick* ac) {
+    if (!ac) return;
+    free(ac->next);
+    free(ac->terminal);
+    free(ac);
+}
+
+/* Regular expression functions */
+
+/* Syntax tree node types */
+enum { RE_AST_SET, RE_AST_CAT, RE_AST_ALT, RE_AST_REPEAT, RE_AST_BOL, RE_AST_EOL, RE_AST_EMPTY };
+
+/* Syntax tree node produced by the ERE parser */
+typedef struct {
+    int type;         /* RE_AST_* */
+    int set;          /* Byte set index for RE_AST_SET */
+    int min, max;     /* Repeat bounds for RE_AST_REPEAT (max -1 = unbounded) */
+    int left, right;  /* Child node indexes (-1 if none) */
+} ReNode;
+
+/* Parser state for one pattern */
+typedef struct {
+    const char* p;          /* Current position in the pattern */
+    RegexProgram* prog;     /* Program receiving byte sets */
+    ReNode* nodes;          /* Syntax tree storage */
+    int node_count, node_cap;
+    const char* error;      /* First error message, NULL if none */
+} ReParser;
+
+/**
+ * Add a 256-bit byte set to a program
+ * @param prog Program
+ * @return Index of the new, empty set
+ */
+static int re_new_set(RegexProgram* prog) {
+    if (prog->set_count == prog->set_cap) {
+        prog->set_cap = prog->set_cap ? prog->set_cap * 2 : 16;
+        prog->sets = realloc(prog->sets, (size_t)prog->set_cap * 32);
+    }
+    memset(prog->sets[prog->set_count], 0, 32);
+    return prog->set_count++;
+}
+
+/**
+ * Add a byte to a set, with its other case under -i
+ */
+static void re_set_add(RegexProgram* prog, int set, int c) {
+    prog->sets[set][c >> 3] |= (unsigned char)(1 << (c & 7));
+    if (prog->case_insensitive && isalpha(c)) {
+        int other = islower(c) ? toupper(c) : tolower(c);
+        prog->sets[set][other >> 3] |= (unsigned char)(1 << (other & 7));
+    }
+}
+
+/**
+ * Add a syntax tree node
+ */
+static int re_node(ReParser* ps, int type, int left, int right) {
+    if (ps->node_count == ps->node_cap) {
+        ps->node_cap = ps->node_cap ? ps->node_cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, (size_t)ps->node_cap * sizeof(ReNode));
+    }
+    ReNode* n = &ps->nodes[ps->node_count];
+    n->type = type;
+    n->set = -1;
+    n->min = n->max = 0;
+    n->left = left;
+    n->right = right;
+    return ps->node_count++;
+}
+
+/**
+ * Add the bytes of a \d, \w or \s shorthand (or its negation) to a set
+ * @return 1 if c named a shorthand class, 0 otherwise
+ */
+static int re_add_shorthand(RegexProgram* prog, int set, int c) {
+    int negate = isupper(c);
+    int lower = tolower(c);
+    if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+    for (int b = 0; b < 256; b++) {
+        int in = lower == 'd' ? isdigit(b) : lower == 'w' ? (isalnum(b) || b == '_') : isspace(b);
+        if ((in != 0) != negate) prog->sets[set][b >> 3] |= (unsigned char)(1 << (b & 7));
+    }
+    return 1;
+}
+
+/**
+ * Parse a bracket expression such as [a-z_], [^0-9] or [[:alpha:]]
+ * @param ps Parser positioned just after '['
+ * @return Set node index
+ */
+static int re_parse_bracket(ReParser* ps) {
+    int set = re_new_set(ps->prog);
+    int negate = 0;
+    if (*ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        if (ps->p[0] == '[' && ps->p[1] == ':') {
+            /* Named character class */
+            static const struct { const char* name; int (*test)(int); } classes[] = {
+                { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+                { "upper", isupper }, { "lower", islower }, { "space", isspace },
+                { "punct", ispunct }, { "xdigit", isxdigit }, { "print", isprint },
+                { "graph", isgraph }, { "cntrl", iscntrl }, { "blank", isblank },
+                { NULL, NULL }
+            };
+            const char* close = strstr(ps->p + 2, ":]");
+            if (!close) break;
+            size_t len = (size_t)(close - (ps->p + 2));
+            int found = 0;
+            for (int i = 0; classes[i].name; i++) {
+                if (strlen(classes[i].name) == len && strncmp(classes[i].name, ps->p + 2, len) == 0) {
+                    for (int b = 0; b < 256; b++) {
+                        if (classes[i].test(b)) re_set_add(ps->prog, set, b);
+                    }
+                    found = 1;
+                }
+            }
+            if (!found) {
+                ps->error = "Invalid character class name";
+                return -1;
+            }
+            ps->p = close + 2;
+            continue;
+        }
+
+        int lo = (unsigned char)*ps->p++;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            int hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi < lo) {
+                ps->error = "Invalid range end";
+                return -1;
+            }
+            for (int b = lo; b <= hi; b++) re_set_add(ps->prog, set, b);
+        } else {
+            re_set_add(ps->prog, set, lo);
+        }
+    }
+    if (*ps->p != ']') {
+        ps->error = "Unmatched [, [^, [:, [., or [=";
+        return -1;
+    }
+    ps->p++;
+
+    if (negate) {
+        for (int i = 0; i < 32; i++) ps->prog->sets[set][i] = (unsigned char)~ps->prog->sets[set][i];
+    }
+    /* Lines never contain their own newline */
+    ps->prog->sets[set]['\n' >> 3] &= (unsigned char)~(1 << ('\n' & 7));
+
+    int node = re_node(ps, RE_AST_SET, -1, -1);
+    ps->nodes[node].set = set;
+    return node;
+}
+
+static int re_parse_alt(ReParser* ps);
+
+/**
+ * Parse a single atom: literal, '.', bracket, group, anchor or escape
+ * Escaped punctuation is literal; \d, \w and \s are the only escaped letters
+ * @return Node index, or -1 on error or when no atom starts here
+ */
+static int re_parse_atom(ReParser* ps) {
+    char c = *ps->p;
+    if (c == '(') {
+        ps->p++;
+        int inner = re_parse_alt(ps);
+        if (inner < 0) return -1;
+        if (*ps->p != ')') {
+            ps->error = "Unmatched ( or \\(";
+            return -1;
+        }
+        ps->p++;
+        return inner;
+    }
+    if (c == '[') {
+        ps->p++;
+        return re_parse_bracket(ps);
+    }
+    if (c == '^') {
+        ps->p++;
+        return re_node(ps, RE_AST_BOL, -1, -1);
+    }
+    if (c == '$') {
+        ps->p++;
+        return re_node(ps, RE_AST_EOL, -1, -1);
+    }
+
+    int set = re_new_set(ps->prog);
+    if (c == '.') {
+        for (int b = 0; b < 256; b++) {
+            if (b != '\n') re_set_add(ps->prog, set, b);
+        }
+        ps->p++;
+    } else if (c == '\\') {
+        if (!ps->p[1]) {
+            ps->error = "Trailing backslash";
+            return -1;
+        }
+        int e = (unsigned char)ps->p[1];
+        if (!re_add_shorthand(ps->prog, set, e)) {
+            /* Word boundaries, backreferences and the like are not implemented */
+            if (isalnum(e) || e == '<' || e == '>' || e == '`' || e == '\'') {
+                ps->error = "unsupported escape";
+                return -1;
+            }
+            re_set_add(ps->prog, set, e);
+        }
+        ps->p += 2;
+    } else {
+        re_set_add(ps->prog, set, (unsigned char)c);
+        ps->p++;
+    }
+    int node = re_node(ps, RE_AST_SET, -1, -1);
+    ps->nodes[node].set = set;
+    return node;
+}
+
+/**
+ * Parse an atom followed by any number of *, +, ? or {m,n} operators
+ */
+static int re_parse_repeat(ReParser* ps) {
+    int node = re_parse_atom(ps);
+    while (node >= 0) {
+        int min, max;
+        char c = *ps->p;
+        if (c == '*') { min = 0; max = -1; ps->p++; }
+        else if (c == '+') { min = 1; max = -1; ps->p++; }
+        else if (c == '?') { min = 0; max = 1; ps->p++; }
+        else if (c == '{' && isdigit((unsigned char)ps->p[1])) {
+            char* end;
+            min = (int)strtol(ps->p + 1, &end, 10);
+            max = min;
+            if (*end == ',') {
+                end++;
+                max = isdigit((unsigned char)*end) ? (int)strtol(end, &end, 10) : -1;
+            }
+            if (*end != '}' || (max != -1 && max < min) || min > RE_MAX_REPEAT || max > RE_MAX_REPEAT) {
+                ps->error = "Invalid content of \\{\\}";
+                return -1;
+            }
+            ps->p = end + 1;
+        } else {
+            break;
+        }
+        int rep = re_node(ps, RE_AST_REPEAT, node, -1);
+        ps->nodes[rep].min = min;
+        ps->nodes[rep].max = max;
+        node = rep;
+    }
+    return node;
+}
+
+/**
+ * Parse a sequence of repeated atoms
+ */
+static int re_parse_concat(ReParser* ps) {
+    int node = re_node(ps, RE_AST_EMPTY, -1, -1);
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int next = re_parse_repeat(ps);
+        if (next < 0) return -1;
+        node = re_node(ps, RE_AST_CAT, node, next);
+    }
+    return node;
+}
+
+/**
+ * Parse alternatives separated by '|'
+ */
+static int re_parse_alt(ReParser* ps) {
+    int node = re_parse_concat(ps);
+    while (node >= 0 && *ps->p == '|') {
+        ps->p++;
+        int right = re_parse_concat(ps);
+        if (right < 0) return -1;
+        node = re_node(ps, RE_AST_ALT, node, right);
+    }
+    return node;
+}
+
+/**
+ * Add an NFA state to a program
+ */
+static int re_state(RegexProgram* prog, int type, int out, int out1, int set) {
+    if (prog->state_count == prog->state_cap) {
+        prog->state_cap = prog->state_cap ? prog->state_cap * 2 : 64;
+        prog->states = realloc(prog->states, (size_t)prog->state_cap * sizeof(RegexState));
+    }
+    RegexState* st = &prog->states[prog->state_count];
+    st->type = type;
+    st->out = out;
+    st->out1 = out1;
+    st->set = set;
+    return prog->state_count++;
+}
+
+/**
+ * Compile a syntax tree node into NFA states (Thompson construction)
+ * Compiled back to front: the node's exits all lead to 'out'
+ * @return Entry state of the compiled fragment
+ */
+static int re_compile_node(RegexProgram* prog, const ReNode* nodes, int index, int out) {
+    const ReNode* n = &nodes[index];
+    switch (n->type) {
+        case RE_AST_SET:
+            return re_state(prog, RE_STATE_SET, out, -1, n->set);
+        case RE_AST_BOL:
+            return re_state(prog, RE_STATE_BOL, out, -1, -1);
+        case RE_AST_EOL:
+            return re_state(prog, RE_STATE_EOL, out, -1, -1);
+        case RE_AST_CAT:
+            return re_compile_node(prog, nodes, n->left, re_compile_node(prog, nodes, n->right, out));
+        case RE_AST_ALT: {
+            int a = re_compile_node(prog, nodes, n->left, out);
+            int b = re_compile_node(prog, nodes, n->right, out);
+            return re_state(prog, RE_STATE_SPLIT, a, b, -1);
+        }
+        case RE_AST_REPEAT: {
+            int cur = out;
+            if (n->max == -1) {
+                /* Unbounded tail: loop back through a split */
+                int loop = re_state(prog, RE_STATE_SPLIT, -1, out, -1);
+                int body = re_compile_node(prog, nodes, n->left, loop);
+                prog->states[loop].out = body;
+                cur = loop;
+            } else {
+                for (int i = 0; i < n->max - n->min; i++) {
+                    int body = re_compile_node(prog, nodes, n->left, cur);
+                    cur = re_state(prog, RE_STATE_SPLIT, body, cur, -1);
+                }
+            }
+            for (int i = 0; i < n->min; i++) {
+                cur = re_compile_node(prog, nodes, n->left, cur);
+            }
+            return cur;
+        }
+        default:
+            return out;
+    }
+}
+
+/**
+ * Free a compiled program
+ * @param prog Program
+ */
+void regex_free(RegexProgram* prog) {
+    if (!prog) return;
+    free(prog->states);
+    free(prog->sets);
+    free(prog);
+}
+
+/**
+ * Compile an extended regular expression into an NFA program
+ * @param pattern ERE pattern
+ * @param case_insensitive Whether to ignore ASCII case
+ * @param error Set to an error message on failure
+ * @return Program (free with regex_free), or NULL on syntax error
+ */
+RegexProgram* regex_compile(const char* pattern, int case_insensitive, const char** error) {
+    RegexProgram* prog = calloc(1, sizeof(RegexProgram));
+    prog->case_insensitive = case_insensitive;
+
+    ReParser ps;
+    ps.p = pattern;
+    ps.prog = prog;
+    ps.nodes = NULL;
+    ps.node_count = ps.node_cap = 0;
+    ps.error = NULL;
+
+    int root = re_parse_alt(&ps);
+    if (root >= 0 && *ps.p == ')') ps.error = "Unmatched ) or \\)";
+    if (root < 0 || ps.error) {
+        *error = ps.error ? ps.error : "Invalid regular expression";
+        free(ps.nodes);
+        regex_free(prog);
+        return NULL;
+    }
+
+    int match = re_state(prog, RE_STATE_MATCH, -1, -1, -1);
+    prog->start = re_compile_node(prog, ps.nodes, root, match);
+    free(ps.nodes);
+    return prog;
+}
+
+/**
+ * Follow epsilon edges from a list of NFA states
+ * Keeps only states that consume input, pending '$' checks and the match
+ * @param dfa DFA whose scratch space is used
+ * @param seeds States to start from
+ * @param seed_count Number of seeds
+ * @param bol Whether '^' may be crossed (at the start of a line)
+ * @param eol Whether '$' may be crossed (at the end of a line)
+ * @return Number of states written to dfa->scratch, sorted
+ */
+static int dfa_closure(Dfa* dfa, const int* seeds, int seed_count, int bol, int eol) {
+    const RegexProgram* prog = dfa->prog;
+    int* stack = dfa->stack;
+    int top = 0, count = 0;
+
+    dfa->mark_gen++;
+    for (int i = 0; i < seed_count; i++) stack[top++] = seeds[i];
+
+    while (top > 0) {
+        int s = stack[--top];
+        if (s < 0 || dfa->marks[s] == dfa->mark_gen) continue;
+        dfa->marks[s] = dfa->mark_gen;
+        const RegexState* st = &prog->states[s];
+        switch (st->type) {
+            case RE_STATE_SPLIT:
+                stack[top++] = st->out1;
+                stack[top++] = st->out;
+                break;
+            case RE_STATE_BOL:
+                if (bol) stack[top++] = st->out;
+                break;
+            case RE_STATE_EOL:
+                if (eol) stack[top++] = st->out;
+                else dfa->scratch[count++] = s;
+                break;
+            default:
+                dfa->scratch[count++] = s;
+                break;
+        }
+    }
+
+    /* Insertion sort: sets are small and mostly ordered */
+    for (int i = 1; i < count; i++) {
+        int v = dfa->scratch[i], j = i - 1;
+        while (j >= 0 && dfa->scratch[j] > v) {
+            dfa->scratch[j + 1] = dfa->scratch[j];
+            j--;
+        }
+        dfa->scratch[j + 1] = v;
+    }
+    return count;
+}
+
+/**
+ * Drop every cached DFA state (used when the cache grows too large)
+ */
+static void dfa_reset(Dfa* dfa) {
+    dfa->state_count = 0;
+    dfa->pool_len = 0;
+    memset(dfa->table, -1, (size_t)dfa->table_size * sizeof(int));
+    dfa->start = -1;
+    dfa->generation++;
+}
+
+/**
+ * Find or create the DFA state for the NFA state set in dfa->scratch
+ * @param dfa DFA
+ * @param count Number of NFA states in dfa->scratch
+ * @return DFA state index
+ */
+static int dfa_intern(Dfa* dfa, int count) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < count; i++) {
+        h ^= (unsigned int)dfa->scratch[i];
+        h *= 16777619u;
+    }
+
+    unsigned int mask = (unsigned int)dfa->table_size - 1;
+    for (unsigned int slot = h & mask;; slot = (slot + 1) & mask) {
+        int idx = dfa->table[slot];
+        if (idx == -1) {
+            if (dfa->state_count == DFA_MAX_STATES) {
+                /* Cache full: start over, keeping the set being interned */
+                dfa_reset(dfa);
+                return dfa_intern(dfa, count);
+            }
+            idx = dfa->state_count++;
+            dfa->table[slot] = idx;
+            if (dfa->pool_len + count > dfa->pool_cap) {
+                while (dfa->pool_len + count > dfa->pool_cap) dfa->pool_cap *= 2;
+                dfa->pool = realloc(dfa->pool, (size_t)dfa->pool_cap * sizeof(int));
+            }
+            memcpy(dfa->pool + dfa->pool_len, dfa->scratch, (size_t)count * sizeof(int));
+            dfa->set_offset[idx] = dfa->pool_len;
+            dfa->set_len[idx] = count;
+            dfa->pool_len += count;
+            dfa->eol_accept[idx] = -1;
+            dfa->accepting[idx] = 0;
+            for (int i = 0; i < count; i++) {
+                if (dfa->prog->states[dfa->scratch[i]].type == RE_STATE_MATCH) dfa->accepting[idx] = 1;
+            }
+            memset(dfa->trans + (size_t)idx * 256, -1, 256 * sizeof(int));
+            return idx;
+        }
+        if (dfa->set_len[idx] == count &&
+            memcmp(dfa->pool + dfa->set_offset[idx], dfa->scratch, (size_t)count * sizeof(int)) == 0) {
+            return idx;
+        }
+    }
+}
+
+/**
+ * Create a lazily built DFA for a program
+ * Each thread searching with the same program needs its own DFA
+ * @param prog Compiled program (shared, read-only)
+ * @return DFA (free with dfa_free)
+ */
+Dfa* dfa_create(const RegexProgram* prog) {
+    Dfa* dfa = calloc(1, sizeof(Dfa));
+    int n = prog->state_count;
+    dfa->prog = prog;
+    dfa->marks = calloc((size_t)n, sizeof(unsigned int));
+    dfa->stack = malloc((size_t)(3 * n + 2) * sizeof(int));
+    dfa->scratch = malloc((size_t)(n + 1) * sizeof(int));
+    dfa->seeds = malloc((size_t)(n + 1) * sizeof(int));
+    dfa->trans = malloc((size_t)DFA_MAX_STATES * 256 * sizeof(int));
+    dfa->set_offset = malloc(DFA_MAX_STATES * sizeof(int));
+    dfa->set_len = malloc(DFA_MAX_STATES * sizeof(int));
+    dfa->accepting = malloc(DFA_MAX_STATES);
+    dfa->eol_accept = malloc(DFA_MAX_STATES);
+    dfa->pool_cap = 1024;
+    dfa->pool = malloc((size_t)dfa->pool_cap * sizeof(int));
+    dfa->table_size = DFA_MAX_STATES * 2;
+    dfa->table = malloc((size_t)dfa->table_size * sizeof(int));
+    dfa_reset(dfa);
+    return dfa;
+}
+
+/**
+ * Free a DFA
+ * @param dfa DFA
+ */
+void dfa_free(Dfa* dfa) {
+    if (!dfa) return;
+    free(dfa->marks);
+    free(dfa->stack);
+    free(dfa->scratch);
+    free(dfa->seeds);
+    free(dfa->trans);
+    free(dfa->set_offset);
+    free(dfa->set_len);
+    free(dfa->accepting);
+    free(dfa->eol_accept);
+    free(dfa->pool);
+    free(dfa->table);
+    free(dfa);
+}
+
+/**
+ * DFA state at the start of a line
+ */
+static int dfa_start(Dfa* dfa) {
+    if (dfa->start < 0) {
+        int seed = dfa->prog->start;
+        dfa->start = dfa_intern(dfa, dfa_closure(dfa, &seed, 1, 1, 0));
+    }
+    return dfa->start;
+}
+
+/**
+ * Compute (and cache) the transition from a DFA state on one byte
+ * Every step re-adds the program start, making the search unanchored
+ */
+static int dfa_step(Dfa* dfa, int state, int c) {
+    const RegexProgram* prog = dfa->prog;
+    int count = 0;
+    const int* set = dfa->pool + dfa->set_offset[state];
+    for (int i = 0; i < dfa->set_len[state]; i++) {
+        const RegexState* st = &prog->states[set[i]];
+        if (st->type == RE_STATE_SET && (prog->sets[st->set][c >> 3] & (1 << (c & 7)))) {
+            dfa->seeds[count++] = st->out;
+        }
+    }
+    dfa->seeds[count++] = prog->start;
+
+    unsigned int generation = dfa->generation;
+    int next = dfa_intern(dfa, dfa_closure(dfa, dfa->seeds, count, 0, 0));
+    /* After a cache reset 'state' no longer exists; only the new state is valid */
+    if (dfa->generation == generation) dfa->trans[(size_t)state * 256 + c] = next;
+    return next;
+}
+
+/**
+ * Whether a DFA state matches when the line ends here ('$' satisfied)
+ */
+static int dfa_accepts_at_eol(Dfa* dfa, int state) {
+    if (dfa->accepting[state]) return 1;
+    if (dfa->eol_accept[state] == -1) {
+        int count = 0;
+        const int* set = dfa->pool + dfa->set_offset[state];
+        for (int i = 0; i < dfa->set_len[state]; i++) {
+            if (dfa->prog->states[set[i]].type == RE_STATE_EOL) dfa->seeds[count++] = set[i];
+        }
+        int accept = 0;
+        if (count > 0) {
+            int n = dfa_closure(dfa, dfa->seeds, count, 0, 1);
+            for (int i = 0; i < n; i++) {
+                if (dfa->prog->states[dfa->scratch[i]].type == RE_STATE_MATCH) accept = 1;
+            }
+        }
+        dfa->eol_accept[state] = (signed char)accept;
+    }
+    return dfa->eol_accept[state];
+}
+
+/**
+ * Find the first line in a block that the regular expression matches
+ * @param dfa DFA for the pattern
+ * @param text Text to search (starting at a line boundary)
+ * @param len Length of text
+ * @return Pointer inside the first matching line, or NULL
+ */
+const char* dfa_find(Dfa* dfa, const char* text, size_t len) {
+    const unsigned char* p = (const unsigned char*)text;
+    const unsigned char* end = p + len;
+    const unsigned char* line = p;
+    int state = dfa_start(dfa);
+
+    for (; p < end; p++) {
+        if (dfa->accepting[state]) return (const char*)p;
+        if (*p == '\n') {
+            if (dfa_accepts_at_eol(dfa, state)) return (const char*)p;
+            state = dfa_start(dfa);
+            line = p + 1;
+            continue;
+        }
+        int next = dfa->trans[(size_t)state * 256 + *p];
+        state = next >= 0 ? next : dfa_step(dfa, state, *p);
+    }
+    /* Final line without a trailing newline */
+    if (p > line && dfa_accepts_at_eol(dfa, state)) return (const char*)(end - 1);
+    return NULL;
+}
+
+/* Search dispatch functions */
+
+/**
+ * Find the first matching line in a block with whichever engine is active
+ * @param s Searcher
+ * @param text Text to search (starting at a line boundary)
+ * @param len Length of text
+ * @return Pointer inside the first matching line, or NULL
+ */
+const char* searcher_find(const Searcher* s, const char* text, size_t len) {
+    switch (s->kind) {
+        case SEARCH_MULTI:
+            return ac_find(s->multi, text, len);
+        case SEARCH_REGEX:
+            return dfa_find(s->dfa, text, len);
+        default:
+            return matcher_find(&s->fixed, text, len);
+    }
+}
+
+/**
+ * Check whether a pattern uses any ERE operator
+ * @param pattern Pattern text
+ * @return 1 if the pattern is a plain string, 0 otherwise
+ */
+static int regex_is_literal(const char* pattern) {
+    return strpbrk(pattern, "\\^$.[]|()*+?{}") == NULL;
+}
+
+/**
+ * Prepare a searcher for one or more patterns
+ * A single fixed string uses the vector matcher, several use Aho-Corasick,
+ * and -E patterns are joined into one alternation for the DFA
+ * @param s Searcher to initialize
+ * @param patterns Patterns (must outlive the searcher)
+ * @param count Number of patterns (at least 1)
+ * @param extended Treat patterns as extended regular expressions
+ * @param case_insensitive Whether to ignore ASCII case
+ * @return 0 on success, -1 on a regex syntax error (already reported)
+ */
+int searcher_init(Searcher* s, const char** patterns, int count, int extended, int case_insensitive) {
+    s->multi = NULL;
+    s->dfa = NULL;
+    s->prog = NULL;
+
+    int literal = 1;
+    for (int i = 0; i < count && extended; i++) {
+        if (!regex_is_literal(patterns[i])) literal = 0;
+    }
+
+    if (literal) {
+        if (count == 1) {
+            s->kind = SEARCH_FIXED;
+            matcher_init(&s->fixed, patterns[0], case_insensitive);
+        } else {
+            s->kind = SEARCH_MULTI;
+            s->multi = ac_build(patterns, count, case_insensitive);
+        }
+        return 0;
+    }
+
+    /* Join the patterns as (p1)|(p2)|... */
+    size_t total = 1;
+    for (int i = 0; i < count; i++) total += strlen(patterns[i]) + 3;
+    char* joined = malloc(total);
+    joined[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0) strcat(joined, "|");
+        strcat(joined, "(");
+        strcat(joined, patterns[i]);
+        strcat(joined, ")");
+    }
+
+    const char* error = NULL;
+    s->prog = regex_compile(count == 1 ? patterns[0] : joined, case_insensitive, &error);
+    free(joined);
+    if (!s->prog) {
+        fprintf(stderr, "grep: %s\n", error);
+        return -1;
+    }
+    s->kind = SEARCH_REGEX;
+    s->dfa = dfa_create(s->prog);
+    return 0;
+}
+
+/**
+ * Free a searcher's engine
+ * @param s Searcher
+ */
+void searcher_free(Searcher* s) {
+    ac_free(s->multi);
+    dfa_free(s->dfa);
+    regex_free(s->prog);
+    s->multi = NULL;
+    s->dfa = NULL;
+    s->prog = NULL;
+}
+
+/* Buffered output functions */
+
+/**
+ * Write a buffer to a descriptor, retrying short writes
+ * @param fd Destination file descriptor
+ * @param data Bytes to write
+ * @param len Number of bytes
+ * @return 0 on success, -1 on error
+ */
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Write several blocks with writev, continuing after partial writes
+ * @param fd File descriptor
+ * @param iov Blocks to write (modified)
+ * @param count Number of blocks
+ * @return 0 on success, -1 on error
+ */
+int writev_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Flush buffered output to its descriptor
+ * @param out Output buffer
+ */
+void outbuf_flush(OutBuf* out) {
+    if (out->len == 0) return;
+    if (out->fd >= 0) {
+        write_all(out->fd, out->data, out->len);
+    } else {
+        /* Capture mode: move pending bytes to the growable heap block */
+        if (out->heap_len + out->len > out->heap_cap) {
+            size_t cap = out->heap_cap ? out->heap_cap * 2 : OUTBUF_SIZE;
+            while (cap < out->heap_len + out->len) cap *= 2;
+            out->heap = realloc(out->heap, cap);
+            out->heap_cap = cap;
+        }
+        memcpy(out->heap + out->heap_len, out->data, out->len);
+        out->heap_len += out->len;
+    }
+    out->len = 0;
+}
+
+/**
+ * Append bytes to an output buffer, writing large blocks straight through
+ * @param out Output buffer
+ * @param data Bytes to append
+ * @param len Number of bytes
+ */
+void outbuf_write(OutBuf* out, const char* data, size_t len) {
+    if (out->len + len > sizeof(out->data)) {
+        if (len >= sizeof(out->data) && out->fd >= 0) {
+            /* Pending bytes and the large block leave in one gathered write */
+            struct iovec iov[2] = { { out->data, out->len }, { (void*)data, len } };
+            writev_all(out->fd, iov, 2);
+            out->len = 0;
+            return;
+        }
+        outbuf_flush(out);
+        while (len > sizeof(out->data)) {
+            memcpy(out->data, data, sizeof(out->data));
+            out->len = sizeof(out->data);
+            outbuf_flush(out);
+            data += sizeof(out->data);
+            len -= sizeof(out->data);
+        }
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    if (out->tty && memchr(data, '\n', len)) outbuf_flush(out);
+}
+
+/**
+ * Set up an output buffer writing to a descriptor
+ * Terminals are line buffered; files and pipes get full blocks
+ * @param out Output buffer
+ * @param fd Destination file descriptor
+ */
+void outbuf_init(OutBuf* out, int fd) {
+    out->fd = fd;
+    out->tty = isatty(fd);
+    out->len = 0;
+    out->heap = NULL;
+    out->heap_len = 0;
+    out->heap_cap = 0;
+}
+
+/**
+ * Set up an output buffer that collects into memory instead of a descriptor
+ * @param out Output buffer
+ */
+void outbuf_init_capture(OutBuf* out) {
+    out->fd = -1;
+    out->tty = 0;
+    out->len = 0;
+    out->heap = NULL;
+    out->heap_len = 0;
+    out->heap_cap = 0;
+}
+
+/**
+ * Write everything a capture buffer has collected to a descriptor
+ * @param out Capture buffer
+ * @param fd Destination file descriptor
+ */
+void outbuf_copy_to(const OutBuf* out, int fd) {
+    if (out->heap_len > 0) write_all(fd, out->heap, out->heap_len);
+    if (out->len > 0) write_all(fd, out->data, out->len);
+}
+
+/**
+ * Append everything a capture buffer has collected to another buffer
+ * @param out Output buffer
+ * @param captured Capture buffer
+ */
+void outbuf_append(OutBuf* out, const OutBuf* captured) {
+    if (captured->heap_len > 0) outbuf_write(out, captured->heap, captured->heap_len);
+    if (captured->len > 0) outbuf_write(out, captured->data, captured->len);
+}
+
+/**
+ * Free a heap-allocated output buffer and anything it captured
+ * @param out Output buffer
+ */
+void outbuf_release(OutBuf* out) {
+    if (!out) return;
+    free(out->heap);
+    free(out);
+}
+
+/**
+ * Append a NUL-terminated string to an output buffer
+ * @param out Output buffer
+ * @param s String to append
+ */
+void outbuf_puts(OutBuf* out, const char* s) {
+    outbuf_write(out, s, strlen(s));
+}
+
+/**
+ * Append formatted text to an output buffer
+ * Formats straight into the free space when it fits
+ * @param out Output buffer
+ * @param format printf-style format
+ */
+void outbuf_printf(OutBuf* out, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t room = sizeof(out->data) - out->len;
+    int len = vsnprintf(out->data + out->len, room, format, args);
+    va_end(args);
+    if (len < 0) return;
+    if ((size_t)len < room) {
+        out->len += (size_t)len;
+        if (out->tty && memchr(out->data + out->len - len, '\n', (size_t)len)) outbuf_flush(out);
+        return;
+    }
+
+    /* Too long for the free space: format into a temporary block */
+    char* text = malloc((size_t)len + 1);
+    if (!text) return;
+    va_start(args, format);
+    vsnprintf(text, (size_t)len + 1, format, args);
+    va_end(args);
+    outbuf_write(out, text, (size_t)len);
+    free(text);
+}
+
+/**
+ * Append a decimal number followed by a separator character
+ * @param out Output buffer
+ * @param value Number to append
+ * @param sep Character written after the number
+ */
+void outbuf_number(OutBuf* out, long value, char sep) {
+    char digits[32];
+    int len = snprintf(digits, sizeof(digits), "%ld%c", value, sep);
+    outbuf_write(out, digits, (size_t)len);
+}
+
+/* Chunk reader functions */
+
+/**
+ * Find the last newline in a block
+ * @param p Start of the block
+ * @param n Length of the block
+ * @return Pointer to the last '\n' or NULL
+ */
+static const char* find_last_newline(const char* p, size_t n) {
+    while (n > 0) {
+        if (p[n - 1] == '\n') return p + n - 1;
+        n--;
+    }
+    return NULL;
+}
+
+/**
+ * Prepare a reader over any descriptor
+ * Regular files are memory-mapped and handed out as one chunk; pipes,
+ * terminals and other streams are read in large blocks
+ * @param reader Reader to initialize
+ * @param fd Source descriptor
+ */
+void reader_init(ChunkReader* reader, int fd) {
+    reader->fd = fd;
+    reader->buf = NULL;
+    reader->cap = 0;
+    reader->start = reader->end = 0;
+    reader->eof = 0;
+    reader->map = NULL;
+    reader->map_len = 0;
+    reader->streaming = 1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            reader->eof = 1;
+            reader->streaming = 0;
+            return;
+        }
+        void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+            reader->map = data;
+            reader->map_len = (size_t)st.st_size;
+            reader->streaming = 0;
+        }
+    }
+}
+
+/**
+ * Return the next block of complete lines
+ * A line that does not fit grows the buffer instead of being split, so
+ * every chunk ends on a line boundary (or at end of input)
+ * @param reader Reader
+ * @param data Set to the start of the chunk
+ * @param len Set to the chunk length, including its final newline
+ * @return 1 if a chunk was returned, 0 at end of input
+ */
+int reader_next_chunk(ChunkReader* reader, const char** data, size_t* len) {
+    if (reader->map) {
+        if (reader->eof) return 0;
+        reader->eof = 1;
+        *data = reader->map;
+        *len = reader->map_len;
+        return 1;
+    }
+
+    for (;;) {
+        /* Move the carried partial line to the front */
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+
+        if (reader->eof) {
+            if (reader->end == 0) return 0;
+            *data = reader->buf;
+            *len = reader->end;
+            reader->start = reader->end;
+            return 1;
+        }
+
+        /* Always leave room for a full-sized read */
+        if (reader->cap - reader->end < GREP_BUFFER_SIZE) {
+            size_t cap = reader->cap ? reader->cap * 2 : GREP_BUFFER_SIZE;
+            while (cap - reader->end < GREP_BUFFER_SIZE) cap *= 2;
+            char* grown = realloc(reader->buf, cap);
+            if (!grown) return 0;
+            reader->buf = grown;
+            reader->cap = cap;
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end);
+        if (n < 0 && errno == EINTR && !sigint_pending) continue;  /* Ctrl+C ends the input */
+        if (n <= 0) {
+            reader->eof = 1;
+            continue;
+        }
+
+        /* Only the new bytes can hold the chunk's last newline */
+        const char* nl = find_last_newline(reader->buf + reader->end, (size_t)n);
+        reader->end += (size_t)n;
+        if (nl) {
+            *data = reader->buf;
+            *len = (size_t)(nl - reader->buf) + 1;
+            reader->start = *len;
+            return 1;
+        }
+    }
+}
+
+/**
+ * Release a reader's buffer or mapping
+ * @param reader Reader
+ */
+void reader_close(ChunkReader* reader) {
+    if (reader->map) munmap(reader->map, reader->map_len);
+    free(reader->buf);
+    reader->map = NULL;
+    reader->buf = NULL;
+}
+
+/* Grep search functions */
+
+/**
+ * Copy or discard a stream without inspecting it
+ * Uses splice() on Linux so pipe data never enters user space,
+ * falling back to large read()/write() blocks elsewhere
+ * @param in_fd Source descriptor
+ * @param out_fd Destination descriptor
+ * @return Number of bytes copied, or -1 on error
+ */
+long long stream_passthrough(int in_fd, int out_fd) {
+    long long copied = 0;
+#ifdef __linux__
+    for (;;) {
+        ssize_t n = splice(in_fd, NULL, out_fd, NULL, GREP_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) return copied;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL) break;  /* Neither end is a pipe, copy instead */
+            return -1;
+        }
+        copied += n;
+    }
+#endif
+    char* buf = malloc(GREP_BUFFER_SIZE);
+    if (!buf) return -1;
+    for (;;) {
+        ssize_t n = read(in_fd, buf, GREP_BUFFER_SIZE);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            copied = -1;
+            break;
+        }
+        if (write_all(out_fd, buf, (size_t)n) != 0) {
+            copied = -1;
+            break;
+        }
+        copied += n;
+    }
+    free(buf);
+    return copied;
+}
+
+/**
+ * Write one selected line with its file name and line number prefixes
+ * @param line Start of the line
+ * @param len Length of the line without the newline
+ * @param line_number Line number of the line (1-based)
+ * @param filename Name used as output prefix (NULL for stdin)
+ * @param opts Search options
+ * @param out Output buffer
+ */
+void grep_emit_line(const char* line, size_t len, long line_number, const char* filename,
+                    const GrepOptions* opts, OutBuf* out) {
+    if (opts->count_only) return;
+    if (opts->show_filename && filename) {
+        outbuf_puts(out, filename);
+        outbuf_write(out, ":", 1);
+    }
+    if (opts->show_line_numbers) {
+        outbuf_number(out, line_number, ':');
+    }
+    outbuf_write(out, line, len);
+    outbuf_write(out, "\n", 1);
+}
+
+/**
+ * Find the start of the line containing a position
+ * @param floor Earliest possible line start
+ * @param p Position inside the line
+ * @return Start of the line
+ */
+static const char* line_start(const char* floor, const char* p) {
+    while (p > floor && p[-1] != '\n') p--;
+    return p;
+}
+
+/**
+ * Search a block of complete lines in place
+ * The whole block is scanned for the pattern instead of line by line;
+ * lines between matches are only walked when -v or -n needs them
+ * @param data Start of the block
+ * @param len Length of the block (a missing final newline is allowed)
+ * @param line_number Line number of the first line minus one; updated
+ * @param filename Name used as output prefix (NULL for stdin)
+ * @param opts Search options
+ * @param out Output buffer
+ * @return Number of selected lines
+ */
+long grep_buffer(const char* data, size_t len, long* line_number, const char* filename,
+                 const GrepOptions* opts, OutBuf* out) {
+    const char* pos = data;
+    const char* end = data + len;
+    long selected = 0;
+    int need_lines = opts->invert_match || opts->show_line_numbers;
+
+    while (pos < end) {
+        const char* hit = searcher_find(&opts->searcher, pos, (size_t)(end - pos));
+        const char* hit_line = hit ? line_start(pos, hit) : end;
+
+        /* Lines before the matching one did not match */
+        if (need_lines) {
+            while (pos < hit_line) {
+                const char* nl = memchr(pos, '\n', (size_t)(hit_line - pos));
+                const char* line_end = nl ? nl : hit_line;
+                (*line_number)++;
+                if (opts->invert_match) {
+                    selected++;
+                    grep_emit_line(pos, (size_t)(line_end - pos), *line_number, filename, opts, out);
+                }
+                pos = nl ? nl + 1 : hit_line;
+            }
+        }
+        if (!hit) break;
+
+        const char* nl = memchr(hit, '\n', (size_t)(end - hit));
+        const char* line_end = nl ? nl : end;
+        (*line_number)++;
+        if (!opts->invert_match) {
+            selected++;
+            grep_emit_line(hit_line, (size_t)(line_end - hit_line), *line_number, filename, opts, out);
+        }
+        pos = nl ? nl + 1 : end;
+    }
+    return selected;
+}
+
+/**
+ * Search one input (regular file, pipe or terminal) and write selected lines
+ * @param fd Descriptor to read from
+ * @param filename Name used as output prefix (NULL for stdin)
+ * @param opts Search options
+ * @param out Output buffer
+ * @return Number of selected lines (1 for any non-empty passed-through input)
+ */
+long grep_stream(int fd, const char* filename, const GrepOptions* opts, OutBuf* out) {
+    /* An empty pattern selects every line: pass data through or drop it */
+    if (opts->searcher.kind == SEARCH_FIXED && opts->searcher.fixed.len == 0 && !opts->count_only) {
+        if (!opts->invert_match && !opts->show_line_numbers && !opts->show_filename && out->fd >= 0) {
+            /* Capture buffers have no descriptor; they take the reader loop below */
+            outbuf_flush(out);
+            return stream_passthrough(fd, out->fd) > 0;
+        }
+        if (opts->invert_match) {
+            /* Still drain the input so the writer is not killed by SIGPIPE */
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd != -1) {
+                stream_passthrough(fd, null_fd);
+                close(null_fd);
+                return 0;
+            }
+        }
+    }
+
+    ChunkReader reader;
+    reader_init(&reader, fd);
+
+    const char* chunk;
+    size_t len;
+    long line_number = 0;  /* Carried across chunks */
+    long match_count = 0;
+
+    while (reader_next_chunk(&reader, &chunk, &len)) {
+        match_count += grep_buffer(chunk, len, &line_number, filename, opts, out);
+
+        /* Keep output flowing when the next read may block on a pipe */
+        if (reader.streaming) outbuf_flush(out);
+    }
+
+    if (opts->count_only) {
+        outbuf_number(out, match_count, '\n');
+    }
+
+    reader_close(&reader);
+    return match_count;
+}
+
+/**
+ * Search one named file (or stdin) and write its results
+ * @param filename File to search (NULL for opts->in_fd)
+ * @param opts Search options
+ * @param out Output buffer
+ * @return Number of selected lines, or -1 if the file could not be opened
+ */
+long grep_file(const char* filename, const GrepOptions* opts, OutBuf* out) {
+    int fd = opts->in_fd;
+    
+    if (filename) {
+        fd = open(filename, O_RDONLY);
+        if (fd == -1) return -1;
+    }
+    
+    long selected = grep_stream(fd, filename, opts, out);
+    
+    if (filename) {
+        close(fd);
+    }
+    return selected;
+}
+
+/**
+ * Report a file that could not be searched
+ * @param filename File name
+ */
+void grep_report_missing(const char* filename) {
+    fprintf(stderr, "grep: %s: No such file or directory\n", filename);
+}
+
+/**
+ * Worker thread body: claim files from the pool and search them
+ * Ordered pools only run a bounded window ahead of the writer so buffered
+ * output stays small
+ * @param arg GrepPool shared by all workers
+ * @return NULL
+ */
+void* grep_worker(void* arg) {
+    GrepPool* pool = arg;
+
+    /* The regex DFA is built while searching, so each worker needs its own */
+    GrepOptions local = *pool->opts;
+    if (local.searcher.kind == SEARCH_REGEX) local.searcher.dfa = dfa_create(local.searcher.prog);
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && !pool->unordered &&
+               pool->next >= pool->written + pool->window) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->next >= pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        GrepTask* task = &pool->tasks[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        /* Collect this file's output in memory */
+        task->out = malloc(sizeof(OutBuf));
+        outbuf_init_capture(task->out);
+        task->selected = grep_file(task->filename, &local, task->out);
+        task->error = task->selected < 0;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->unordered) {
+            /* Stream each file's output as soon as it is complete */
+            if (task->error) grep_report_missing(task->filename);
+            outbuf_append(pool->out, task->out);
+            outbuf_flush(pool->out);
+            outbuf_release(task->out);
+            task->out = NULL;
+        }
+        task->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (local.searcher.kind == SEARCH_REGEX) dfa_free(local.searcher.dfa);
+    return NULL;
+}
+
+/**
+ * Search many files with a pool of worker threads
+ * In ordered mode results are written in argument order, exactly as a
+ * serial search would produce them
+ * @param files Files to search
+ * @param file_count Number of files
+ * @param threads Number of worker threads
+ * @param unordered Set to 1 to write each file's results as it finishes
+ * @param out Buffer the results are appended to
+ * @param opts Search options
+ * @return 0 if any line was selected, 1 if none, 2 if a file could not be read
+ */
+int grep_parallel(char** files, int file_count, int threads, int unordered, OutBuf* out,
+                  const GrepOptions* opts) {
+    GrepPool pool;
+    pool.tasks = calloc(file_count, sizeof(GrepTask));
+    pool.count = file_count;
+    pool.next = 0;
+    pool.written = 0;
+    pool.window = threads * 2;
+    pool.unordered = unordered;
+    pool.out = out;
+    pool.opts = opts;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    for (int i = 0; i < file_count; i++) {
+        pool.tasks[i].filename = files[i];
+    }
+
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, grep_worker, &pool) == 0) started++;
+    }
+    if (started == 0) {
+        /* No threads available: search serially on this thread */
+        pool.window = file_count;
+        grep_worker(&pool);
+    }
+
+    if (!unordered) {
+        for (int i = 0; i < file_count; i++) {
+            GrepTask* task = &pool.tasks[i];
+            pthread_mutex_lock(&pool.lock);
+            while (!task->done) pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+
+            if (task->error) {
+                outbuf_flush(pool.out);
+                grep_report_missing(task->filename);
+            }
+            outbuf_append(pool.out, task->out);
+            outbuf_release(task->out);
+            task->out = NULL;
+
+            pthread_mutex_lock(&pool.lock);
+            pool.written++;
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    int status = 1;
+    for (int i = 0; i < file_count; i++) {
+        if (pool.tasks[i].error) status = 2;
+        else if (pool.tasks[i].selected > 0 && status == 1) status = 0;
+    }
+    free(workers);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    free(pool.tasks);
+    return status;
+}
+
+/**
+ * Built-in grep command implementation
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0 if any line was selected, 1 if none, 2 on error
+ */
+int builtin_grep(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    if (!args[1]) {
+        fprintf(stderr, "Usage: grep [options] pattern [file...]\n");
+        fprintf(stderr, "       grep [options] -e pattern [-e pattern...] [file...]\n");
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "  -i    Ignore case\n");
+        fprintf(stderr, "  -n    Show line numbers\n");
+        fprintf(stderr, "  -v    Invert match (show non-matching lines)\n");
+        fprintf(stderr, "  -c    Count matching lines only\n");
+        fprintf(stderr, "  -e P  Add pattern P (repeatable, all searched in one pass)\n");
+        fprintf(stderr, "  -E    Patterns are extended regular expressions\n");
+        fprintf(stderr, "  -F    Patterns are fixed strings (default)\n");
+        fprintf(stderr, "  -j N  Search at most N files in parallel (default: CPU count)\n");
+        fprintf(stderr, "  -u    Unordered: print each file's results as soon as it finishes\n");
+        return 2;
+    }
+    
+    int case_insensitive = 0;
+    int show_line_numbers = 0;
+    int invert_match = 0;
+    int count_only = 0;
+    int extended = 0;
+    int max_threads = 0;
+    int unordered = 0;
+    const char** patterns = NULL;
+    int pattern_count = 0;
+    int explicit_patterns = 0;  /* Set once -e is used */
+    int file_count = 0;
+    char** files = NULL;
+    int status = 0;
+    
+    /* Parse options and arguments */
+    for (int i = 1; args[i] != NULL && status == 0; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            /* Option */
+            for (int j = 1; args[i][j] != '\0' && status == 0; j++) {
+                char opt = args[i][j];
+                switch (opt) {
+                    case 'i':
+                        case_insensitive = 1;
+                        break;
+                    case 'n':
+                        show_line_numbers = 1;
+                        break;
+                    case 'v':
+                        invert_match = 1;
+                        break;
+                    case 'c':
+                        count_only = 1;
+                        break;
+                    case 'E':
+                        extended = 1;
+                        break;
+                    case 'F':
+                        extended = 0;
+                        break;
+                    case 'u':
+                        unordered = 1;
+                        break;
+                    case 'e':
+                    case 'j': {
+                        /* Options with a value: -eVALUE or -e VALUE */
+                        const char* value = args[i][j + 1] ? &args[i][j + 1] : args[i + 1];
+                        if (!args[i][j + 1] && value) i++;
+                        if (!value) {
+                            fprintf(stderr, "grep: option requires an argument -- '%c'\n", opt);
+                            status = 2;
+                            break;
+                        }
+                        if (opt == 'e') {
+                            patterns = realloc(patterns, (pattern_count + 1) * sizeof(char*));
+                            patterns[pattern_count++] = value;
+                            explicit_patterns = 1;
+                        } else if (atoi(value) < 1) {
+                            fprintf(stderr, "grep: -j requires a positive thread count\n");
+                            status = 2;
+                        } else {
+                            max_threads = atoi(value);
+                        }
+                        j = (int)strlen(args[i]) - 1;  /* Rest of the word was the value */
+                        break;
+                    }
+                    default:
+                        fprintf(stderr, "grep: invalid option -- '%c'\n", opt);
+                        status = 2;
+                }
+            }
+        } else if (pattern_count == 0 && !explicit_patterns) {
+            /* First non-option argument is the pattern unless -e was used */
+            patterns = realloc(patterns, sizeof(char*));
+            patterns[pattern_count++] = args[i];
+        } else {
+            /* File argument */
+            file_count++;
+            files = realloc(files, file_count * sizeof(char*));
+            files[file_count - 1] = args[i];
+        }
+    }
+    
+    if (status == 0 && pattern_count == 0) {
+        fprintf(stderr, "grep: no pattern specified\n");
+        status = 2;
+    }
+
+    GrepOptions opts;
+    if (status == 0 && searcher_init(&opts.searcher, patterns, pattern_count, extended, case_insensitive) != 0) {
+        status = 2;
+    }
+    if (status != 0) {
+        free(patterns);
+        free(files);
+        return status;
+    }
+    
+    /* If no files specified, read from stdin */
+    if (file_count == 0) {
+        files = malloc(sizeof(char*));
+        files[0] = NULL;  /* NULL means stdin */
+        file_count = 1;
+    }
+    
+    opts.show_line_numbers = show_line_numbers;
+    opts.invert_match = invert_match;
+    opts.count_only = count_only;
+    opts.show_filename = file_count > 1;
+    opts.in_fd = io->in_fd;
+
+    /* Several files: search them concurrently */
+    int threads = max_threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > file_count) threads = file_count;
+    if (threads > 1) {
+        status = grep_parallel(files, file_count, threads, unordered, io->out, &opts);
+        searcher_free(&opts.searcher);
+        free(patterns);
+        free(files);
+        return status;
+    }
+
+    OutBuf* out = io->out;
+    
+    /* Process each file */
+    status = 1;
+    for (int file_idx = 0; file_idx < file_count; file_idx++) {
+        long selected = grep_file(files[file_idx], &opts, out);
+        if (selected < 0) {
+            outbuf_flush(out);
+            grep_report_missing(files[file_idx]);
+            status = 2;
+        } else if (selected > 0 && status == 1) {
+            status = 0;
+        }
+    }
+    
+    outbuf_flush(out);
+    searcher_free(&opts.searcher);
+    free(patterns);
+    free(files);
+    return status;
+}
+
+/* Parallel execution functions */
+
+/**
+ * Build the command line for one argument of the parallel builtin
+ * Every {} in the template is replaced by the argument; without any {}
+ * the argument is appended as the last word
+ * @param template Command template words
+ * @param count Number of template words
+ * @param arg Argument for this run
+ * @return Heap-allocated argument vector (free with parallel_free_argv)
+ */
+char** parallel_build_argv(char** template, int count, const char* arg) {
+    char** argv = malloc((count + 2) * sizeof(char*));
+    size_t arg_len = strlen(arg);
+    int substituted = 0;
+
+    for (int i = 0; i < count; i++) {
+        /* Size the word with every placeholder replaced */
+        size_t len = 0;
+        for (const char* p = template[i]; *p; ) {
+            if (p[0] == '{' && p[1] == '}') {
+                len += arg_len;
+                p += 2;
+            } else {
+                len++;
+                p++;
+            }
+        }
+        char* word = malloc(len + 1);
+        char* out = word;
+        for (const char* p = template[i]; *p; ) {
+            if (p[0] == '{' && p[1] == '}') {
+                memcpy(out, arg, arg_len);
+                out += arg_len;
+                p += 2;
+                substituted = 1;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        *out = '\0';
+        argv[i] = word;
+    }
+    argv[count] = substituted ? NULL : strdup(arg);
+    argv[count + 1] = NULL;
+    return argv;
+}
+
+/**
+ * Free an argument vector from parallel_build_argv
+ * @param argv Argument vector
+ */
+void parallel_free_argv(char** argv) {
+    for (int i = 0; argv[i]; i++) free(argv[i]);
+    free(argv);
+}
+
+/**
+ * Start one parallel task with its stdout connected to a pipe
+ * @param task Task to start
+ * @param argv Command to run
+ * @param resolved Full path of the command (NULL for builtins or PATH search)
+ * @param stdin_file File to use as stdin (NULL to use in_fd)
+ * @param in_fd Descriptor to use as stdin (-1 to inherit)
+ * @return 0 if the child is running, -1 if it could not be started
+ */
+int parallel_start(ParallelTask* task, char** argv, const char* resolved, const char* stdin_file,
+                   int in_fd) {
+    int fds[2];
+    task->pid = -1;
+    task->out_fd = -1;
+    task->out = NULL;
+    task->status = 127;
+    task->done = 0;
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    set_cloexec(fds[0]);
+    set_cloexec(fds[1]);
+
+    LaunchSpec spec;
+    spec.argv = argv;
+    spec.resolved = resolved;
+    spec.infile = stdin_file;
+    spec.outfile = NULL;
+    spec.append = 0;
+    spec.in_fd = stdin_file ? -1 : in_fd;
+    spec.out_fd = fds[1];
+    /* Join the caller's group: the shell's at top level, the job's as a pipeline stage */
+    spec.pgid = getpgrp();
+
+    if (is_builtin(argv[0])) {
+        task->pid = fork_command(&spec, 1, fds, 2);
+    } else {
+        task->pid = launch_command(&spec, fds, 2);
+    }
+    close(fds[1]);
+    if (task->pid <= 0) {
+        close(fds[0]);
+        task->pid = -1;
+        return -1;
+    }
+    task->out_fd = fds[0];
+    return 0;
+}
+
+/**
+ * Hold task output in memory until it may be written
+ * @param task Task that produced the data
+ * @param data Bytes read from the child
+ * @param len Number of bytes
+ */
+void parallel_buffer(ParallelTask* task, const char* data, size_t len) {
+    if (!task->out) {
+        task->out = malloc(sizeof(OutBuf));
+        outbuf_init_capture(task->out);
+    }
+    outbuf_write(task->out, data, len);
+}
+
+/**
+ * Write and drop a task's buffered output
+ * @param task Task
+ * @param out_fd Destination descriptor
+ */
+void parallel_flush(ParallelTask* task, int out_fd) {
+    if (!task->out) return;
+    outbuf_copy_to(task->out, out_fd);
+    outbuf_release(task->out);
+    task->out = NULL;
+}
+
+/**
+ * Collect the arguments for the parallel builtin from stdin, one per line
+ * @param in_fd Descriptor to read
+ * @param data Set to the buffer holding the NUL-separated lines (caller frees)
+ * @param count Set to the number of lines
+ * @return Array of line pointers into data (caller frees)
+ */
+char** parallel_read_lines(int in_fd, char** data, int* count) {
+    ChunkReader reader;
+    reader_init(&reader, in_fd);
+    size_t len = 0, cap = 0;
+    *data = NULL;
+
+    const char* chunk;
+    size_t chunk_len;
+    while (reader_next_chunk(&reader, &chunk, &chunk_len)) {
+        if (len + chunk_len + 1 > cap) {
+            cap = (len + chunk_len + 1) * 2;
+            *data = realloc(*data, cap);
+        }
+        memcpy(*data + len, chunk, chunk_len);
+        len += chunk_len;
+    }
+    reader_close(&reader);
+
+    char** lines = NULL;
+    int cap_lines = 0;
+    *count = 0;
+    for (size_t start = 0; start < len; ) {
+        char* nl = memchr(*data + start, '\n', len - start);
+        size_t end = nl ? (size_t)(nl - *data) : len;
+        (*data)[end] = '\0';  /* The final line has room for its terminator */
+        if (end > start) {
+            if (*count == cap_lines) {
+                cap_lines = cap_lines ? cap_lines * 2 : 64;
+                lines = realloc(lines, cap_lines * sizeof(char*));
+            }
+            lines[(*count)++] = *data + start;
+        }
+        start = end + 1;
+    }
+    return lines;
+}
+
+/**
+ * Built-in parallel command implementation
+ * parallel [-j N] [-u] command [{}...] ::: arg...   - one run per argument
+ * parallel [-j N] [-u] command [{}...] < list       - one run per stdin line
+ * At most N children run at once (default: CPU count). Each run's output is
+ * kept together and written in argument order, or in completion order
+ * with -u; in order mode the oldest running task streams straight through.
+ * Workers share the caller's process group. Under job control the builtin
+ * is forked as a job of its own (BUILTIN_JOB), so Ctrl+Z stops it together
+ * with its workers and fg or bg resumes them all.
+ * @param argc Number of arguments
+ * @param args Command arguments (already glob-expanded)
+ * @param io Descriptors of the invocation
+ * @return 0 if every run succeeded, else the number of failed runs (max 101),
+ *         255 on usage errors
+ */
+int builtin_parallel(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    int max_jobs = 0;
+    int unordered = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (args[i][1] == 'j') {
+            const char* value = args[i][2] ? args[i] + 2 : args[++i];
+            char* end = NULL;
+            long count = 0;
+            if (value) {
+                errno = 0;
+                count = strtol(value, &end, 10);
+            }
+            if (!value || end == value || *end || errno == ERANGE || count < 1 || count > INT_MAX) {
+                fprintf(stderr, "parallel: -j requires a positive job count\n");
+                return 255;
+            }
+            max_jobs = (int)count;
+        } else if (strcmp(args[i], "-u") == 0) {
+            unordered = 1;
+        } else if (strcmp(args[i], "-k") == 0) {
+            unordered = 0;
+        } else {
+            fprintf(stderr, "parallel: invalid option -- '%s'\n", args[i] + 1);
+            return 255;
+        }
+    }
+
+    char** template = args + i;
+    int template_count = 0;
+    while (template[template_count] && strcmp(template[template_count], ":::") != 0) {
+        template_count++;
+    }
+    if (template_count == 0) {
+        fprintf(stderr, "Usage: parallel [-j N] [-u] command [{}] ::: arg...\n");
+        fprintf(stderr, "       parallel [-j N] [-u] command [{}] < arguments\n");
+        return 255;
+    }
+
+    /* Arguments follow ::: or come from stdin, one per line */
+    char** inputs;
+    int input_count = 0;
+    char* input_data = NULL;
+    char** input_list = NULL;
+    const char* child_stdin = NULL;
+    if (template[template_count]) {
+        inputs = template + template_count + 1;
+        while (inputs[input_count]) input_count++;
+    } else {
+        input_list = parallel_read_lines(io->in_fd, &input_data, &input_count);
+        inputs = input_list;
+        child_stdin = "/dev/null";  /* stdin was the argument list */
+    }
+
+    if (max_jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_jobs = cpus > 0 ? (int)cpus : 1;
+    }
+    if (max_jobs > input_count) max_jobs = input_count > 0 ? input_count : 1;  /* Slots beyond the runs stay idle */
+
+    /* Resolve the command once for every run */
+    char* saved = template[template_count];
+    template[template_count] = NULL;
+    const char* resolved = (strchr(template[0], '{') || is_builtin(template[0])) ? NULL :
+                           hash_lookup_command(template[0]);
+    template[template_count] = saved;
+
+    ParallelTask* tasks = calloc(input_count > 0 ? input_count : 1, sizeof(ParallelTask));
+    struct pollfd* fds = malloc(max_jobs * sizeof(struct pollfd));
+    int* fd_task = malloc(max_jobs * sizeof(int));
+    char* buf = malloc(OUTBUF_SIZE);
+    int next = 0, running = 0, written = 0, failed = 0, interrupted = 0;
+
+    /* Children and streamed output write to the descriptor directly */
+    int child_in = io->in_fd == STDIN_FILENO ? -1 : io->in_fd;
+    outbuf_flush(io->out);
+    while (written < next || (next < input_count && !interrupted)) {
+        /* Keep every job slot busy */
+        while (running < max_jobs && next < input_count && !interrupted) {
+            ParallelTask* task = &tasks[next++];
+            char** argv = parallel_build_argv(template, template_count, inputs[next - 1]);
+            if (parallel_start(task, argv, resolved, child_stdin, child_in) == 0) {
+                running++;
+            } else {
+                task->done = 1;
+                failed++;
+            }
+            parallel_free_argv(argv);
+        }
+
+        /* Write finished output; the oldest task then streams directly */
+        if (!unordered) {
+            while (written < next) {
+                parallel_flush(&tasks[written], io->out_fd);
+                if (!tasks[written].done) break;
+                written++;
+            }
+        }
+        if (running == 0) {
+            if (unordered) written = next;
+            continue;
+        }
+
+        int nfds = 0;
+        for (int t = written; t < next && nfds < running; t++) {
+            if (tasks[t].out_fd == -1) continue;
+            fds[nfds].fd = tasks[t].out_fd;
+            fds[nfds].events = POLLIN;
+            fd_task[nfds++] = t;
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int f = 0; f < nfds; f++) {
+            if (fds[f].revents == 0) continue;
+            ParallelTask* task = &tasks[fd_task[f]];
+            ssize_t n = read(task->out_fd, buf, OUTBUF_SIZE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n > 0) {
+                if (!unordered && fd_task[f] == written) {
+                    write_all(io->out_fd, buf, (size_t)n);
+                } else {
+                    parallel_buffer(task, buf, (size_t)n);
+                }
+                continue;
+            }
+
+            /* End of output: collect the child */
+            close(task->out_fd);
+            task->out_fd = -1;
+            int status = 0;
+            struct rusage usage;
+            pid_t reaped;
+            while ((reaped = wait4(task->pid, &status, 0, &usage)) == -1 && errno == EINTR) {
+                /* Retry until the child is reaped */
+            }
+            if (reaped > 0) child_usage_add(&usage);
+            task->status = decode_status(status);
+            task->done = 1;
+            running--;
+            if (task->status != 0) failed++;
+            if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) interrupted = 1;
+            if (unordered) parallel_flush(task, io->out_fd);
+        }
+        if (unordered) {
+            /* In completion order, written only counts finished tasks */
+            while (written < next && tasks[written].done) written++;
+        }
+    }
+
+    free(buf);
+    free(fd_task);
+    free(fds);
+    free(tasks);
+    free(input_list);
+    free(input_data);
+    return failed > 101 ? 101 : failed;
+}
+
+/**
+ * Recompute the cached working directory and the prompt
+ * Called after cd and whenever PWD or HOME change; $PWD is trusted when it
+ * names the current directory, so symlinked paths are kept as typed
+ */
+void cwd_refresh() {
+    const char* pwd = getenv("PWD");
+    struct stat pwd_st, dot_st;
+    if (pwd && pwd[0] == '/' && strlen(pwd) < sizeof(shell_cwd) &&
+        stat(pwd, &pwd_st) == 0 && stat(".", &dot_st) == 0 &&
+        pwd_st.st_dev == dot_st.st_dev && pwd_st.st_ino == dot_st.st_ino) {
+        strcpy(shell_cwd, pwd);
+    } else if (!getcwd(shell_cwd, sizeof(shell_cwd))) {
+        shell_cwd[0] = '\0';
+    }
+
+    if (!shell_cwd[0]) {
+        /* Fallback if getcwd fails */
+        snprintf(prompt_cache, sizeof(prompt_cache), "ccsh> ");
+    } else {
+        /* Try to make the path more readable by shortening home directory */
+        const char* home = getenv("HOME");
+        size_t home_len = home ? strlen(home) : 0;
+        if (home_len > 0 && strncmp(shell_cwd, home, home_len) == 0 &&
+            (shell_cwd[home_len] == '/' || shell_cwd[home_len] == '\0')) {
+            /* Replace home directory with ~ */
+            snprintf(prompt_cache, sizeof(prompt_cache), "ccsh:~%s> ", shell_cwd + home_len);
+        } else {
+            snprintf(prompt_cache, sizeof(prompt_cache), "ccsh:%s> ", shell_cwd);
+        }
+    }
+    shell_cwd_valid = 1;
+}
+
+/**
+ * Current working directory from the cache
+ * @return Absolute path, or "" if it cannot be determined
+ */
+const char* current_dir() {
+    if (!shell_cwd_valid) cwd_refresh();
+    return shell_cwd;
+}
+
+/**
+ * Prompt showing the current directory, from the cache
+ * @return Prompt string (valid until the next cd)
+ */
+const char* generate_prompt() {
+    if (!shell_cwd_valid) cwd_refresh();
+    return prompt_cache;
+}
+
+/**
+ * Expand tilde (~) to home directory
+ * @param path Path that may contain tilde
+ * @param expanded Buffer to store expanded path
+ * @param expanded_size Size of expanded buffer
+ * @return 0 on success, -1 on error
+ */
+int expand_tilde(const char* path, char* expanded, size_t expanded_size) {
+    if (!path || !expanded) return -1;
+    
+    if (path[0] == '~') {
+        const char* home = getenv("HOME");
+        if (!home || strlen(home) == 0) {
+            fprintf(stderr, "cd: HOME environment variable not set\n");
+            return -1;
+        }
+        
+        if (path[1] == '\0' || path[1] == '/') {
+            /* ~ or ~/path */
+            if (path[1] == '/') {
+                snprintf(expanded, expanded_size, "%s%s", home, path + 1);
+            } else {
+                snprintf(expanded, expanded_size, "%s", home);
+            }
+        } else {
+            /* ~username - not supported in this simple implementation */
+            fprintf(stderr, "cd: ~username not supported\n");
+            return -1;
+        }
+    } else {
+        /* No tilde, copy as-is */
+        strncpy(expanded, path, expanded_size - 1);
+        expanded[expanded_size - 1] = '\0';
+    }
+    
+    return 0;
+}
+
+/**
+ * Display help information about shell features
+ * @param out Output buffer
+ */
+void print_help(OutBuf* out) {
+    outbuf_puts(out, "ccsh - Compact C Shell\n");
+    outbuf_puts(out, "Supported features:\n");
+    outbuf_puts(out, "  Built-in commands: cd, pwd, exit, help, fg, bg, jobs, wait, alias, unalias, path, which, hash, set, grep, parallel\n");
+    outbuf_puts(out, "  Tilde expansion: ~ expands to home directory (e.g., cd ~, cd ~/Documents)\n");
+    outbuf_puts(out, "  Dynamic prompt: Shows current directory in prompt (e.g., ccsh:~> ccsh:/usr/bin>)\n");
+    outbuf_puts(out, "  External programs: All programs in PATH (e.g., sudo, ls, cat, etc.)\n");
+    outbuf_puts(out, "  I/O Redirection: < (input), > (output), >> (append)\n");
+    outbuf_puts(out, "  Pipelines: cmd1 | cmd2 | ... (stages run concurrently)\n");
+    outbuf_puts(out, "  Command lists: cmd1; cmd2, cmd1 && cmd2, cmd1 || cmd2\n");
+    outbuf_puts(out, "  Job control: & runs in the background, Ctrl+Z stops; jobs, fg and bg to control\n");
+    outbuf_puts(out, "  Timing: time pipeline (wall, user, sys, max RSS, context switches); CCSH_TRACE=file logs each phase\n");
+    outbuf_puts(out, "  Globbing: *, ?, [...], ** and {a,b} (set -o globcache keeps listings)\n");
+    outbuf_puts(out, "  Aliases: alias name='value', unalias name\n");
+    outbuf_puts(out, "  Substitution: $NAME, ${NAME}, $?, $$ and $(command); NAME=value sets a variable\n");
+    outbuf_puts(out, "  Command history with arrow keys, Tab completes commands and paths (if readline available)\n");
+    outbuf_puts(out, "  Signal handling: Ctrl+C to interrupt\n");
+    outbuf_puts(out, "\nExamples:\n");
+    outbuf_puts(out, "  path                    - Show PATH environment variable\n");
+    outbuf_puts(out, "  which ls                - Find location of ls command\n");
+    outbuf_puts(out, "  which sudo              - Find location of sudo command\n");
+    outbuf_puts(out, "  hash                    - List remembered command locations (hash -r to clear)\n");
+    outbuf_puts(out, "  set +o spawn            - Launch commands with fork() instead of posix_spawn\n");
+    outbuf_puts(out, "  cd ~                    - Change to home directory\n");
+    outbuf_puts(out, "  cd ~/Documents          - Change to Documents in home directory\n");
+    outbuf_puts(out, "  sudo ls -la             - Run sudo with arguments\n");
+    outbuf_puts(out, "  ls *.txt > files.txt   - Redirect output to file\n");
+    outbuf_puts(out, "  echo $(pwd) \"$HOME\"    - Substitute command output and variables\n");
+    outbuf_puts(out, "  sleep 10 &             - Run command in background\n");
+    outbuf_puts(out, "  wait / wait -n / wait %0 - Wait for all jobs, any one job, or job 0\n");
+    outbuf_puts(out, "  time make | tail -1    - Report resource usage of the whole pipeline\n");
+    outbuf_puts(out, "  ls -l | grep txt | wc -l - Count matching lines through a pipeline\n");
+    outbuf_puts(out, "  grep pattern file.txt   - Search for pattern in file\n");
+    outbuf_puts(out, "  grep -i -n hello *.txt - Case-insensitive search with line numbers\n");
+    outbuf_puts(out, "  grep -j 4 -u ERROR *.log - Search files on 4 threads, unordered output\n");
+    outbuf_puts(out, "  grep -e WARN -e ERROR app.log - Search several strings in one pass\n");
+    outbuf_puts(out, "  grep -E '^[0-9]+ (GET|POST)' access.log - Extended regular expression\n");
+    outbuf_puts(out, "  parallel -j 4 gzip {} ::: *.log - Run gzip on every log, 4 at a time\n");
+    outbuf_puts(out, "  ls | parallel -u wc -l  - One run per stdin line, output in completion order\n");
+}
+
+/* Built-in dispatch functions */
+
+/**
+ * Built-in exit command implementation
+ * @param argc Number of arguments
+ * @param args Command arguments; args[1] is the exit status (default: last status)
+ * @param io Descriptors of the invocation
+ * @return Exit status for the shell
+ */
+int builtin_exit(int argc, char** args, IoCtx* io) {
+    (void)io;
+    exit_requested = 1;
+    return argc > 1 ? atoi(args[1]) & 0xff : last_status;
+}
+
+/**
+ * Built-in cd command implementation
+ * @param argc Number of arguments
+ * @param args Command arguments; args[1] is the target (default: ~)
+ * @param io Descriptors of the invocation
+ * @return 0 on success, 1 on error
+ */
+int builtin_cd(int argc, char** args, IoCtx* io) {
+    (void)io;
+    char expanded_path[1024];
+    const char* target = argc > 1 ? args[1] : "~";
+    
+    if (expand_tilde(target, expanded_path, sizeof(expanded_path)) != 0) return 1;
+    if (chdir(expanded_path) != 0) {
+        perror("cd");
+        return 1;
+    }
+    /* Resolve the new directory once; the prompt and pwd reuse it */
+    env_set("PWD", NULL);
+    cwd_refresh();
+    if (shell_cwd[0]) env_set("PWD", shell_cwd);
+    return 0;
+}
+
+/**
+ * Built-in pwd command implementation
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0 on success, 1 on error
+ */
+int builtin_pwd(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    (void)args;
+    const char* cwd = current_dir();
+    if (cwd[0]) outbuf_printf(io->out, "%s\n", cwd);
+    else {
+        perror("pwd");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Built-in jobs command implementation
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0
+ */
+int builtin_jobs(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    (void)args;
+    list_jobs(io->out);
+    return 0;
+}
+
+/**
+ * Resolve the job operand of fg and bg
+ * @param arg Job ID, optionally written %N; NULL for the current job
+ * @return Job ID, or -1 if it names no tracked job
+ */
+int job_operand(const char* arg) {
+    if (!arg) {
+        if (find_job(job_current)) return job_current;
+        for (int id = job_slots_used - 1; id >= 0; id--) {
+            if (jobs[id].used) return id;
+        }
+        return -1;
+    }
+    char* end;
+    int is_job = arg[0] == '%';
+    long value = strtol(arg + is_job, &end, 10);
+    if (end == arg + is_job || *end != '\0' || value < 0) return -1;
+    return find_job((int)value) ? (int)value : -1;
+}
+
+/**
+ * Built-in fg command implementation
+ * Continues the job if it is stopped and waits for it in the foreground
+ * @param argc Number of arguments
+ * @param args Command arguments; args[1] is the job ID (default: current job)
+ * @param io Descriptors of the invocation
+ * @return Exit status of the job, 1 on error
+ */
+int builtin_fg(int argc, char** args, IoCtx* io) {
+    int job_id = job_operand(argc > 1 ? args[1] : NULL);
+    Job* job = find_job(job_id);
+    if (!job) {
+        fprintf(stderr, "Invalid job ID: %s\n", argc > 1 ? args[1] : "(none)");
+        return 1;
+    }
+    outbuf_printf(io->out, "%s\n", job_command(job));
+    outbuf_flush(io->out);
+
+    /* The last process may already have been reaped in the background */
+    int last_reaped = job->pids[job->pid_count - 1] == 0;
+    job_unindex(job);  /* Reaped below rather than by the SIGCHLD drain */
+    job->stopped = 0;
+    job_current = job_id;
+    int stopped;
+    int status = wait_for_pids(job->pids, job->pid_count, job->pid, &stopped);
+    if (stopped) {
+        /* Stopped again: track what is left of it */
+        job_index(job_id);
+        job->stopped = 1;
+        job->stop_reported = 1;
+        if (interactive) printf("\n[%d] Stopped %s\n", job_id, job_command(job));
+        return status;
+    }
+    if (last_reaped) status = job->status;
+    /* Remove the job from the list after completion */
+    remove_job(job_id);
+    return status;
+}
+
+/**
+ * Built-in bg command implementation
+ * Continues a stopped job in the background
+ * @param argc Number of arguments
+ * @param args Command arguments; args[1] is the job ID (default: current job)
+ * @param io Descriptors of the invocation
+ * @return 0 on success, 1 on error
+ */
+int builtin_bg(int argc, char** args, IoCtx* io) {
+    int job_id = job_operand(argc > 1 ? args[1] : NULL);
+    Job* job = find_job(job_id);
+    if (!job) {
+        fprintf(stderr, "Invalid job ID: %s\n", argc > 1 ? args[1] : "(none)");
+        return 1;
+    }
+    if (!job->stopped) {
+        fprintf(stderr, "bg: job %d already in background\n", job_id);
+        return 0;
+    }
+    job->stopped = 0;
+    job->stop_reported = 0;
+    job_signal(job, SIGCONT);
+    outbuf_printf(io->out, "[%d] %s &\n", job_id, job_command(job));
+    return 0;
+}
+
+/**
+ * Built-in alias command implementation
+ * alias            - list all aliases
+ * alias name=value - define an alias
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0 on success, 1 on error
+ */
+int builtin_alias(int argc, char** args, IoCtx* io) {
+    if (argc < 2) {
+        /* List all aliases */
+        list_aliases(io->out);
+        return 0;
+    }
+    /* Add new alias */
+    char* eq = strchr(args[1], '=');
+    if (eq && eq > args[1]) {
+        *eq = '\0';
+        char* name = args[1];
+        char* value = eq + 1;  /* Quotes were already removed by the lexer */
+        add_alias(name, value);
+        return 0;
+    }
+    fprintf(stderr, "Usage: alias name='value'\n");
+    return 1;
+}
+
+/**
+ * Built-in unalias command implementation
+ * @param argc Number of arguments
+ * @param args Command arguments; args[1] is the alias to remove
+ * @param io Descriptors of the invocation
+ * @return 0 on success, 1 on error
+ */
+int builtin_unalias(int argc, char** args, IoCtx* io) {
+    (void)io;
+    if (argc < 2) {
+        fprintf(stderr, "Usage: unalias name\n");
+        return 1;
+    }
+    remove_alias(args[1]);
+    return 0;
+}
+
+/**
+ * Built-in help command implementation
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0
+ */
+int builtin_help(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    (void)args;
+    print_help(io->out);
+    return 0;
+}
+
+/**
+ * Built-in path command implementation: show the PATH environment variable
+ * @param argc Number of arguments
+ * @param args Command arguments
+ * @param io Descriptors of the invocation
+ * @return 0
+ */
+int builtin_path(int argc, char** args, IoCtx* io) {
+    (void)argc;
+    (void)args;
+    const char* path = getenv("PATH");
+    if (path) {
+        outbuf_printf(io->out, "PATH=%s\n", path);
+    } else {
+        outbuf_puts(io->out, "PATH environment variable not set\n");
+    }
+    return 0;
+}
+
+/**
+ * Built-in which command implementation: find an executable in PATH
+ * @param argc Number of arguments
+ * @param args Command arguments; args[1] is the command to look up
+ * @param io Descriptors of the invocation
+ * @return 0 if found, 1 otherwise
+ */
+int builtin_which(int argc, char** args, IoCtx* io) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: which <command>\n");
+        return 1;
+    }
+    
+    if (!getenv("PATH")) {
+        fprintf(stderr, "PATH environment variable not set\n");
+        return 1;
+    }
+    
+    const char* full_path = hash_lookup_command(args[1]);
+    if (!full_path && strchr(args[1], '/') && access(args[1], X_OK) == 0) {
+        full_path = args[1];
+    }
+    if (!full_path) {
+        fprintf(stderr, "which: %s not found\n", args[1]);
+        return 1;
+    }
+    outbuf_printf(io->out, "%s\n", full_path);
+    return 0;
+}
+
+/**
+ * Hash of a builtin name with a given first-character weight
+ * @param name Command name
+ * @param len Length of name (at least 1)
+ * @param weight Multiplier of the first character
+ * @return Slot index
+ */
+static unsigned int builtin_name_hash(const char* name, size_t len, unsigned int weight) {
+    return (weight * (unsigned char)name[0] + (unsigned char)name[len - 1] + (unsigned int)len) &
+           (BUILTIN_TABLE_SIZE - 1);
+}
+
+/**
+ * Slot of a builtin name in builtin_table
+ * BUILTIN_HASH_WEIGHT makes every name below land in its own slot, so a
+ * lookup is a single strcmp. The slots are written out by hand;
+ * builtin_table_check, run by make test, verifies them and, when they are
+ * wrong, searches for a weight that keeps the names collision-free.
+ * @param name Command name
+ * @param len Length of name (at least 1)
+ * @return Slot index
+ */
+static unsigned int builtin_slot(const char* name, size_t len) {
+    return builtin_name_hash(name, len, BUILTIN_HASH_WEIGHT);
+}
+
+/* Builtins by builtin_slot() */
+static const Builtin builtin_table[BUILTIN_TABLE_SIZE] = {
+    [0]  = { "unalias", builtin_unalias, BUILTIN_STATE | BUILTIN_SNAPSHOT },
+    [1]  = { "set", builtin_set, BUILTIN_STATE | BUILTIN_SNAPSHOT | BUILTIN_CAPTURE },
+    [3]  = { "jobs", builtin_jobs, BUILTIN_CAPTURE },
+    [4]  = { "help", builtin_help, BUILTIN_CAPTURE },
+    [5]  = { "bg", builtin_bg, BUILTIN_STATE },
+    [6]  = { "alias", builtin_alias, BUILTIN_STATE | BUILTIN_SNAPSHOT | BUILTIN_CAPTURE },
+    [7]  = { "pwd", builtin_pwd, BUILTIN_CAPTURE },
+    [12] = { "path", builtin_path, BUILTIN_CAPTURE },
+    [15] = { "which", builtin_which, BUILTIN_CAPTURE },
+    [16] = { "cd", builtin_cd, BUILTIN_STATE },
+    [20] = { "parallel", builtin_parallel, BUILTIN_JOB },
+    [22] = { "grep", builtin_grep, BUILTIN_CAPTURE },
+    [26] = { "wait", builtin_wait, BUILTIN_STATE },
+    [28] = { "hash", builtin_hash, BUILTIN_STATE | BUILTIN_SNAPSHOT | BUILTIN_CAPTURE },
+    [29] = { "fg", builtin_fg, BUILTIN_STATE },
+    [30] = { "exit", builtin_exit, BUILTIN_STATE },
+};
+
+#ifdef CCSH_CHECK_BUILTINS
+/**
+ * Verify that every builtin sits in the slot builtin_slot gives its name
+ * On a mismatch, reports it together with the first weight under which
+ * all names are collision-free, so the table can be re-laid out
+ * @return 0 if the table is consistent, -1 otherwise (reported on stderr)
+ */
+int builtin_table_check() {
+    int status = 0;
+    for (unsigned int i = 0; i < BUILTIN_TABLE_SIZE; i++) {
+        const char* name = builtin_table[i].name;
+        if (!name) continue;
+        size_t len = strlen(name);
+        if (len > BUILTIN_MAX_NAME || builtin_slot(name, len) != i) {
+            fprintf(stderr, "ccsh: builtin table: %s is in slot %u but hashes to %u\n",
+                    name, i, builtin_slot(name, len));
+            status = -1;
+        }
+    }
+    if (status == 0) return 0;
+
+    for (unsigned int weight = 1; weight < 1024; weight++) {
+        unsigned int used = 0;
+        int unique = 1;
+        for (int i = 0; i < BUILTIN_TABLE_SIZE && unique; i++) {
+            const char* name = builtin_table[i].name;
+            if (!name) continue;
+            unsigned int bit = 1u << builtin_name_hash(name, strlen(name), weight);
+            unique = !(used & bit);
+            used |= bit;
+        }
+        if (unique) {
+            fprintf(stderr, "ccsh: builtin table: BUILTIN_HASH_WEIGHT %uu places every name in its own slot\n",
+                    weight);
+            break;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Entry point of builtin_check, the table check make test runs
+ * @return 0 if the table is consistent, 1 otherwise
+ */
+int main() {
+    return builtin_table_check() != 0;
+}
+#endif /* CCSH_CHECK_BUILTINS */
+
+/**
+ * Look up a builtin by name
+ * @param name Command name
+ * @return Table entry, or NULL if name is not a builtin
+ */
+const Builtin* find_builtin(const char* name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > BUILTIN_MAX_NAME) return NULL;
+    const Builtin* builtin = &builtin_table[builtin_slot(name, len)];
+    return builtin->name && strcmp(builtin->name, name) == 0 ? builtin : NULL;
+}
+
+/**
+ * Check whether a command name is a shell builtin
+ * @param name Command name
+ * @return 1 if builtin, 0 otherwise
+ */
+int is_builtin(const char* name) {
+    return find_builtin(name) != NULL;
+}
+
+/**
+ * Run a builtin command in the current process
+ * Output goes through io->out when the caller supplies a buffer, otherwise
+ * through the shared builtin buffer bound to io->out_fd, and is flushed
+ * when the builtin returns
+ * @param builtin Table entry from find_builtin
+ * @param argv Null-terminated command arguments
+ * @param io Descriptors of the invocation; io->out is set here if NULL
+ * @return Exit status of the builtin
+ */
+int run_builtin(const Builtin* builtin, char** argv, IoCtx* io) {
+    int argc = 0;
+    while (argv[argc]) argc++;
+
+    /* Anything the shell printed itself goes out before the builtin's output */
+    fflush(stdout);
+    if (!io->out) {
+        outbuf_init(&builtin_out, io->out_fd);
+        io->out = &builtin_out;
+    }
+    int status = builtin->handler(argc, argv, io);
+    outbuf_flush(io->out);
+    return status;
+}
+
+/* Pipeline functions */
+
+/**
+ * Initialize an empty command list
+ * @param cmds Command list
+ */
+void command_list_init(CommandList* cmds) {
+    memset(cmds, 0, sizeof(*cmds));
+}
+
+/**
+ * Release the storage owned by a command list
+ * @param cmds Command list
+ */
+void command_list_free(CommandList* cmds) {
+    free(cmds->args);
+    free(cmds->arg_glob);
+    free(cmds->stages);
+    free(cmds->pipelines);
+    command_list_init(cmds);
+}
+
+/**
+ * Parse one pipeline, splitting the token stream on '|'
+ * @param list Token list of the command line
+ * @param pos Index of the pipeline's first token; advanced past it
+ * @param cmds Command list receiving the pipeline and its stages
+ * @return 0 on success, -1 on syntax error
+ */
+int parse_pipeline(const TokenList* list, int* pos, CommandList* cmds) {
+    if (cmds->count == cmds->cap) {
+        int cap = cmds->cap ? cmds->cap * 2 : 8;
+        Pipeline* grown = realloc(cmds->pipelines, cap * sizeof(Pipeline));
+        if (!grown) return -1;
+        cmds->pipelines = grown;
+        cmds->cap = cap;
+    }
+    Pipeline* pipeline = &cmds->pipelines[cmds->count++];
+    pipeline->first = cmds->stage_count;
+    pipeline->count = 0;
+    pipeline->background = 0;
+    pipeline->connector = TOK_SEMI;
+    pipeline->timed = 0;
+    pipeline->text_start = list->tokens[*pos].start;
+    pipeline->text_end = pipeline->text_start;
+
+    /* A leading unquoted time reports the pipeline's resource usage */
+    while (*pos < list->count && list->tokens[*pos].kind == TOK_WORD &&
+           !(list->tokens[*pos].flags & TOKF_QUOTED) && strcmp(token_word(list, *pos), "time") == 0) {
+        pipeline->timed = 1;
+        (*pos)++;
+    }
+
+    while (1) {
+        if (pipeline->count == MAX_STAGES) {
+            fprintf(stderr, "ccsh: too many pipeline stages (max %d)\n", MAX_STAGES);
+            return -1;
+        }
+        if (cmds->stage_count == cmds->stage_cap) {
+            int cap = cmds->stage_cap ? cmds->stage_cap * 2 : 4;
+            Stage* grown = realloc(cmds->stages, cap * sizeof(Stage));
+            if (!grown) return -1;
+            cmds->stages = grown;
+            cmds->stage_cap = cap;
+        }
+
+        Stage* stage = &cmds->stages[cmds->stage_count++];
+        pipeline->count++;
+        int first = *pos;
+        if (parse_command(list, pos, cmds, stage) != 0) return -1;
+        if (*pos > first) {
+            const Token* last = &list->tokens[*pos - 1];
+            pipeline->text_end = last->start + last->len;
+        }
+
+        int bar = *pos < list->count && list->tokens[*pos].kind == TOK_PIPE;
+        if (stage->argc == 0 && (bar || pipeline->count > 1 || (*pos == first && !pipeline->timed))) {
+            fprintf(stderr, "ccsh: syntax error near unexpected token `%s'\n",
+                    *pos < list->count ? token_text(list->tokens[*pos].kind) : "newline");
+            return -1;
+        }
+        if (!bar) break;
+        (*pos)++;
+    }
+    return 0;
+}
+
+/**
+ * Parse a command line into pipelines joined by ;, &, && and ||
+ * The line is parsed once; evaluation walks the resulting list
+ * @param list Token list of the command line
+ * @param cmds Command list (cleared first, storage reused)
+ * @return 0 on success, -1 on syntax error
+ */
+int parse_list(const TokenList* list, CommandList* cmds) {
+    cmds->count = 0;
+    cmds->stage_count = 0;
+    cmds->arg_count = 0;
+
+    int pos = 0;
+    int connector = TOK_SEMI;
+    while (pos < list->count) {
+        if (list->tokens[pos].kind == TOK_SEMI && connector == TOK_SEMI) {
+            /* Empty command (blank line or trailing ';') */
+            pos++;
+            continue;
+        }
+        if (parse_pipeline(list, &pos, cmds) != 0) return -1;
+        Pipeline* pipeline = &cmds->pipelines[cmds->count - 1];
+        pipeline->connector = connector;
+        connector = TOK_SEMI;
+
+        if (pos == list->count) break;
+        int kind = list->tokens[pos++].kind;
+        if (kind == TOK_AMP) {
+            pipeline->background = 1;
+        } else if (kind == TOK_AND || kind == TOK_OR) {
+            connector = kind;
+            if (pos == list->count) {
+                fprintf(stderr, "ccsh: syntax error near unexpected token `newline'\n");
+                return -1;
+            }
+        } else if (kind != TOK_SEMI) {
+            fprintf(stderr, "ccsh: syntax error near unexpected token `%s'\n", token_text(kind));
+            return -1;
+        }
+    }
+
+    /* The argument vector is final; give each stage its slice */
+    for (int i = 0; i < cmds->stage_count; i++) {
+        Stage* stage = &cmds->stages[i];
+        stage->args = cmds->args + stage->first_arg;
+        stage->glob = cmds->arg_glob + stage->first_arg;
+    }
+    return 0;
+}
+
+/**
+ * Run a pipeline with every stage executing concurrently
+ * All stages share one process group; the exit status is the last stage's
+ * @param stages Parsed stages
+ * @param count Number of stages
+ * @param background Set to 1 to run as a background job
+ * @param cmdline Original command line for job display
+ * @return Exit status of the last stage (0 for background jobs)
+ */
+int run_pipeline(Stage* stages, int count, int background, const char* cmdline) {
+    pid_t pids[MAX_STAGES];
+    pid_t pgid = 0;
+    int prev_read = -1;
+    int empty = 0;  /* A stage expanded to no words */
+
+    /* Catch SIGCHLD before the first background child can exit */
+    if (background) jobs_init();
+
+    for (int i = 0; i < count; i++) {
+        int fds[2] = { -1, -1 };
+        if (i < count - 1) {
+            if (pipe(fds) == -1) {
+                perror("pipe");
+                for (int j = i; j < count; j++) pids[j] = 0;
+                break;
+            }
+            set_cloexec(fds[0]);
+            set_cloexec(fds[1]);
+        }
+
+        /* Pipe ends currently open in the shell, closed in forked children */
+        int pipe_fds[3] = { prev_read, fds[0], fds[1] };
+        int pipe_fd_count = 3;
+
+        /* Expand glob patterns in arguments */
+        uint64_t start = trace_start();
+        int expand_failed = expand_globs(stages[i].args, stages[i].glob, &shell_argv) != 0;
+        char** expanded = shell_argv.argv;
+        trace_event(start, "glob", stages[i].args[0], shell_argv.count);
+        if (!expand_failed && !expanded[0]) {
+            /* Every word substituted to nothing: the stage is an empty command */
+            pids[i] = 0;
+            empty = 1;
+            if (prev_read != -1) close(prev_read);
+            if (fds[1] != -1) close(fds[1]);
+            prev_read = fds[0];
+            continue;
+        }
+        if (!expand_failed && !is_builtin(expanded[0]) && argv_arena_too_big(&shell_argv)) {
+            fprintf(stderr, "ccsh: %s: %s\n", expanded[0], strerror(E2BIG));
+            expand_failed = 1;
+        }
+
+        char* infile = stages[i].infile;
+        char* outfile = stages[i].outfile;
+        char* infile_storage = NULL;
+        char* outfile_storage = NULL;
+        if (!expand_failed && (expand_target(&infile, &infile_storage) != 0 ||
+                               expand_target(&outfile, &outfile_storage) != 0)) {
+            expand_failed = 1;
+        }
+
+        LaunchSpec spec;
+        spec.argv = expanded;
+        spec.infile = infile;
+        spec.outfile = outfile;
+        spec.append = stages[i].append;
+        spec.in_fd = prev_read;
+        spec.out_fd = fds[1];
+        spec.pgid = pgid;
+        spec.resolved = NULL;
+
+        if (expand_failed) {
+            pids[i] = 0;  /* Stage is skipped; its neighbours see EOF */
+        } else if (is_builtin(expanded[0])) {
+            pids[i] = fork_command(&spec, 1, pipe_fds, pipe_fd_count);
         } else {
-            /* Non-option argument */
-            if (!pattern) {
-                pattern = args[i];
-            } else {
-                /* File argument */
-                file_count++;
-                files = realloc(files, file_count * sizeof(char*));
-                files[file_count - 1] = args[i];
+            /* Resolve the command once in the parent so the cache persists */
+            spec.resolved = hash_lookup_command(expanded[0]);
+            pids[i] = launch_command(&spec, pipe_fds, pipe_fd_count);
+        }
+        free(infile_storage);
+        free(outfile_storage);
+        if (pids[i] > 0 && pgid == 0) {
+            pgid = pids[i];
+            /* Hand over the terminal now, so Ctrl+C during the launch reaches the job */
+            if (job_control && !background) tcsetpgrp(STDIN_FILENO, pgid);
+        }
+
+        /* The parent keeps only the read end the next stage needs */
+        if (prev_read != -1) close(prev_read);
+        if (fds[1] != -1) close(fds[1]);
+        prev_read = fds[0];
+    }
+    if (prev_read != -1) close(prev_read);
+
+    if (pgid == 0) return count == 1 && empty ? 0 : 1;  /* Nothing started */
+
+    if (background) {
+        int id = add_job(pids, count, pgid, cmdline);
+        if (id >= 0 && interactive) printf("[%d] %d\n", id, pgid);
+        return 0;
+    }
+
+    /* Ctrl+C that reached the shell before the handoff is passed on */
+    if (job_control && sigint_pending) kill(-pgid, SIGINT);
+
+    int stopped;
+    int status = wait_for_pids(pids, count, pgid, &stopped);
+    if (stopped) {
+        /* Ctrl+Z: keep the rest of the pipeline as a stopped job */
+        jobs_init();
+        int id = add_job(pids, count, pgid, cmdline);
+        if (id >= 0) {
+            jobs[id].stopped = 1;
+            jobs[id].stop_reported = 1;
+            if (interactive) printf("\n[%d] Stopped %s\n", id, cmdline);
+        }
+    }
+    return status;
+}
+
+/* History functions */
+
+/**
+ * Choose the history file and size from $HISTFILE and $HISTSIZE
+ * Nothing is read until history_load is called
+ */
+void history_init() {
+    const char* file = getenv("HISTFILE");
+    if (file && *file) {
+        history_path = strdup(file);
+    } else {
+        const char* home = getenv("HOME");
+        if (!home) return;
+        size_t len = strlen(home) + sizeof("/.ccsh_history");
+        history_path = malloc(len);
+        snprintf(history_path, len, "%s/.ccsh_history", home);
+    }
+
+    const char* size = getenv("HISTSIZE");
+    if (size && atoi(size) > 0) history_size = atoi(size);
+    #if READLINE_LIB
+    stifle_history(history_size);
+    #endif
+}
+
+/**
+ * Replace the history file with just its tail
+ * Written to a temporary file and renamed, so a crash never loses the file
+ * @param tail Start of the lines to keep
+ * @param len Length of the tail
+ */
+static void history_compact(const char* tail, size_t len) {
+    size_t path_len = strlen(history_path) + sizeof(".tmp");
+    char* tmp = malloc(path_len);
+    snprintf(tmp, path_len, "%s.tmp", history_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        int ok = write_all(fd, tail, len) == 0;
+        close(fd);
+        if (!ok || rename(tmp, history_path) != 0) unlink(tmp);
+    }
+    free(tmp);
+}
+
+/**
+ * Load the last $HISTSIZE entries of the history file
+ * The file is mapped and scanned backwards from the end, so only the tail
+ * that is kept is ever touched; when the stale head outweighs the tail
+ * the file is compacted
+ */
+void history_load() {
+    if (!history_path) return;
+    int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+
+    /* Walk back over history_size lines (ignoring a final newline) */
+    size_t start = size;
+    if (start > 0 && data[start - 1] == '\n') start--;
+    int lines = 0;
+    while (start > 0) {
+        if (data[start - 1] == '\n' && ++lines == history_size) break;
+        start--;
+    }
+
+    char* entry = NULL;
+    size_t entry_cap = 0;
+    for (size_t pos = start; pos < size; ) {
+        const char* nl = memchr(data + pos, '\n', size - pos);
+        size_t len = (nl ? (size_t)(nl - data) : size) - pos;
+        if (len > 0) {
+            if (len + 1 > entry_cap) {
+                entry_cap = (len + 1) * 2;
+                entry = realloc(entry, entry_cap);
             }
+            memcpy(entry, data + pos, len);
+            entry[len] = '\0';
+            #if READLINE_LIB
+            add_history(entry);
+            #endif
         }
+        pos += len + 1;
     }
-    
-    if (!pattern) {
-        fprintf(stderr, "grep: no pattern specified\n");
-        free(files);
-        return 1;
+    if (entry) {
+        free(history_last);
+        history_last = entry;  /* Last line loaded */
     }
-    
-    /* If no files specified, read from stdin */
-    if (file_count == 0) {
-        files = malloc(sizeof(char*));
-        files[0] = NULL;  /* NULL means stdin */
-        file_count = 1;
+
+    if (start > size - start && size > HISTORY_COMPACT_MIN) history_compact(data + start, size - start);
+    munmap(data, size);
+}
+
+/**
+ * Record an entered line in memory and append it to the history file
+ * A line identical to the previous entry is skipped; each entry is
+ * written with a single writev so concurrent shells never interleave
+ * @param line Command line
+ */
+void history_add(const char* line) {
+    if (history_last && strcmp(history_last, line) == 0) return;
+    free(history_last);
+    history_last = strdup(line);
+    #if READLINE_LIB
+    add_history(line);
+    #endif
+
+    if (!history_path) return;
+    if (history_fd == -1) {
+        history_fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (history_fd == -1) return;
     }
-    
-    /* Process each file */
-    for (int file_idx = 0; file_idx < file_count; file_idx++) {
-        FILE* file = stdin;
-        char* filename = files[file_idx];
-        
-        if (filename) {
-            file = fopen(filename, "r");
-            if (!file) {
-                fprintf(stderr, "grep: %s: No such file or directory\n", filename);
-                continue;
+    struct iovec parts[2];
+    parts[0].iov_base = (void*)line;
+    parts[0].iov_len = strlen(line);
+    parts[1].iov_base = "\n";
+    parts[1].iov_len = 1;
+    if (writev(history_fd, parts, 2) == -1) {
+        /* History is best effort */
+    }
+}
+
+/* Script execution functions */
+
+/**
+ * Run one pipeline of a parsed command list
+ * A lone foreground builtin runs in the shell itself, with its redirections
+ * opened here and handed over in its descriptor context instead of forking;
+ * everything else goes through run_pipeline
+ * @param cmds Command list
+ * @param pipeline Pipeline to run
+ * @param line Command line the list was parsed from (for job display)
+ * @return Exit status of the pipeline
+ */
+int run_list_pipeline(CommandList* cmds, const Pipeline* pipeline, const char* line) {
+    Stage* stages = cmds->stages + pipeline->first;
+
+    /* Skip if no command */
+    if (!stages[0].args[0]) return 0;
+
+    /* Handle built-in commands in the shell itself */
+    const Builtin* builtin = find_builtin(stages[0].args[0]);
+    int redirected = stages[0].infile || stages[0].outfile;
+    if (rc_cacheable == 1) {
+        /* The rc snapshot only holds the state of snapshot builtins run as written */
+        int literal = 1;
+        for (int i = 0; stages[0].args[i]; i++) literal &= !stages[0].glob[i];
+        if (!builtin || !(builtin->flags & BUILTIN_SNAPSHOT) || pipeline->count > 1 ||
+            pipeline->background || redirected || !literal) {
+            rc_cacheable = 0;
+        }
+    }
+
+    /* A command of nothing but NAME=value words sets variables */
+    if (!builtin && pipeline->count == 1 && !pipeline->background) {
+        int assignments = 1;
+        for (int i = 0; stages[0].args[i] && assignments; i++) assignments = is_assignment(stages[0].args[i]);
+        if (assignments) return run_assignments(stages[0].args, stages[0].glob);
+    }
+    /* A builtin that runs children of its own is forked instead, so Ctrl+Z
+       stops it with them and fg or bg can resume the whole job */
+    if (builtin && (builtin->flags & BUILTIN_JOB) && job_control) builtin = NULL;
+    if (builtin && pipeline->count == 1 && !pipeline->background) {
+        IoCtx io = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, NULL };
+        char* infile = stages[0].infile;
+        char* outfile = stages[0].outfile;
+        char* storage = NULL;
+        if (infile) {
+            int failed = expand_target(&infile, &storage) != 0;
+            if (!failed) io.in_fd = open(infile, O_RDONLY | O_CLOEXEC);
+            free(storage);
+            if (failed || io.in_fd < 0) {
+                if (!failed) perror("input");
+                return 1;
             }
         }
-        
-        char line[4096];
-        int line_number = 0;
-        int match_count = 0;
-        
-        while (fgets(line, sizeof(line), file)) {
-            line_number++;
-            
-            /* Remove newline */
-            size_t len = strlen(line);
-            if (len > 0 && line[len-1] == '\n') {
-                line[len-1] = '\0';
+        if (outfile) {
+            int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (stages[0].append ? O_APPEND : O_TRUNC);
+            int failed = expand_target(&outfile, &storage) != 0;
+            if (!failed) io.out_fd = open(outfile, flags, 0644);
+            free(storage);
+            if (failed || io.out_fd < 0) {
+                if (!failed) perror("output");
+                if (io.in_fd != STDIN_FILENO) close(io.in_fd);
+                return 1;
             }
-            
-            int matches = simple_match(line, pattern, case_insensitive);
-            if (invert_match) matches = !matches;
-            
-            if (matches) {
-                match_count++;
-                if (!count_only) {
-                    if (file_count > 1 && filename) {
-                        printf("%s:", filename);
-                    }
-                    if (show_line_numbers) {
-                        printf("%d:", line_number);
-                    }
-                    printf("%s\n", line);
+        }
+
+        /* Builtins see glob-expanded arguments just like external commands */
+        int status = 1;
+        uint64_t start = trace_start();
+        if (expand_globs(stages[0].args, stages[0].glob, &shell_argv) == 0) {
+            trace_event(start, "glob", builtin->name, shell_argv.count);
+            start = trace_start();
+            status = run_builtin(builtin, shell_argv.argv, &io);
+            trace_event(start, "builtin", builtin->name, status);
+        }
+        fflush(stdout);  /* Keep builtin output ordered before later commands' */
+        if (io.in_fd != STDIN_FILENO) close(io.in_fd);
+        if (io.out_fd != STDOUT_FILENO) close(io.out_fd);
+        return status;
+    }
+
+    /* Execute external command or pipeline */
+    char text[1024];
+    snprintf(text, sizeof(text), "%.*s", (int)(pipeline->text_end - pipeline->text_start),
+             line + pipeline->text_start);
+    return run_pipeline(stages, pipeline->count, pipeline->background, text);
+}
+
+/**
+ * Run one command line: lex, expand aliases, parse once and evaluate
+ * && and || skip the next pipeline depending on the last exit status
+ * @param tokens Token list reused across lines
+ * @param cmds Command list reused across lines
+ * @param line Command line
+ * @return 1 if the shell should exit, 0 otherwise
+ */
+int run_line(TokenList* tokens, CommandList* cmds, const char* line) {
+    /* Lex the line and expand aliases on the token stream */
+    glob_begin(1);
+    uint64_t start = trace_start();
+    int failed = tokenize(tokens, line) != 0;
+    trace_event(start, "lex", line, tokens->count);
+    if (!failed) {
+        start = trace_start();
+        failed = expand_alias(tokens) != 0;
+        trace_event(start, "alias", line, tokens->count);
+    }
+    if (!failed) {
+        start = trace_start();
+        failed = parse_list(tokens, cmds) != 0;
+        trace_event(start, "parse", line, cmds->count);
+    }
+    if (failed) {
+        last_status = 2;
+        return 0;
+    }
+
+    /* Ctrl+C reaching the shell abandons the rest of the line */
+    sigint_pending = 0;
+    for (int i = 0; i < cmds->count && !exit_requested && !sigint_pending; i++) {
+        const Pipeline* pipeline = &cmds->pipelines[i];
+        if (pipeline->connector == TOK_AND && last_status != 0) continue;
+        if (pipeline->connector == TOK_OR && last_status == 0) continue;
+        TimeSample sample;
+        if (pipeline->timed) time_begin(&sample);
+        last_status = run_list_pipeline(cmds, pipeline, line);
+        if (sigint_pending) last_status = 128 + SIGINT;  /* Interrupted, possibly before it started */
+        if (pipeline->timed) time_report(&sample);
+    }
+    return exit_requested;
+}
+
+/**
+ * Execute commands read from a descriptor without prompting
+ * Input is consumed in large blocks through a chunk reader (a script file is
+ * mapped whole); when the source is stdin and seekable, its offset is kept
+ * just past the current line so commands reading stdin see what follows,
+ * and reading resumes from wherever they leave it
+ * @param fd Script descriptor
+ * @param tokens Token list reused across lines
+ * @param cmds Command list reused across lines
+ */
+void run_script(int fd, TokenList* tokens, CommandList* cmds) {
+    ChunkReader reader;
+    reader_init(&reader, fd);
+    char* line = NULL;
+    size_t line_cap = 0;
+    int done = 0;
+
+    const char* data;
+    size_t len;
+    while (!done && reader_next_chunk(&reader, &data, &len)) {
+        const char* end = data + len;
+        for (const char* p = data; p < end && !done; ) {
+            const char* nl = memchr(p, '\n', (size_t)(end - p));
+            const char* line_end = nl ? nl : end;
+            size_t line_len = (size_t)(line_end - p);
+
+            if (line_len + 1 > line_cap) {
+                size_t cap = line_cap ? line_cap : 256;
+                while (cap < line_len + 1) cap *= 2;
+                char* grown = realloc(line, cap);
+                if (!grown) {
+                    done = 1;
+                    break;
                 }
+                line = grown;
+                line_cap = cap;
+            }
+            memcpy(line, p, line_len);
+            line[line_len] = '\0';
+            p = nl ? nl + 1 : end;
+
+            int shared = fd == STDIN_FILENO && reader.map;
+            if (shared) lseek(fd, p - reader.map, SEEK_SET);
+            if (job_count > 0) check_background_jobs();
+            done = run_line(tokens, cmds, line);
+            if (shared) {
+                /* Resume wherever the command left the offset */
+                off_t pos = lseek(fd, 0, SEEK_CUR);
+                if (pos >= 0 && (size_t)pos <= reader.map_len) p = reader.map + pos;
             }
         }
-        
-        if (count_only && filename) {
-            printf("%d\n", match_count);
-        } else if (count_only && !filename) {
-            printf("%d\n", match_count);
+    }
+    free(line);
+    reader_close(&reader);
+}
+
+/* Startup file functions */
+
+/* Header of the rc snapshot; the sections follow in the order listed */
+typedef struct {
+    char magic[8];            /* RC_SNAPSHOT_MAGIC */
+    uint32_t alias_size;      /* sizeof(Alias) of the writer */
+    uint32_t option_count;    /* Entries in the option section */
+    uint64_t rc_size;         /* Key: size of the rc file */
+    int64_t rc_mtime;         /* Key: modification time of the rc file */
+    int64_t rc_mtime_nsec;
+    uint64_t rc_dev;          /* Key: device and inode of the rc file */
+    uint64_t rc_ino;
+    uint64_t alias_capacity;  /* Alias slots, copied as they are */
+    uint64_t alias_count;
+    uint64_t arena_len;       /* Bytes of alias names and values */
+    uint64_t path_len;        /* PATH the hashed commands were found in, with NUL */
+    uint64_t hash_count;      /* Hashed commands */
+    uint64_t hash_len;        /* Bytes of NUL-terminated name/path pairs */
+} RcSnapshot;
+
+#define RC_SNAPSHOT_MAGIC "ccshrc1"
+
+/**
+ * Locate the rc file and its snapshot
+ * @param rc_path Buffer receiving ~/.ccshrc
+ * @param cache_path Buffer receiving $XDG_CACHE_HOME/ccsh/rc.bin (default ~/.cache)
+ * @param size Size of both buffers
+ * @return 0 on success, -1 if HOME is not set
+ */
+static int rc_paths(char* rc_path, char* cache_path, size_t size) {
+    const char* home = getenv("HOME");
+    if (!home || !*home) return -1;
+    snprintf(rc_path, size, "%s/.ccshrc", home);
+    const char* cache = getenv("XDG_CACHE_HOME");
+    if (cache && *cache) snprintf(cache_path, size, "%s/ccsh/rc.bin", cache);
+    else snprintf(cache_path, size, "%s/.cache/ccsh/rc.bin", home);
+    return 0;
+}
+
+/**
+ * Fill the key fields of a snapshot header from the rc file's status
+ * @param header Header to fill
+ * @param st Status of the rc file
+ */
+static void rc_snapshot_key(RcSnapshot* header, const struct stat* st) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, RC_SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->alias_size = sizeof(Alias);
+    header->option_count = sizeof(shell_options) / sizeof(shell_options[0]) - 1;
+    header->rc_size = (uint64_t)st->st_size;
+    header->rc_mtime = (int64_t)st->st_mtime;
+#ifdef __APPLE__
+    header->rc_mtime_nsec = (int64_t)st->st_mtimespec.tv_nsec;
+#else
+    header->rc_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+#endif
+    header->rc_dev = (uint64_t)st->st_dev;
+    header->rc_ino = (uint64_t)st->st_ino;
+}
+
+/**
+ * Restore aliases, options and hashed commands from a snapshot
+ * The file is mapped and its sections copied in a few memcpy calls; nothing
+ * is re-parsed. Hashed commands are only kept if PATH is unchanged.
+ * @param cache_path Snapshot file
+ * @param st Status of the rc file the snapshot must match
+ * @return 0 if the snapshot was valid and restored, -1 otherwise
+ */
+static int rc_snapshot_load(const char* cache_path, const struct stat* st) {
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) != 0 || (size_t)cache_st.st_size < sizeof(RcSnapshot)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)cache_st.st_size;
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    RcSnapshot key, header;
+    rc_snapshot_key(&key, st);
+    memcpy(&header, map, sizeof(header));
+    size_t options_len = header.option_count * sizeof(int32_t);
+    size_t alias_len = header.alias_capacity * sizeof(Alias);
+    size_t expected = sizeof(header) + options_len + alias_len + header.arena_len +
+                      header.path_len + header.hash_len;
+    if (memcmp(header.magic, key.magic, sizeof(key.magic)) != 0 ||
+        header.alias_size != key.alias_size || header.option_count != key.option_count ||
+        header.rc_size != key.rc_size || header.rc_mtime != key.rc_mtime ||
+        header.rc_mtime_nsec != key.rc_mtime_nsec || header.rc_dev != key.rc_dev ||
+        header.rc_ino != key.rc_ino || expected != size ||
+        (header.alias_capacity & (header.alias_capacity - 1)) != 0) {
+        munmap(map, size);
+        return -1;
+    }
+
+    /* Every string must end inside its section */
+    const char* p = map + sizeof(header);
+    const char* arena = p + options_len + alias_len;
+    const char* strings = arena + header.arena_len;
+    int valid = header.alias_count <= header.alias_capacity &&
+                (header.arena_len == 0 || arena[header.arena_len - 1] == '\0') &&
+                (header.path_len == 0 || strings[header.path_len - 1] == '\0') &&
+                (header.hash_len == 0 || map[size - 1] == '\0');
+    for (uint64_t i = 0; valid && i < header.alias_capacity; i++) {
+        Alias slot;
+        memcpy(&slot, p + options_len + i * sizeof(Alias), sizeof(slot));
+        if (slot.used && (slot.name >= header.arena_len || slot.value >= header.arena_len)) valid = 0;
+    }
+    if (!valid) {
+        munmap(map, size);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < header.option_count; i++) {
+        int32_t value;
+        memcpy(&value, p + i * sizeof(int32_t), sizeof(value));
+        *shell_options[i].value = value;
+    }
+    p += options_len;
+
+    /* Alias slots and strings are stored exactly as the table holds them */
+    free(aliases);
+    free(alias_arena.data);
+    aliases = header.alias_capacity ? malloc(alias_len) : NULL;
+    memcpy(aliases, p, alias_len);
+    p += alias_len;
+    alias_capacity = header.alias_capacity;
+    alias_count = (int)header.alias_count;
+    alias_arena.data = header.arena_len ? malloc(header.arena_len) : NULL;
+    memcpy(alias_arena.data, p, header.arena_len);
+    alias_arena.len = alias_arena.cap = header.arena_len;
+    alias_arena.dead = 0;
+    p += header.arena_len;
+
+    const char* path = getenv("PATH");
+    if (header.path_len > 0 && path && strcmp(path, p) == 0) {
+        cmd_hash_check_path();
+        const char* entry = p + header.path_len;
+        for (uint64_t i = 0; i < header.hash_count; i++) {
+            const char* full_path = entry + strlen(entry) + 1;
+            cmd_hash_insert(entry, full_path);
+            entry = full_path + strlen(full_path) + 1;
         }
-        
-        if (filename) {
-            fclose(file);
+    }
+    munmap(map, size);
+    return 0;
+}
+
+/**
+ * Write the current aliases, options and hashed commands to a snapshot
+ * The file is written beside the target and renamed over it, so readers
+ * never see a partial snapshot
+ * @param cache_path Snapshot file
+ * @param st Status of the rc file the snapshot belongs to
+ */
+static void rc_snapshot_save(const char* cache_path, const struct stat* st) {
+    /* Create the cache directories (e.g. ~/.cache and ~/.cache/ccsh) */
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", cache_path);
+    for (char* slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+    }
+
+    /* Drop dead strings so the arena holds live aliases only */
+    if (alias_arena.dead > 0) alias_rehash(alias_capacity);
+
+    RcSnapshot header;
+    rc_snapshot_key(&header, st);
+    header.alias_capacity = alias_capacity;
+    header.alias_count = (uint64_t)alias_count;
+    header.arena_len = alias_arena.len;
+
+    int32_t options[sizeof(shell_options) / sizeof(shell_options[0])];
+    for (uint32_t i = 0; i < header.option_count; i++) options[i] = *shell_options[i].value;
+
+    StringArena hashed = { NULL, 0, 0, 0 };
+    if (cmd_hash_path && cmd_hash_count > 0) {
+        for (int b = 0; b < CMD_HASH_SIZE; b++) {
+            for (CmdHashEntry* entry = cmd_hash[b]; entry; entry = entry->next) {
+                arena_add(&hashed, entry->name);
+                arena_add(&hashed, entry->path);
+                header.hash_count++;
+            }
+        }
+        header.path_len = strlen(cmd_hash_path) + 1;
+    }
+    header.hash_len = hashed.len;
+
+    struct iovec iov[6] = {
+        { &header, sizeof(header) },
+        { options, header.option_count * sizeof(int32_t) },
+        { aliases, alias_capacity * sizeof(Alias) },
+        { alias_arena.data, alias_arena.len },
+        { cmd_hash_path, header.path_len },
+        { hashed.data, hashed.len }
+    };
+    size_t total = 0;
+    for (int i = 0; i < 6; i++) total += iov[i].iov_len;
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%ld", cache_path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        ssize_t written = writev(fd, iov, 6);
+        close(fd);
+        if (written == (ssize_t)total) rename(tmp, cache_path);
+        else unlink(tmp);
+    }
+    free(hashed.data);
+}
+
+/**
+ * Load ~/.ccshrc for an interactive shell
+ * A valid snapshot of the file is restored without reading the text.
+ * Otherwise the file runs as a script, and if every command in it only
+ * changed state the snapshot captures (alias, unalias, set, hash), that
+ * state is saved for the next startup.
+ * @param tokens Token list reused across lines
+ * @param cmds Command list reused across lines
+ */
+void rc_load(TokenList* tokens, CommandList* cmds) {
+    char rc_path[PATH_MAX], cache_path[PATH_MAX];
+    if (rc_paths(rc_path, cache_path, sizeof(rc_path)) != 0) return;
+    int fd = open(rc_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return;
+    }
+    if (rc_snapshot_load(cache_path, &st) == 0) {
+        close(fd);
+        return;
+    }
+
+    rc_cacheable = 1;
+    run_script(fd, tokens, cmds);
+    close(fd);
+    if (rc_cacheable && !exit_requested) rc_snapshot_save(cache_path, &st);
+    rc_cacheable = -1;
+}
+
+/* Tab completion functions */
+
+#if READLINE_LIB
+Completion completion = { { NULL, 0, 0 }, NULL, 0, 0, -1, 0 };
+
+/**
+ * Directory listing a completion reads, in the glob engine's key format
+ * @param dir Directory part of the word, as typed ("" for none)
+ * @param len Length of dir
+ * @return Listing (check its error flag)
+ */
+static DirListing* completion_listing(const char* dir, size_t len) {
+    char path[PATH_MAX];
+    char typed[PATH_MAX];
+    if (len >= sizeof(typed)) len = sizeof(typed) - 1;
+    memcpy(typed, dir, len);
+    typed[len] = '\0';
+    if (typed[0] == '~') {
+        if (expand_tilde(typed, path, sizeof(path)) != 0) snprintf(path, sizeof(path), "%s", typed);
+    } else {
+        snprintf(path, sizeof(path), "%s", typed);
+    }
+    /* Listings are keyed without the trailing slash, except for the root */
+    size_t path_len = strlen(path);
+    while (path_len > 1 && path[path_len - 1] == '/') path[--path_len] = '\0';
+    return dir_cache_get(path);
+}
+
+/**
+ * Add the entries of a listing that complete a name
+ * @param listing Directory listing
+ * @param dir Directory part to put in front of each name
+ * @param dir_len Length of dir
+ * @param name Name prefix being completed
+ * @param commands 1 to take command names (directories are skipped),
+ *                 0 to take paths (directories get a trailing /)
+ */
+static void completion_add_listing(DirListing* listing, const char* dir, size_t dir_len,
+                                   const char* name, int commands) {
+    size_t name_len = strlen(name);
+    for (int i = 0; !listing->error && i < listing->count; i++) {
+        const char* entry = listing->names + listing->offsets[i];
+        if (strncmp(entry, name, name_len) != 0 || (entry[0] == '.' && name[0] != '.')) continue;
+        int is_dir = 0;
+        if (commands) {
+#ifdef DT_DIR
+            if (listing->types[i] == DT_DIR) continue;
+#endif
+        } else {
+            is_dir = glob_entry_is_dir(listing, i, 1);
         }
+        size_t entry_len = strlen(entry);
+        char* match = malloc(dir_len + entry_len + 2);
+        memcpy(match, dir, dir_len);
+        memcpy(match + dir_len, entry, entry_len);
+        match[dir_len + entry_len] = '/';
+        match[dir_len + entry_len + is_dir] = '\0';
+        glob_paths_push(&completion.matches, match);
     }
-    
-    free(files);
-    return 0;
 }
 
 /**
- * Generate prompt with current directory
- * @param prompt Buffer to store the prompt
- * @param prompt_size Size of prompt buffer
+ * Compare two candidates for sorting
  */
-void generate_prompt(char* prompt, size_t prompt_size) {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        /* Try to make the path more readable by shortening home directory */
-        const char* home = getenv("HOME");
-        if (home && strncmp(cwd, home, strlen(home)) == 0) {
-            /* Replace home directory with ~ */
-            snprintf(prompt, prompt_size, "ccsh:~%s> ", cwd + strlen(home));
-        } else {
-            snprintf(prompt, prompt_size, "ccsh:%s> ", cwd);
+static int completion_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Collect every candidate for a word from builtins, aliases, hashed
+ * commands and the listings of the directories involved
+ * @param text Word being completed
+ * @param dir_len Length of its directory part
+ * @param command 1 to complete a command name
+ */
+static void completion_build(const char* text, size_t dir_len, int command) {
+    if (command && dir_len == 0) {
+        size_t len = strlen(text);
+        for (int i = 0; i < BUILTIN_TABLE_SIZE; i++) {
+            const char* name = builtin_table[i].name;
+            if (name && strncmp(name, text, len) == 0) glob_paths_push(&completion.matches, strdup(name));
+        }
+        for (size_t i = 0; i < alias_capacity; i++) {
+            const char* name = alias_arena.data + aliases[i].name;
+            if (aliases[i].used && strncmp(name, text, len) == 0) {
+                glob_paths_push(&completion.matches, strdup(name));
+            }
+        }
+        cmd_hash_check_path();
+        for (int i = 0; i < CMD_HASH_SIZE; i++) {
+            for (CmdHashEntry* entry = cmd_hash[i]; entry; entry = entry->next) {
+                if (strncmp(entry->name, text, len) == 0) glob_paths_push(&completion.matches, strdup(entry->name));
+            }
+        }
+
+        /* Every PATH directory, each listed at most once through the glob cache */
+        const char* path = getenv("PATH");
+        while (path && *path) {
+            const char* colon = strchr(path, ':');
+            size_t part = colon ? (size_t)(colon - path) : strlen(path);
+            DirListing* listing = completion_listing(path, part);  /* Empty means . */
+            completion_add_listing(listing, "", 0, text, 1);
+            path = colon ? colon + 1 : NULL;
         }
     } else {
-        /* Fallback if getcwd fails */
-        snprintf(prompt, prompt_size, "ccsh> ");
+        completion_add_listing(completion_listing(text, dir_len), text, dir_len, text + dir_len, 0);
+    }
+
+    /* Sorted and unique, so readline never has to sort or deduplicate */
+    GlobPaths* matches = &completion.matches;
+    qsort(matches->items, matches->count, sizeof(char*), completion_compare);
+    int kept = 0;
+    for (int i = 0; i < matches->count; i++) {
+        if (kept > 0 && strcmp(matches->items[kept - 1], matches->items[i]) == 0) {
+            free(matches->items[i]);
+        } else {
+            matches->items[kept++] = matches->items[i];
+        }
     }
+    matches->count = kept;
 }
 
 /**
- * Expand tilde (~) to home directory
- * @param path Path that may contain tilde
- * @param expanded Buffer to store expanded path
- * @param expanded_size Size of expanded buffer
- * @return 0 on success, -1 on error
+ * Gather the candidates for a word, reusing the previous ones when the word
+ * only grew within the same directory since the last completion
+ * @param text Word being completed
+ * @param command 1 if the word is in command position
  */
-int expand_tilde(const char* path, char* expanded, size_t expanded_size) {
-    if (!path || !expanded) return -1;
-    
-    if (path[0] == '~') {
-        const char* home = getenv("HOME");
-        if (!home || strlen(home) == 0) {
-            fprintf(stderr, "cd: HOME environment variable not set\n");
-            return -1;
-        }
-        
-        if (path[1] == '\0' || path[1] == '/') {
-            /* ~ or ~/path */
-            if (path[1] == '/') {
-                snprintf(expanded, expanded_size, "%s%s", home, path + 1);
+static void completion_prepare(const char* text, int command) {
+    const char* slash = strrchr(text, '/');
+    size_t dir_len = slash ? (size_t)(slash - text + 1) : 0;
+    command = command && !slash;
+
+    if (completion.text && completion.command == command && completion.batch == glob_batch &&
+        completion.dir_len == dir_len && strncmp(text, completion.text, strlen(completion.text)) == 0 &&
+        strncmp(text, completion.text, dir_len) == 0) {
+        /* Longer prefix: filter what matched the shorter one, without listing again */
+        size_t len = strlen(text);
+        int kept = 0;
+        for (int i = 0; i < completion.matches.count; i++) {
+            if (strncmp(completion.matches.items[i], text, len) == 0) {
+                completion.matches.items[kept++] = completion.matches.items[i];
             } else {
-                snprintf(expanded, expanded_size, "%s", home);
+                free(completion.matches.items[i]);
             }
-        } else {
-            /* ~username - not supported in this simple implementation */
-            fprintf(stderr, "cd: ~username not supported\n");
-            return -1;
         }
+        completion.matches.count = kept;
     } else {
-        /* No tilde, copy as-is */
-        strncpy(expanded, path, expanded_size - 1);
-        expanded[expanded_size - 1] = '\0';
+        glob_paths_free(&completion.matches);
+        completion_build(text, dir_len, command);
     }
-    
-    return 0;
+
+    free(completion.text);
+    completion.text = strdup(text);
+    completion.dir_len = dir_len;
+    completion.command = command;
+    completion.batch = glob_batch;
+    completion.next = 0;
 }
 
 /**
- * Display help information about shell features
+ * Readline generator handing out the prepared candidates one at a time
+ * @param text Word being completed (unused; candidates are already filtered)
+ * @param state 0 on the first call for a completion
+ * @return Next candidate (readline frees it), or NULL when done
  */
-void print_help() {
-    printf("ccsh - Compact C Shell\n");
-    printf("Supported features:\n");
-    printf("  Built-in commands: cd, pwd, exit, help, fg, jobs, alias, unalias, path, which, grep\n");
-    printf("  Tilde expansion: ~ expands to home directory (e.g., cd ~, cd ~/Documents)\n");
-    printf("  Dynamic prompt: Shows current directory in prompt (e.g., ccsh:~> ccsh:/usr/bin>)\n");
-    printf("  External programs: All programs in PATH (e.g., sudo, ls, cat, etc.)\n");
-    printf("  I/O Redirection: < (input), > (output), >> (append)\n");
-    printf("  Background jobs: & (with fg and jobs to control)\n");
-    printf("  Globbing: *, ? (filename pattern matching)\n");
-    printf("  Aliases: alias name='value', unalias name\n");
-    printf("  Command history with arrow keys (if readline available)\n");
-    printf("  Signal handling: Ctrl+C to interrupt\n");
-    printf("\nExamples:\n");
-    printf("  path                    - Show PATH environment variable\n");
-    printf("  which ls                - Find location of ls command\n");
-    printf("  which sudo              - Find location of sudo command\n");
-    printf("  cd ~                    - Change to home directory\n");
-    printf("  cd ~/Documents          - Change to Documents in home directory\n");
-    printf("  sudo ls -la             - Run sudo with arguments\n");
-    printf("  ls *.txt > files.txt   - Redirect output to file\n");
-    printf("  sleep 10 &             - Run command in background\n");
-    printf("  grep pattern file.txt   - Search for pattern in file\n");
-    printf("  grep -i -n hello *.txt - Case-insensitive search with line numbers\n");
+static char* completion_generator(const char* text, int state) {
+    (void)text;
+    if (state == 0) completion.next = 0;
+    if (completion.next >= completion.matches.count) return NULL;
+    return strdup(completion.matches.items[completion.next++]);
 }
 
 /**
- * Main shell loop
- * Handles command input, parsing, and execution
+ * Readline completion entry point: command names in command position,
+ * paths everywhere else; never falls back to readline's own file scan
+ * @param text Word being completed
+ * @param start Offset of the word in rl_line_buffer
+ * @param end Offset just past the word
+ * @return Matches for readline, or NULL if there are none
  */
-int main() {
-    /* Set up signal handler for Ctrl+C */
-    signal(SIGINT, sigint_handler);
+char** shell_completion(const char* text, int start, int end) {
+    (void)end;
+    int pos = start;
+    while (pos > 0 && (rl_line_buffer[pos - 1] == ' ' || rl_line_buffer[pos - 1] == '\t')) pos--;
+    int command = pos == 0 || strchr("|;&", rl_line_buffer[pos - 1]) != NULL;
+
+    completion_prepare(text, command);
+    rl_attempted_completion_over = 1;
+    /* Paths are shown by their last component and quoted when they need it */
+    rl_filename_completion_desired = !completion.command;
+    rl_filename_quoting_desired = 1;
+    return rl_completion_matches(text, completion_generator);
+}
+#endif
+
+/* Interactive loop functions */
+
+#if READLINE_LIB
+char* repl_line = NULL;  /* Line completed by readline's callback */
+int repl_line_ready = 0; /* repl_line is waiting to be run (NULL at EOF) */
+
+/**
+ * Readline callback: take a completed line and stop editing until it has run
+ * @param line Entered line (caller frees), or NULL at EOF
+ */
+void repl_line_handler(char* line) {
+    repl_line = line;
+    repl_line_ready = 1;
+    rl_callback_handler_remove();
+}
+#else
+char* repl_input = NULL;   /* Bytes read from the terminal, not yet run */
+size_t repl_input_len = 0;
+size_t repl_input_cap = 0;
+int repl_input_eof = 0;    /* The terminal reported end of input */
+
+/**
+ * Read what the terminal has available into the input buffer
+ */
+void repl_read_input() {
+    if (repl_input_len + 4096 > repl_input_cap) {
+        repl_input_cap = (repl_input_len + 4096) * 2;
+        repl_input = realloc(repl_input, repl_input_cap);
+    }
+    ssize_t n = read(STDIN_FILENO, repl_input + repl_input_len, repl_input_cap - repl_input_len);
+    if (n > 0) {
+        repl_input_len += (size_t)n;
+    } else if (n == 0 || errno != EINTR) {
+        repl_input_eof = 1;
+    }
+}
+#endif
 
-    /* Load command history if readline is available */
+/**
+ * Take the next complete line entered at the prompt
+ * @param line Set to the line (caller frees)
+ * @return 1 if a line was taken, 0 if none is complete yet, -1 at EOF
+ */
+int repl_take_line(char** line) {
     #if READLINE_LIB
-    read_history(".ccsh_history");
+    if (!repl_line_ready) return 0;
+    repl_line_ready = 0;
+    *line = repl_line;
+    repl_line = NULL;
+    return *line ? 1 : -1;
+    #else
+    char* nl = memchr(repl_input, '\n', repl_input_len);
+    if (!nl && !(repl_input_eof && repl_input_len > 0)) return repl_input_eof ? -1 : 0;
+    size_t len = nl ? (size_t)(nl - repl_input) : repl_input_len;
+    *line = strndup(repl_input, len);
+    size_t used = nl ? len + 1 : len;
+    memmove(repl_input, repl_input + used, repl_input_len - used);
+    repl_input_len -= used;
+    return 1;
     #endif
+}
 
-    char* line;
-    char prompt[1024];
-    while (1) {
-        /* Generate dynamic prompt with current directory */
-        generate_prompt(prompt, sizeof(prompt));
-        
-        /* Get command line input */
+/**
+ * Drain the signal self-pipe, handling what does not depend on the line
+ * Ctrl+C is left to the caller through sigint_pending
+ */
+void repl_drain_signals() {
+    char signals[16];
+    ssize_t n;
+    while ((n = read(signal_pipe[0], signals, sizeof(signals))) > 0) {
         #if READLINE_LIB
-        line = readline(prompt);
-        if (line == NULL) {
-            /* EOF or readline error - exit gracefully */
-            printf("\n");
-            break;
+        for (ssize_t i = 0; i < n; i++) {
+            if (signals[i] == SIGWINCH) rl_resize_terminal();
         }
-        #else
-        static char buffer[1024];
-        printf("%s", prompt);
-        if (!fgets(buffer, sizeof(buffer), stdin)) break;
-        buffer[strcspn(buffer, "\n")] = 0;  /* Remove newline */
-        line = strdup(buffer);
         #endif
+    }
+}
 
-        /* Handle empty input */
-        if (!line || !*line) {
-            free(line);
-            continue;
-        }
-        
-        /* Add to history and check background jobs */
-        #if READLINE_LIB
-        add_history(line);
-        #endif
-        check_background_jobs();
+/**
+ * Report finished jobs first, then show the prompt for the next line
+ */
+void repl_prompt() {
+    /* Ctrl+C during the last command, or a job killed by it, only needs a new line */
+    repl_drain_signals();
+    if (sigint_pending || last_status == 128 + SIGINT) putchar('\n');
+    sigint_pending = 0;
 
-        /* Expand aliases in command line */
-        char expanded_line[2048];
-        expand_alias(line, expanded_line, sizeof(expanded_line));
+    check_background_jobs();
 
-        /* Parse command into arguments and handle redirection */
-        int background = 0, append = 0;
-        char *infile = NULL, *outfile = NULL;
-        char* args[MAX_TOKENS];
-        parse_command(expanded_line, args, &background, &infile, &outfile, &append);
+    /* Dynamic prompt with current directory, cached until the next cd */
+    const char* prompt = generate_prompt();
+    trace_flush();  /* Nothing is lost while the shell sits at the prompt */
+    fflush(stdout);
+    #if READLINE_LIB
+    rl_callback_handler_install(prompt, repl_line_handler);
+    #else
+    fputs(prompt, stdout);
+    fflush(stdout);
+    #endif
+}
 
-        /* Skip if no command */
-        if (!args[0]) {
-            free(line);
-            continue;
-        }
+/**
+ * Print job notices while a line is being edited
+ * The line is cleared, the notices written and the prompt and line redrawn
+ */
+void repl_report_jobs() {
+    reap_children();
+    if (!jobs_have_notice()) return;
 
-        /* Handle built-in commands */
+    #if READLINE_LIB
+    rl_clear_visible_line();
+    check_background_jobs();
+    fflush(stdout);
+    rl_forced_update_display();
+    #else
+    putchar('\n');
+    check_background_jobs();
+    fputs(generate_prompt(), stdout);
+    fflush(stdout);
+    #endif
+}
 
-        /* Exit command */
-        if (strcmp(args[0], "exit") == 0) break;
-        
-        /* Change directory */
-        if (strcmp(args[0], "cd") == 0) {
-            char expanded_path[1024];
-            const char* target = args[1] ? args[1] : "~";
-            
-            if (expand_tilde(target, expanded_path, sizeof(expanded_path)) == 0) {
-                if (chdir(expanded_path) != 0) {
-                    perror("cd");
-                }
-            }
-            free(line);
-            continue;
-        }
-        
-        /* Print working directory */
-        if (strcmp(args[0], "pwd") == 0) {
-            char cwd[1024];
-            if (getcwd(cwd, sizeof(cwd))) printf("%s\n", cwd);
-            else perror("pwd");
-            free(line);
-            continue;
-        }
-        
-        /* List background jobs */
-        if (strcmp(args[0], "jobs") == 0) {
-            list_jobs();
-            free(line);
-            continue;
-        }
-        
-        /* Bring job to foreground */
-        if (strcmp(args[0], "fg") == 0 && args[1]) {
-            int job_id = atoi(args[1]);
-            if (job_id >= 0 && job_id < job_count) {
-                int status;
-                waitpid(jobs[job_id].pid, &status, 0);
-                /* Remove the job from the list after completion */
-                for (int j = job_id; j < job_count - 1; j++) {
-                    jobs[j] = jobs[j + 1];
-                }
-                job_count--;
-            } else {
-                fprintf(stderr, "Invalid job ID: %s\n", args[1]);
-            }
-            free(line);
-            continue;
-        }
-        
-        /* Alias management */
-        if (strcmp(args[0], "alias") == 0) {
-            if (!args[1]) {
-                /* List all aliases */
-                for (int i = 0; i < alias_count; i++) {
-                    printf("alias %s='%s'\n", aliases[i].name, aliases[i].value);
-                }
-            } else {
-                /* Add new alias */
-                char* eq = strchr(args[1], '=');
-                if (eq && eq > args[1]) {
-                    *eq = '\0';
-                    char* name = args[1];
-                    char* value = eq + 1;
-                    /* Remove quotes if present */
-                    if (*value == '\'' || *value == '"') {
-                        value++;
-                        size_t len = strlen(value);
-                        if (len > 0 && (value[len-1] == '\'' || value[len-1] == '"')) {
-                            value[len-1] = '\0';
-                        }
-                    }
-                    add_alias(name, value);
-                } else {
-                    fprintf(stderr, "Usage: alias name='value'\n");
-                }
-            }
-            free(line);
-            continue;
+/**
+ * Handle Ctrl+C at the prompt: drop the line being edited and start over
+ */
+void repl_interrupt() {
+    #if READLINE_LIB
+    rl_callback_sigcleanup();
+    rl_replace_line("", 0);
+    rl_point = rl_mark = 0;
+    fputs(SIGINT_NOTICE, stdout);
+    fflush(stdout);
+    rl_on_new_line();
+    rl_redisplay();
+    #else
+    repl_input_len = 0;
+    fputs(SIGINT_NOTICE, stdout);
+    fputs(generate_prompt(), stdout);
+    fflush(stdout);
+    #endif
+}
+
+/**
+ * Wait for the next event and service it
+ * The terminal, the signal self-pipe and the SIGCHLD self-pipe share one
+ * poll, so Ctrl+C and finished jobs are handled while a line is typed
+ */
+void repl_wait() {
+    struct pollfd fds[3];
+    fds[0].fd = STDIN_FILENO;
+    fds[1].fd = signal_pipe[0];
+    fds[2].fd = sigchld_pipe[0];  /* -1 (ignored) until the first background job */
+    for (int i = 0; i < 3; i++) fds[i].events = POLLIN;
+    if (poll(fds, 3, -1) == -1) {
+        if (errno != EINTR) perror("poll");
+        return;
+    }
+
+    if (fds[1].revents & POLLIN) {
+        repl_drain_signals();
+        if (sigint_pending) {
+            sigint_pending = 0;
+            repl_interrupt();
         }
-        
-        /* Remove alias */
-        if (strcmp(args[0], "unalias") == 0) {
-            if (!args[1]) {
-                fprintf(stderr, "Usage: unalias name\n");
-            } else {
-                remove_alias(args[1]);
-            }
-            free(line);
-            continue;
+    }
+    if (fds[2].revents & POLLIN) repl_report_jobs();
+    if (fds[0].revents) {
+        #if READLINE_LIB
+        rl_callback_read_char();  /* Calls repl_line_handler once a line is complete */
+        #else
+        repl_read_input();
+        #endif
+    }
+}
+
+/**
+ * Read and run commands from the terminal until exit or EOF
+ * Readline runs through its callback interface, so the shell never blocks
+ * inside it and services signals and job notices as they arrive
+ * @param tokens Token list reused across lines
+ * @param cmds Command list reused across lines
+ */
+void repl_run(TokenList* tokens, CommandList* cmds) {
+    if (pipe(signal_pipe) == 0) {
+        for (int i = 0; i < 2; i++) {
+            set_cloexec(signal_pipe[i]);
+            fcntl(signal_pipe[i], F_SETFL, fcntl(signal_pipe[i], F_GETFL) | O_NONBLOCK);
         }
-        
-        /* Help command */
-        if (strcmp(args[0], "help") == 0) {
-            print_help();
-            free(line);
+    } else {
+        signal_pipe[0] = signal_pipe[1] = -1;
+    }
+
+    #if READLINE_LIB
+    /* Signals reach the loop through the self-pipe, not readline's handlers */
+    rl_catch_signals = 0;
+    rl_catch_sigwinch = 0;
+    rl_attempted_completion_function = shell_completion;
+    rl_sort_completion_matches = 0;  /* Candidates arrive sorted and unique */
+    rl_completer_quote_characters = "'\"";
+    rl_variable_bind("mark-directories", "off");  /* Directory candidates already end in / */
+    rl_filename_quote_characters = " \t\n\\\"'|&;<>()$*?[]{}";
+    if (signal_pipe[0] != -1) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = signal_forward_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, NULL);
+    }
+    #endif
+
+    repl_prompt();
+    while (1) {
+        char* line = NULL;
+        int taken = repl_take_line(&line);
+        if (taken == 0) {
+            repl_wait();
             continue;
         }
-        
-        /* Show PATH environment variable */
-        if (strcmp(args[0], "path") == 0) {
-            const char* path = getenv("PATH");
-            if (path) {
-                printf("PATH=%s\n", path);
-            } else {
-                printf("PATH environment variable not set\n");
-            }
-            free(line);
-            continue;
+        if (taken < 0) {
+            /* EOF or readline error - exit gracefully */
+            printf("\n");
+            break;
         }
-        
-        /* Which command - find executable in PATH */
-        if (strcmp(args[0], "which") == 0) {
-            if (!args[1]) {
-                fprintf(stderr, "Usage: which <command>\n");
-                free(line);
-                continue;
-            }
-            
-            const char* path_env = getenv("PATH");
-            if (!path_env) {
-                fprintf(stderr, "PATH environment variable not set\n");
-                free(line);
-                continue;
-            }
-            
-            char* path_copy = strdup(path_env);
-            char* dir = strtok(path_copy, ":");
-            int found = 0;
-            
-            while (dir != NULL) {
-                char full_path[1024];
-                snprintf(full_path, sizeof(full_path), "%s/%s", dir, args[1]);
-                
-                if (access(full_path, X_OK) == 0) {
-                    printf("%s\n", full_path);
-                    found = 1;
-                    break;
-                }
-                
-                dir = strtok(NULL, ":");
-            }
-            
-            if (!found) {
-                fprintf(stderr, "which: %s not found\n", args[1]);
-            }
-            
-            free(path_copy);
-            free(line);
-            continue;
+
+        /* Handle empty input */
+        int done = 0;
+        if (*line) {
+            history_add(line);
+            done = run_line(tokens, cmds, line);
         }
-        
-        /* Built-in grep command */
-        if (strcmp(args[0], "grep") == 0) {
-            builtin_grep(args);
-            free(line);
-            continue;
+        free(line);
+        if (done) break;
+        repl_prompt();
+    }
+    #if READLINE_LIB
+    rl_callback_handler_remove();
+    #endif
+}
+
+/* Library interface functions (see ccsh.h) */
+
+struct CcshParser {
+    TokenList tokens;    /* Tokens of the last line */
+    CommandList cmds;    /* Pipelines and stages of the last line */
+    ArgvArena argv;      /* Arguments of the last expanded stage */
+};
+
+CcshParser* ccsh_parser_new(void) {
+    CcshParser* parser = calloc(1, sizeof(CcshParser));
+    if (!parser) return NULL;
+    token_list_init(&parser->tokens);
+    command_list_init(&parser->cmds);
+    return parser;
+}
+
+void ccsh_parser_free(CcshParser* parser) {
+    if (!parser) return;
+    token_list_free(&parser->tokens);
+    command_list_free(&parser->cmds);
+    argv_arena_free(&parser->argv);
+    free(parser);
+}
+
+int ccsh_parse(CcshParser* parser, const char* line) {
+    glob_begin(1);
+    parser->cmds.count = 0;
+    parser->cmds.stage_count = 0;
+    if (tokenize(&parser->tokens, line) != 0 || expand_alias(&parser->tokens) != 0 ||
+        parse_list(&parser->tokens, &parser->cmds) != 0) {
+        parser->cmds.count = 0;
+        parser->cmds.stage_count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int ccsh_pipeline_count(const CcshParser* parser) {
+    return parser->cmds.count;
+}
+
+int ccsh_stage_count(const CcshParser* parser) {
+    return parser->cmds.stage_count;
+}
+
+char** ccsh_stage_argv(const CcshParser* parser, int stage) {
+    return parser->cmds.stages[stage].args;
+}
+
+char** ccsh_expand_stage(CcshParser* parser, int stage) {
+    const Stage* s = &parser->cmds.stages[stage];
+    if (expand_globs(s->args, s->glob, &parser->argv) != 0) return NULL;
+    return parser->argv.argv;
+}
+
+void ccsh_alias_set(const char* name, const char* value) {
+    add_alias(name, value);
+}
+
+void ccsh_alias_unset(const char* name) {
+    remove_alias(name);
+}
+
+int ccsh_glob_match(const char* pattern, const char* name) {
+    return glob_match(pattern, name);
+}
+
+#ifndef CCSH_LIBRARY
+/**
+ * Main shell loop
+ * Handles command input, parsing, and execution; with -c or a script file
+ * (or when stdin is not a terminal) commands run without prompts or history
+ * @param argc Argument count
+ * @param argv Arguments: [-c command | script]
+ */
+int main(int argc, char** argv) {
+    const char* command = NULL;
+    const char* script = NULL;
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "ccsh: -c: option requires an argument\n");
+            return 2;
         }
+        command = argv[2];
+    } else if (argc > 1) {
+        script = argv[1];
+    }
 
-        /* Expand glob patterns in arguments */
-        char* expanded[MAX_TOKENS];
-        int expanded_count;
-        expand_globs(args, expanded, &expanded_count);
-
-        /* Execute external command */
-        pid_t pid = fork();
-        if (pid == 0) {
-            /* Child process */
-            signal(SIGINT, SIG_DFL);  /* Reset signal handler for child */
-            
-            /* Handle input redirection */
-            if (infile) {
-                int fd = open(infile, O_RDONLY);
-                if (fd == -1) { 
-                    perror("input"); 
-                    exit(1); 
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            }
-            
-            /* Handle output redirection */
-            if (outfile) {
-                int flags = O_WRONLY | O_CREAT;
-                if (append) flags |= O_APPEND;
-                else flags |= O_TRUNC;
-                
-                int fd = open(outfile, flags, 0644);
-                if (fd == -1) { 
-                    perror("output"); 
-                    exit(1); 
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            }
-            
-            /* Execute command */
-            if (execvp(expanded[0], expanded) == -1) {
-                perror("execvp");
-                exit(1);
-            }
-        } else if (pid > 0) {
-            /* Parent process */
-            if (background) {
-                /* Background job */
-                printf("[%d] %d\n", job_count, pid);
-                add_job(pid, line);
-            } else {
-                /* Foreground job - wait for completion */
-                int status;
-                waitpid(pid, &status, 0);
+    /* Allow the launch engine to be chosen from the environment for A/B runs */
+    const char* spawn_env = getenv("CCSH_SPAWN");
+    if (spawn_env) opt_spawn = strcmp(spawn_env, "0") != 0;
+    trace_init();
+
+    TokenList tokens;  /* Reused for every line */
+    CommandList cmds;
+    token_list_init(&tokens);
+    command_list_init(&cmds);
+
+    /* Non-interactive modes: no readline, prompt or history */
+    if (command) {
+        run_line(&tokens, &cmds, command);
+        trace_flush();
+        token_list_free(&tokens);
+        command_list_free(&cmds);
+        return last_status;
+    }
+    if (script || !isatty(STDIN_FILENO)) {
+        int fd = STDIN_FILENO;
+        if (script) {
+            fd = open(script, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                fprintf(stderr, "ccsh: %s: %s\n", script, strerror(errno));
+                token_list_free(&tokens);
+                command_list_free(&cmds);
+                return 127;
             }
-        } else {
-            /* Fork failed */
-            perror("fork");
         }
+        run_script(fd, &tokens, &cmds);
+        if (script) close(fd);
+        trace_flush();
+        token_list_free(&tokens);
+        command_list_free(&cmds);
+        return last_status;
+    }
 
-        free(line);
+    /* Set up signal handler for Ctrl+C */
+    interactive = 1;
+    cwd_refresh();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;  /* No SA_RESTART: blocking builtins return to check the flag */
+    sigaction(SIGINT, &sa, NULL);
+
+    /* Give each pipeline its own process group when we own the terminal */
+    if (tcgetpgrp(STDIN_FILENO) == getpgrp()) {
+        job_control = 1;
+        shell_pgid = getpgrp();
+        tcgetattr(STDIN_FILENO, &shell_tmodes);
+        signal(SIGTSTP, SIG_IGN);  /* Ctrl+Z stops the foreground job, not the shell */
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);  /* Allow taking the terminal back */
     }
 
-    /* Save command history before exiting */
-    #if READLINE_LIB
-    write_history(".ccsh_history");
-    #endif
+    /* Aliases and settings from ~/.ccshrc (or its snapshot) */
+    rc_load(&tokens, &cmds);
 
-    return 0;
+    /* Load the tail of the history file */
+    history_init();
+    history_load();
+
+    repl_run(&tokens, &cmds);
+
+    /* Entries were appended as they were entered */
+    if (history_fd != -1) close(history_fd);
+    trace_flush();
+
+    token_list_free(&tokens);
+    command_list_free(&cmds);
+    return last_status;
 }
+#endif /* CCSH_LIBRARY */
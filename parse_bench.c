@@ -0,0 +1,129 @@
+/*
+ * parse_bench.c - Microbenchmark of the ccsh parse path
+ *
+ * Runs a fixed mix of command lines through lexing, alias expansion,
+ * parsing and argument expansion (libccsh) and reports the time and the
+ * number of heap allocations per line, as JSON lines like bench.sh.
+ *
+ * Usage: parse_bench [lines]   (default: 1000000)
+ */
+
+#include <stdio.h>      /* Result output: printf */
+#include <stdlib.h>     /* atol */
+#include <stdint.h>     /* Fixed-width integers: uint64_t */
+#include <time.h>       /* Monotonic clock: clock_gettime */
+#include "ccsh.h"       /* Parser under test */
+
+/* Allocation counting: glibc lets the program replace malloc and friends */
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static unsigned long alloc_count = 0;
+
+void* malloc(size_t size) {
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    alloc_count++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+#define ALLOCATIONS() ((long)alloc_count)
+#else
+#define ALLOCATIONS() (-1L)  /* Not measurable without glibc */
+#endif
+
+/* Representative interactive and script lines; none of them touch the disk */
+static const char* lines[] = {
+    "ls -la",
+    "ll",
+    "gs && gd | less",
+    "cat access.log | grep -v DEBUG | sort | uniq -c | sort -rn | head -20",
+    "make -j8 > build.log 2>/dev/null; echo done",
+    "echo 'single quoted | not a pipe' \"double $HOME\" plain\\ escaped",
+    "false || echo recovered && echo chained",
+    "sleep 10 &",
+    "cd ~/src/project",
+    "git commit -m \"fix: handle the empty case\"",
+    "time parallel -j 4 gzip {} ::: a.log b.log c.log",
+    "la | wc -l",
+};
+
+/**
+ * Monotonic clock reading
+ * @return Nanoseconds since an arbitrary fixed point
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Run the benchmark
+ * @param argc Argument count
+ * @param argv Arguments: [lines]
+ * @return 0 on success, 1 if a line failed to parse
+ */
+int main(int argc, char** argv) {
+    long total = argc > 1 ? atol(argv[1]) : 1000000;
+    if (total <= 0) total = 1000000;
+    int count = (int)(sizeof(lines) / sizeof(lines[0]));
+
+    /* A typical alias set, padded out so lookups hit a realistically sized table */
+    ccsh_alias_set("ll", "ls -l");
+    ccsh_alias_set("la", "ls -A");
+    ccsh_alias_set("gs", "git status");
+    ccsh_alias_set("gd", "git diff");
+    char name[16], value[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "alias%d", i);
+        snprintf(value, sizeof(value), "echo %d", i);
+        ccsh_alias_set(name, value);
+    }
+
+    CcshParser* parser = ccsh_parser_new();
+    if (!parser) return 1;
+
+    /* Warm up so buffers have reached their final size */
+    for (int i = 0; i < count; i++) ccsh_parse(parser, lines[i]);
+
+    long allocs_before = ALLOCATIONS();
+    uint64_t start = now_ns();
+    long stages = 0;
+    for (long n = 0; n < total; n++) {
+        if (ccsh_parse(parser, lines[n % count]) != 0) {
+            fprintf(stderr, "parse_bench: failed to parse: %s\n", lines[n % count]);
+            return 1;
+        }
+        int stage_count = ccsh_stage_count(parser);
+        for (int s = 0; s < stage_count; s++) ccsh_expand_stage(parser, s);
+        stages += stage_count;
+    }
+    uint64_t elapsed = now_ns() - start;
+    long allocs = ALLOCATIONS() - allocs_before;
+
+    printf("{\"bench\":\"parse_ns_per_line\",\"value\":%.1f,\"unit\":\"ns\"}\n", (double)elapsed / total);
+    if (allocs_before >= 0) {
+        printf("{\"bench\":\"parse_allocs_per_line\",\"value\":%.3f,\"unit\":\"allocs\"}\n",
+               (double)allocs / total);
+    }
+    printf("{\"bench\":\"parse_stages_per_line\",\"value\":%.3f,\"unit\":\"stages\"}\n",
+           (double)stages / total);
+
+    ccsh_parser_free(parser);
+    return 0;
+}
@@ -6,11 +6,31 @@ echo "Testing ccsh..."
 ./ccsh <<'EOF'
 echo hello > test.txt
 cat < test.txt
+set +o spawn
+cat < test.txt
+set -o spawn
 ls *.txt
+echo {test,none}.t[x]t
+cat test.txt | tr a-z A-Z | cat
+grep hello test.txt > grep.txt
+cat grep.txt
+time echo timed | cat
 alias ll="ls"
 ll
+echo 'a  b' "c|d" e\ f '*.txt'
+[ "$(echo "*".txt \{test,none\}.t*)" = "*.txt {test,none}.t*" ] && echo quoted globs kept || echo quoted glob FAILED
+X="sub  stituted"
+echo $X "$X" '$X' $(grep -c hello test.txt) "$(echo pipe | tr a-z A-Z)"
+[ "$(grep '' test.txt)" = hello ] && echo grep captured || echo grep capture FAILED
+grep -E '\bhello' test.txt; [ $? = 2 ] && echo escape rejected || echo escape check FAILED
+false && echo skipped || echo recovered; echo done
 sleep 1 &
 jobs
+wait -n && wait
+parallel -j 2 echo item-{} ::: a b c
+which ls
+hash
+hash -r
 help
 exit
 EOF